@@ -4,6 +4,8 @@
  */
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
-// Maximum payload size with jumbo frames on DAS6 network.
+// Maximum payload size with jumbo frames on DAS6 network. The raw and FPGA
+// implementations always send this size, the ibverbs endpoints use it as an
+// upper bound for their default message size (see rdma_options).
 #define MSG_SIZE 8940
 #endif
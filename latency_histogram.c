@@ -0,0 +1,104 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#include <string.h>
+
+#include "latency_histogram.h"
+
+static unsigned
+bucket_index(uint64_t value)
+{
+    if (value < LATENCY_HISTOGRAM_SUB_BUCKETS) return value;
+
+    unsigned exponent = 63 - __builtin_clzll(value);
+    unsigned shift = exponent - LATENCY_HISTOGRAM_SUB_BITS;
+    unsigned sub_bucket = (value >> shift) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+static uint64_t
+bucket_upper_bound(unsigned index)
+{
+    if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) return index;
+
+    unsigned shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % LATENCY_HISTOGRAM_SUB_BUCKETS;
+    uint64_t lower = (LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+void
+latency_histogram_reset(struct latency_histogram *histogram)
+{
+    memset(histogram, 0, sizeof *histogram);
+    histogram->min = UINT64_MAX;
+}
+
+void
+latency_histogram_record(struct latency_histogram *histogram, uint64_t value)
+{
+    histogram->buckets[bucket_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+void
+latency_histogram_merge
+(struct latency_histogram *histogram, const struct latency_histogram *other)
+{
+    for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        histogram->buckets[i] += other->buckets[i];
+    }
+
+    histogram->count += other->count;
+    histogram->sum += other->sum;
+    if (other->min < histogram->min) histogram->min = other->min;
+    if (other->max > histogram->max) histogram->max = other->max;
+}
+
+uint64_t
+latency_histogram_percentile
+(const struct latency_histogram *histogram, double percentile)
+{
+    uint64_t target = histogram->count * percentile / 100;
+    uint64_t seen = 0;
+
+    if (!histogram->count) return 0;
+    if (target >= histogram->count) return histogram->max;
+
+    for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > target) {
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void
+latency_histogram_print
+(const struct latency_histogram *histogram, FILE *out, const char *name)
+{
+    if (!histogram->count) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(out, "%s: %lu samples, min %.3f us, mean %.3f us, p50 %.3f us, "
+            "p90 %.3f us, p99 %.3f us, p99.9 %.3f us, max %.3f us\n",
+            name, histogram->count,
+            histogram->min / 1e3,
+            (double) histogram->sum / histogram->count / 1e3,
+            latency_histogram_percentile(histogram, 50) / 1e3,
+            latency_histogram_percentile(histogram, 90) / 1e3,
+            latency_histogram_percentile(histogram, 99) / 1e3,
+            latency_histogram_percentile(histogram, 99.9) / 1e3,
+            histogram->max / 1e3);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-linear histogram: every power of two range is split into
+// LATENCY_HISTOGRAM_SUB_BUCKETS linear buckets, giving a relative error of at
+// most 1/16th over the full range of 64-bit values. Values below
+// LATENCY_HISTOGRAM_SUB_BUCKETS get a bucket of their own.
+#define LATENCY_HISTOGRAM_SUB_BITS 4
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_BUCKETS \
+    ((64 - LATENCY_HISTOGRAM_SUB_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+struct latency_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+void latency_histogram_reset(struct latency_histogram *histogram);
+
+void latency_histogram_record(struct latency_histogram *histogram, uint64_t value);
+
+void
+latency_histogram_merge
+(struct latency_histogram *histogram, const struct latency_histogram *other);
+
+// Upper bound of the bucket containing the given percentile (0-100)
+uint64_t
+latency_histogram_percentile
+(const struct latency_histogram *histogram, double percentile);
+
+// Print count, mean, and percentiles, treating the values as nanoseconds
+void
+latency_histogram_print
+(const struct latency_histogram *histogram, FILE *out, const char *name);
+#endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mr_cache.h"
+
+struct mr_cache_entry {
+    // Page aligned range covered by the memory region
+    uintptr_t start;
+    uintptr_t end;
+    struct ibv_mr *mr;
+    int refs;
+    // Removed from the map, deregistered once the last reference is released
+    bool retired;
+    // Least recently used list, most recently used first
+    struct mr_cache_entry *prev;
+    struct mr_cache_entry *next;
+};
+
+struct mr_cache {
+    struct ibv_pd *protection_domain;
+    uintptr_t page_size;
+    int max_entries;
+    size_t max_bytes;
+
+    // Entries sorted by start address, non-overlapping. Has room for one
+    // entry beyond 'max_entries', which is evicted right after insertion.
+    struct mr_cache_entry **map;
+    int num_entries;
+    struct mr_cache_entry *lru_head;
+    struct mr_cache_entry *lru_tail;
+
+    struct mr_cache_stats stats;
+};
+
+static void
+deregister(struct mr_cache_entry *entry)
+{
+    if (ibv_dereg_mr(entry->mr)) {
+        fprintf(stderr, "Couldn't destroy memory region.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(entry);
+}
+
+static void
+lru_unlink(struct mr_cache *cache, struct mr_cache_entry *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->lru_tail = entry->prev;
+}
+
+static void
+lru_push(struct mr_cache *cache, struct mr_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->prev = entry;
+    else cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+// Index of the last entry starting at or before 'addr', -1 if there is none
+static int
+map_find(const struct mr_cache *cache, uintptr_t addr)
+{
+    int low = 0, high = cache->num_entries;
+
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (cache->map[middle]->start <= addr) low = middle + 1;
+        else high = middle;
+    }
+
+    return low - 1;
+}
+
+// Take the entry at 'index' out of the map, deregistering it unless it's
+// still referenced.
+static void
+map_remove(struct mr_cache *cache, int index)
+{
+    struct mr_cache_entry *entry = cache->map[index];
+
+    memmove(&cache->map[index], &cache->map[index + 1],
+            (cache->num_entries - index - 1) * (sizeof *cache->map));
+    cache->num_entries--;
+    cache->stats.bytes -= entry->end - entry->start;
+    lru_unlink(cache, entry);
+
+    entry->retired = true;
+    if (!entry->refs) deregister(entry);
+}
+
+struct mr_cache *
+mr_cache_create(struct ibv_pd *protection_domain, int max_entries, size_t max_bytes)
+{
+    struct mr_cache *cache = calloc(1, sizeof *cache);
+    if (!cache) {
+        fprintf(stderr, "Couldn't allocate registration cache.\n");
+        return NULL;
+    }
+
+    cache->protection_domain = protection_domain;
+    cache->page_size = sysconf(_SC_PAGESIZE);
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    cache->max_bytes = max_bytes;
+    cache->map = malloc((cache->max_entries + 1) * (sizeof *cache->map));
+    if (!cache->map) {
+        fprintf(stderr, "Couldn't allocate registration cache.\n");
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+struct mr_cache_entry *
+mr_cache_acquire(struct mr_cache *cache, const void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t) addr & ~(cache->page_size - 1);
+    uintptr_t end = ((uintptr_t) addr + length + cache->page_size - 1) & ~(cache->page_size - 1);
+
+    int index = map_find(cache, start);
+    if (index >= 0 && cache->map[index]->end >= end) {
+        struct mr_cache_entry *entry = cache->map[index];
+        if (cache->lru_head != entry) {
+            lru_unlink(cache, entry);
+            lru_push(cache, entry);
+        }
+        entry->refs++;
+        cache->stats.hits++;
+        return entry;
+    }
+
+    // Register the union with every entry the range overlaps, entries
+    // 'first' up to 'last'
+    int first = index >= 0 && cache->map[index]->end > start ? index : index + 1;
+    int last = first;
+    while (last < cache->num_entries && cache->map[last]->start < end) last++;
+
+    if (last > first) {
+        if (cache->map[first]->start < start) start = cache->map[first]->start;
+        if (cache->map[last - 1]->end > end) end = cache->map[last - 1]->end;
+    }
+
+    struct mr_cache_entry *entry = calloc(1, sizeof *entry);
+    if (!entry) {
+        fprintf(stderr, "Couldn't allocate registration cache entry.\n");
+        return NULL;
+    }
+
+    // Send buffers are only read by the NIC
+    entry->mr = ibv_reg_mr(cache->protection_domain, (void *) start, end - start, 0);
+    if (!entry->mr) {
+        fprintf(stderr, "Couldn't register %zu bytes at %p\n", (size_t) (end - start),
+                (void *) start);
+        free(entry);
+        return NULL;
+    }
+    entry->start = start;
+    entry->end = end;
+    entry->refs = 1;
+    cache->stats.misses++;
+
+    for (int i = last - 1; i >= first; i--) map_remove(cache, i);
+
+    memmove(&cache->map[first + 1], &cache->map[first],
+            (cache->num_entries - first) * (sizeof *cache->map));
+    cache->map[first] = entry;
+    cache->num_entries++;
+    cache->stats.bytes += end - start;
+    lru_push(cache, entry);
+
+    while (cache->num_entries > 1
+           && (cache->num_entries > cache->max_entries
+               || (cache->max_bytes && cache->stats.bytes > cache->max_bytes))) {
+        map_remove(cache, map_find(cache, cache->lru_tail->start));
+        cache->stats.evictions++;
+    }
+
+    return entry;
+}
+
+uint32_t
+mr_cache_lkey(const struct mr_cache_entry *entry)
+{
+    return entry->mr->lkey;
+}
+
+void
+mr_cache_release(struct mr_cache *cache, struct mr_cache_entry *entry)
+{
+    (void) cache;
+    if (!--entry->refs && entry->retired) deregister(entry);
+}
+
+void
+mr_cache_invalidate(struct mr_cache *cache, const void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = start + length;
+
+    int index = map_find(cache, start);
+    if (index < 0 || cache->map[index]->end <= start) index++;
+    while (index < cache->num_entries && cache->map[index]->start < end) {
+        map_remove(cache, index);
+    }
+}
+
+void
+mr_cache_get_stats(const struct mr_cache *cache, struct mr_cache_stats *stats)
+{
+    *stats = cache->stats;
+    stats->entries = cache->num_entries;
+}
+
+void
+mr_cache_destroy(struct mr_cache *cache)
+{
+    if (!cache) return;
+
+    while (cache->num_entries) map_remove(cache, cache->num_entries - 1);
+    free(cache->map);
+    free(cache);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef MR_CACHE_H
+#define MR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__has_include)
+#if __has_include(<infiniband/verbs.h>)
+#include <infiniband/verbs.h>
+#else
+#include "verbs.h"
+#endif
+#endif
+
+// Pin-down cache of memory regions registered for application memory, so
+// repeated sends from the same arrays are never registered twice. The cache
+// is an interval map of page aligned, non-overlapping registrations sorted by
+// address, looked up by binary search. A range that overlaps cached
+// registrations without fitting in one is registered as their union. Beyond
+// 'max_entries' registrations, or 'max_bytes' registered bytes, the least
+// recently used registration is evicted.
+//
+// Registrations in use by posted Send Requests hold a reference. Evicted or
+// replaced registrations that still hold references are only deregistered
+// once their last reference is released. Memory must stay mapped while it
+// is cached, unmapping it requires mr_cache_invalidate() first.
+struct mr_cache;
+struct mr_cache_entry;
+
+struct mr_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Registrations currently in the cache and the bytes they cover
+    int entries;
+    size_t bytes;
+};
+
+// Returns NULL on failure. 0 for 'max_bytes' limits the number of entries
+// only.
+struct mr_cache *
+mr_cache_create(struct ibv_pd *protection_domain, int max_entries, size_t max_bytes);
+
+// Take a reference on a registration covering 'length' bytes at 'addr',
+// registering the range on a miss. Returns NULL if registration fails.
+struct mr_cache_entry *
+mr_cache_acquire(struct mr_cache *cache, const void *addr, size_t length);
+
+uint32_t
+mr_cache_lkey(const struct mr_cache_entry *entry);
+
+void
+mr_cache_release(struct mr_cache *cache, struct mr_cache_entry *entry);
+
+// Drop the registrations overlapping 'length' bytes at 'addr', e.g., before
+// unmapping that memory.
+void
+mr_cache_invalidate(struct mr_cache *cache, const void *addr, size_t length);
+
+void
+mr_cache_get_stats(const struct mr_cache *cache, struct mr_cache_stats *stats);
+
+// Deregister every cached registration and release the cache. No references
+// may be held.
+void
+mr_cache_destroy(struct mr_cache *cache);
+#endif
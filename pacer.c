@@ -0,0 +1,93 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#include <math.h>
+#include <string.h>
+
+#include "pacer.h"
+#include "tsc.h"
+
+#define FIXED_SHIFT 16
+
+int
+pacer_parse_pattern(const char *str)
+{
+    if (!strcmp(str, "constant")) return PACER_CONSTANT;
+    if (!strcmp(str, "bursty")) return PACER_BURSTY;
+    if (!strcmp(str, "poisson")) return PACER_POISSON;
+    return -1;
+}
+
+// Gap until the next grant, in 1/2^16 cycles
+static uint64_t
+next_gap(struct pacer *pacer)
+{
+    switch (pacer->pattern) {
+      case PACER_BURSTY:
+        return pacer->interval * pacer->burst;
+      case PACER_POISSON: {
+        // xorshift64*, the top 53 bits give a uniform value in (0, 1]
+        pacer->random ^= pacer->random >> 12;
+        pacer->random ^= pacer->random << 25;
+        pacer->random ^= pacer->random >> 27;
+        uint64_t bits = (pacer->random * 0x2545F4914F6CDD1DULL) >> 11;
+        double uniform = (bits + 1) / 9007199254740992.0;
+        return -log(uniform) * pacer->interval;
+      }
+      case PACER_CONSTANT:
+      default:
+        return pacer->interval;
+    }
+}
+
+// Schedule the next grant 'gap' 1/2^16 cycles after 'from'
+static void
+schedule(struct pacer *pacer, uint64_t from, uint64_t gap)
+{
+    uint64_t fixed = pacer->fraction + gap;
+    pacer->next = from + (fixed >> FIXED_SHIFT);
+    pacer->fraction = fixed & ((1 << FIXED_SHIFT) - 1);
+}
+
+void
+pacer_init(struct pacer *pacer, double rate, enum pacer_pattern pattern, int burst)
+{
+    tsc_calibrate();
+
+    // Cycles per second, scaled from the frequency tsc_calibrate() estimated
+    // over a 20 ms sleep. Converting a whole second only avoids rounding the
+    // rate in nanoseconds; it is no more precise than that estimate.
+    double cycles_per_second = ns_to_tsc(1000000000);
+
+    *pacer = (struct pacer) {
+        .pattern = pattern,
+        .burst = burst > 0 ? burst : 1,
+        .interval = cycles_per_second / rate * (1 << FIXED_SHIFT),
+        .random = tsc_read() | 1,
+    };
+    if (!pacer->interval) pacer->interval = 1;
+    schedule(pacer, tsc_read(), next_gap(pacer));
+}
+
+int
+pacer_take(struct pacer *pacer, int max)
+{
+    uint64_t now = tsc_read();
+    int grant = pacer->pattern == PACER_BURSTY ? pacer->burst : 1;
+
+    while (now >= pacer->next) {
+        pacer->tokens += grant;
+        schedule(pacer, pacer->next, next_gap(pacer));
+
+        // Drop the tokens of a sender too late to use them
+        if (pacer->tokens >= pacer->burst) {
+            pacer->tokens = pacer->burst;
+            if (now >= pacer->next) schedule(pacer, now, next_gap(pacer));
+        }
+    }
+
+    int taken = pacer->tokens < max ? pacer->tokens : max;
+    pacer->tokens -= taken;
+    return taken;
+}
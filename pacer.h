@@ -0,0 +1,47 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+// Token bucket releasing messages at a set rate, timed with the TSC. Tokens
+// are granted on a schedule following the arrival pattern: one at every
+// interval (constant), 'burst' at once every 'burst' intervals (bursty), or
+// one after every exponentially distributed gap (Poisson). At most 'burst'
+// tokens are kept, so a late sender catches up with at most one burst.
+enum pacer_pattern {
+    PACER_CONSTANT,
+    PACER_BURSTY,
+    PACER_POISSON
+};
+
+struct pacer {
+    enum pacer_pattern pattern;
+    int burst;
+    // Mean TSC cycles between tokens, in 1/2^16 cycles, for sub-cycle
+    // precision at high rates
+    uint64_t interval;
+    // TSC time of the next grant, its fraction of a cycle in 1/2^16
+    // cycles, and the tokens granted
+    uint64_t next;
+    uint64_t fraction;
+    int tokens;
+    // State of the random number generator of the Poisson pattern
+    uint64_t random;
+};
+
+// Parse "constant", "bursty", or "poisson", returns -1 if it's none
+int
+pacer_parse_pattern(const char *str);
+
+// Release 'rate' messages per second on average, starting now
+void
+pacer_init(struct pacer *pacer, double rate, enum pacer_pattern pattern, int burst);
+
+// Take up to 'max' of the tokens granted by now, returns the number taken
+int
+pacer_take(struct pacer *pacer, int max);
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf_counter.h"
+
+// glibc has no wrapper for perf_event_open
+static int
+open_event(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int
+perf_counter_open_llc_misses(void)
+{
+    int fd = open_event(PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_LL
+                        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (fd < 0) fd = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    return fd;
+}
+
+uint64_t
+perf_counter_read(int fd)
+{
+    uint64_t value;
+
+    if (fd < 0 || read(fd, &value, sizeof value) != sizeof value) return 0;
+    return value;
+}
+
+void
+perf_counter_close(int fd)
+{
+    if (fd >= 0) close(fd);
+}
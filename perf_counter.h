@@ -0,0 +1,23 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef PERF_COUNTER_H
+#define PERF_COUNTER_H
+
+#include <stdint.h>
+
+// Hardware event counters of the calling thread, using perf_event_open(2).
+// Opening fails without hardware counters, e.g., in most virtual machines,
+// or when /proc/sys/kernel/perf_event_paranoid forbids it.
+
+// Open a counter of the last-level cache misses of the calling thread in user
+// space, falling back to the generic cache miss event. Returns the file
+// descriptor of the counter, or -1 if it can't be opened.
+int perf_counter_open_llc_misses(void);
+
+// Current value of a counter, 0 for a counter that failed to open
+uint64_t perf_counter_read(int fd);
+
+void perf_counter_close(int fd);
+#endif
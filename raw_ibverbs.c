@@ -21,6 +21,7 @@
 #include "crc32.h"
 #include "lookup_addr.h"
 #include "fpga_host.h"
+#include "pacer.h"
 #include "raw_packet.h"
 
 static int packet_loop = 1;
@@ -135,9 +136,11 @@ init_invariant_headers
 }
 
 // Loop sending InfiniBand UD packets in a loop, updating the payload and
-// headers at every iteration.
+// headers at every iteration. Without a pacer it sends one packet per
+// second and prints its headers, with one it sends each packet as soon as
+// the pacer releases it.
 void
-ib_host_send_loop(struct packet *packet, uint32_t header_crc)
+ib_host_send_loop(struct packet *packet, uint32_t header_crc, struct pacer *pacer)
 {
     int result;
 
@@ -159,15 +162,19 @@ ib_host_send_loop(struct packet *packet, uint32_t header_crc)
         uint32_t *checksum = (uint32_t*) &packet->data[MSG_SIZE];
         *checksum = crc32(header_crc, packet->data, MSG_SIZE);
 
-        print_ib_headers(&packet->ib_header);
-        printf("\n");
+        if (pacer) {
+            while (packet_loop && !pacer_take(pacer, 1));
+        } else {
+            print_ib_headers(&packet->ib_header);
+            printf("\n");
+        }
 
         result = sendto(sock, packet, length, 0, (struct sockaddr *) &device, sizeof (device));
         if (result == -1) {
             perror("Error sending message");
             exit(EXIT_FAILURE);
         }
-        sleep(1);
+        if (!pacer) sleep(1);
     }
 }
 
@@ -184,6 +191,34 @@ int main(int argc, char **argv)
 
     uint32_t queue_pair;
     bool use_fpga = false;
+    double gbps = 0;
+    int pattern = PACER_CONSTANT;
+    int burst = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+R:P:B:")) != -1) {
+        switch (opt) {
+          case 'R':
+            gbps = atof(optarg);
+            if (gbps <= 0) argc = 0;
+            break;
+          case 'P':
+            pattern = pacer_parse_pattern(optarg);
+            if (pattern < 0) argc = 0;
+            break;
+          case 'B':
+            burst = atoi(optarg);
+            if (burst < 1) argc = 0;
+            break;
+          default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc) {
+        argc -= optind - 1;
+        argv += optind - 1;
+    }
     struct addr local = { 0 };
     struct addr remote = { 0 };
 
@@ -211,7 +246,8 @@ int main(int argc, char **argv)
             queue_pair = atoi(argv[8]);
         }
     } else {
-        fprintf(stderr, "Usage: raw_ibverbs host <dest IPv4> <dest IB GID> <IB QP> [<interface name>]\n");
+        fprintf(stderr, "Usage: raw_ibverbs [-R <Gbit/s>] [-P <constant|bursty|poisson>] [-B <packets>]\n"
+                "           host <dest IPv4> <dest IB GID> <IB QP> [<interface name>]\n");
         fprintf(stderr, "       raw_ibverbs fpga <dest MAC> <dest IPv4> <dest IB GID> <IB QP>\n");
         fprintf(stderr, "       raw_ibverbs fpga <src MAC> <src IPv4> <src IB GID> <dest MAC> <dest IPv4> <dest IB GID> <IB QP>\n");
         exit(EXIT_FAILURE);
@@ -230,8 +266,15 @@ int main(int argc, char **argv)
 
     uint32_t header_crc = init_invariant_headers(&full_packet, &local, &remote, queue_pair);
 
+    // Pace the frames of the host, including the Ethernet header
+    struct pacer pacer;
+    if (gbps) {
+        size_t frame = MSG_SIZE + total_header_size + checksum_size;
+        pacer_init(&pacer, gbps * 1e9 / 8 / frame, pattern, burst);
+    }
+
     if (use_fpga) ib_fpga_send_loop(&full_packet, header_crc);
-    else ib_host_send_loop(&full_packet, header_crc);
+    else ib_host_send_loop(&full_packet, header_crc, gbps ? &pacer : NULL);
 
     return 0;
 }
@@ -3,507 +3,4371 @@
  * Licensed under the Apache License, version 2.0. See LICENSE for details.
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rdma.h"
 #include "raw_packet.h"
+#include "tsc.h"
 
 #define IB_PORT 1
 
-static uint32_t max_mtu;
-static int page_size, queue_size;
-static int send_flags = IBV_SEND_SIGNALED;
+#define CACHE_LINE_SIZE 64
 
-static struct ibv_context *context;
-static struct ibv_pd      *protection_domain;
-struct ibv_cq             *completion_queue;
-static struct ibv_qp      *queue_pair;
+#define HUGEPAGE_2M (2UL << 20)
+#define HUGEPAGE_1G (1UL << 30)
 
-static void *header_buffer = NULL;
-static void *buffer = NULL;
+// Memory policy constants from <numaif.h>, defined here so we don't need the
+// libnuma headers for a single syscall.
+#define MPOL_PREFERRED 1
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+#define NUMA_MAX_NODES 1024
 
-static struct ibv_sge *scatter_gather = NULL;
-static struct ibv_recv_wr *recv_requests = NULL;
-static struct ibv_send_wr *send_requests = NULL;
+// A buffer registered with the NIC. 'page_size' is the size of the pages
+// backing it, larger than the base page size if it was mapped from
+// hugepages. Large buffers may be registered as several memory regions of
+// 'chunk_size' bytes, the last one taking the remainder, see buf_lkey().
+struct registered_buffer {
+    void *addr;
+    size_t size;
+    size_t page_size;
+    struct ibv_mr **mrs;
+    int num_mrs;
+    size_t chunk_size;
+};
 
-static struct ibv_mr *memory_region = NULL;
-static struct ibv_mr *header_memory_region = NULL;
-static struct ibv_ah *ah = NULL;
+// Local key of the memory region holding 'ptr'
+static inline uint32_t
+buf_lkey(const struct registered_buffer *buf, const void *ptr)
+{
+    size_t chunk = ((const char *) ptr - (const char *) buf->addr) / buf->chunk_size;
+    return buf->mrs[chunk < (size_t) buf->num_mrs ? chunk : (size_t) buf->num_mrs - 1]->lkey;
+}
+
+// A share of the parallel initialisation of a buffer, see run_parallel()
+struct init_task {
+    pthread_t thread;
+    struct rdma_endpoint *endpoint;
+    struct registered_buffer *buf;
+    int index;
+    int num_tasks;
+    int access;
+    int result;
+};
+
+// FIFO of slot indices of a circular buffer, holding at most 'size' slots.
+// Used as the free list of the receive and send rings, so slots can be
+// returned in any order.
+struct slot_ring {
+    int *slots;
+    int size;
+    int head;
+    int count;
+};
+
+// Inline data requested per Send Request, the device may grant less, or
+// refuse, in which case the queue pair is created without
+#define MAX_INLINE_REQUEST 256
+
+// Most memory regions of a receive ring a client of a connected transport can
+// write into, see the registration_chunks option.
+#define MAX_REMOTE_MRS 64
+
+// wr_id of the RDMA READ of the server's credit counter, see remote_credit()
+#define CREDIT_WR_ID UINT64_MAX
+
+// Everything the peer of a connected endpoint needs to know, exchanged over
+// TCP in network byte order by rdma_accept()/rdma_connect(): the address of
+// the queue pair, and the receive ring a client writes into, with the remote
+// key of every 'chunk_size' bytes memory region of the ring. Clients send an
+// empty ring. RC servers also send the location of their credit counter.
+struct connection_info {
+    uint64_t ring_addr;
+    uint64_t credit_addr;
+    uint32_t credit_rkey;
+    uint64_t stride;
+    uint64_t message_size;
+    uint64_t chunk_size;
+    uint32_t qpn;
+    uint32_t psn;
+    uint32_t num_slots;
+    uint32_t num_mrs;
+    uint32_t rkeys[MAX_REMOTE_MRS];
+    uint8_t gid[16];
+    uint32_t lid;
+};
+
+// A payload array of the scatter layout option: 'length' bytes of every
+// datagram go into a slot of 'stride' bytes of 'buf'.
+struct payload_segment {
+    size_t length;
+    size_t stride;
+    struct registered_buffer buf;
+};
+
+// State of the block placement mode, see init_block_placement(). Internal
+// sequence numbers count from the first datagram received, 'sequence_base'
+// converts them to the sequence numbers of the sender. Block b lives in
+// buffer b % num_blocks, packet s in slot s % block_packets of the buffer of
+// block s / block_packets. Receive Requests are posted in expected sequence
+// order, so in the normal case a datagram lands in its own slot.
+struct block_placement {
+    int block_packets;
+    int num_blocks;
+    int bitmap_words;
+    size_t block_bytes;
+
+    bool synced;
+    uint64_t sequence_base;
+    // Sequence number of the next Receive Request to post, the oldest block
+    // not yet handed out, and the number of blocks released by the consumer.
+    uint64_t next_post;
+    uint64_t next_block;
+    uint64_t released;
+    int wr_head;
+
+    // Receive Requests posted per slot and per block buffer, datagrams
+    // placed per block buffer, and a bitmap of the placed packets and of the
+    // missing packets (filled in on hand out) per block buffer.
+    uint8_t *slot_pending;
+    int *block_pending;
+    int *block_received;
+    uint64_t *received;
+    uint64_t *missing;
+
+    // Datagrams whose slot still has a Receive Request posted wait in a
+    // spill slot until that request completes. 'spill_of' holds the spill
+    // slot of every slot, -1 if none.
+    char *spill;
+    int *spill_of;
+    struct slot_ring spill_free;
+
+    struct rdma_placement_stats stats;
+};
+
+// Headers in front of the payload of a RoCEv2 datagram as delivered to a raw
+// packet queue pair: Ethernet, IPv4, UDP, BTH, and DETH. The 4 byte invariant
+// CRC trailing the payload is delivered as well.
+#define ROCE_V2_HEADER_SIZE \
+    ( sizeof (struct ethhdr) + sizeof (struct iphdr) + sizeof (struct udphdr) \
+    + sizeof (struct ib_bth) + sizeof (struct ib_deth))
+#define ROCE_V2_UDP_PORT 4791
+#define ICRC_SIZE 4
+
+// Fields hashed to pick a receive work queue in RSS mode. RoCEv2 senders use a
+// different UDP source port per queue pair, which gives the hash its entropy.
+#define RSS_HASH_FIELDS \
+    ( IBV_RX_HASH_SRC_IPV4 | IBV_RX_HASH_DST_IPV4 \
+    | IBV_RX_HASH_SRC_PORT_UDP | IBV_RX_HASH_DST_PORT_UDP)
+
+// Default Toeplitz key from the Microsoft RSS specification
+static uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+// All state belonging to a single endpoint. Everything that used to be a
+// file-level static lives here, so independent endpoints can coexist in one
+// process.
+struct rdma_endpoint {
+    uint32_t max_mtu;
+    int page_size, queue_size;
+    int send_flags;
+    struct rdma_options options;
+
+    struct ibv_context *context;
+    struct ibv_pd      *protection_domain;
+    struct ibv_comp_channel *completion_channel;
+    struct ibv_cq      *completion_queue;
+    struct ibv_qp      *queue_pair;
+
+    struct registered_buffer header_buffer;
+    struct registered_buffer buffer;
+
+    struct ibv_sge *scatter_gather;
+    struct ibv_recv_wr *recv_requests;
+    struct ibv_send_wr *send_requests;
+
+    struct ibv_ah *ah;
+
+    struct recv_buffer *recv_buffers;
+    struct send_buffer *send_buffers;
+
+    // Largest datagram payload of the endpoint and the distance between
+    // consecutive slots of the data buffer, see configure_message_size().
+    size_t message_size;
+    size_t stride;
+
+    // Size of the per-datagram header slot and number of SGEs per Receive
+    // Request in the receive ring, and whether the last SGE receives the
+    // invariant CRC of a raw RoCEv2 frame.
+    size_t header_size;
+    int num_recv_sge;
+    bool recv_trailer;
+
+    // Number of SGEs per Receive Request scattering the GRH, 3 for the
+    // compact header policy, and the side array receiving the compact header
+    // fields, see init_recv_ring().
+    int header_sges;
+    struct registered_buffer compact_headers;
+
+    // Payload arrays of the scatter layout option, see
+    // configure_message_size(). The first segment is the data buffer, its
+    // 'buf' is unused. 0 segments without a layout.
+    struct payload_segment *segments;
+    int num_segments;
+
+    // Receive work queue used instead of the queue pair in RSS mode.
+    struct ibv_wq *work_queue;
+
+    // Server group this endpoint belongs to, if any. Endpoints in a group
+    // borrow the device context and protection domain of the group.
+    struct rdma_server_group *group;
+
+    // Adaptive polling state of rdma_poll(): whether we are busy polling,
+    // when the current mode started, and when the last completion arrived.
+    bool interrupt_mode;
+    uint64_t mode_start;
+    uint64_t last_completion;
+    struct rdma_poll_stats poll_stats;
+
+    // Completion timestamping, see the timestamps option. With hardware
+    // timestamps the completion queue is an extended CQ reporting the device
+    // clock, converted to CLOCK_MONOTONIC using a reference pair of device
+    // cycles and nanoseconds that is refreshed every second. Without them
+    // the TSC timestamp of the previous poll bounds the arrival time.
+    struct ibv_cq_ex *completion_queue_ex;
+    bool hardware_timestamps;
+    uint64_t hca_core_clock;
+    uint64_t reference_cycles;
+    uint64_t reference_ns;
+    uint64_t last_poll;
+    uint64_t *completion_timestamps;
+
+    // Time each receive slot was polled, to measure poll-to-repost delay
+    uint64_t *poll_times;
+
+    struct latency_histogram nic_to_poll;
+    struct latency_histogram poll_to_repost;
+
+    // Receive slots released by the consumer but not yet reposted, and the
+    // number of Receive Requests currently posted. Released slots are
+    // reposted in a single chain once no more than 'recv_low_watermark'
+    // requests remain posted. Endpoints of an SRQ group use the free list
+    // and watermark of the pool.
+    struct slot_ring recv_free;
+    int recv_posted;
+    int recv_low_watermark;
+
+    // With the recycle_budget option the free list is used as a stack and no
+    // more than 'recv_window' Receive Requests are posted, see
+    // flush_released(). Otherwise the window is the whole receive queue.
+    bool recycle_lifo;
+    int recv_window;
+
+    // Zero-copy leases on receive slots, see rdma_recv_lease(). Every slot
+    // has a reference count, the last release pushes the slot onto the
+    // lock-free 'returned' stack (linked through 'returned_next', -1
+    // terminated), so leases can be released from any thread. The polling
+    // thread reclaims the returned slots into the free list.
+    atomic_int *lease_refs;
+    int *returned_next;
+    atomic_int returned_head;
+    atomic_int leases;
+
+    // Send slot allocation, see rdma_send_acquire(). 'send_free' holds the
+    // slots that may be acquired, 'send_posted' the posted slots in the
+    // order they were posted. Only every 'signal_interval'th Send Request is
+    // signaled, 'send_covers' records for every signaled slot how many posted
+    // slots its completion frees.
+    struct slot_ring send_free;
+    struct slot_ring send_posted;
+    int *send_covers;
+    int signal_interval;
+    int send_unsignaled;
+    struct rdma_send_stats send_stats;
+
+    // Concurrent send path, see rdma_send_reserve(). Tickets below
+    // 'send_reserved' are reserved, below 'send_published' posted, and below
+    // 'send_completed' completed. 'send_ready' holds ticket + 1 for every
+    // committed slot. Only the thread holding 'send_combining' posts and
+    // reaps. The free list is unused.
+    _Atomic uint64_t send_reserved;
+    _Atomic uint64_t send_published;
+    _Atomic uint64_t send_completed;
+    _Atomic uint64_t *send_ready;
+    atomic_flag send_combining;
+    atomic_bool send_failed;
+
+    // Gather sends, see rdma_send_gather(). Every send slot has 1 +
+    // 'gather_segments' SGEs, and holds a reference on the cached
+    // registration of each of its payload segments until it completes.
+    int gather_segments;
+    struct mr_cache *mr_cache;
+    // Send Requests of at most this many bytes are sent inline, see
+    // post_send_run()
+    uint32_t max_inline;
+    // The NIC paces sends at the rate_limit_kbps option
+    bool rate_limited;
+    struct mr_cache_entry **gather_refs;
+    int *gather_counts;
+
+    // NUMA node of the device, -1 if unknown
+    int numa_node;
+    // Register buffers for On-Demand Paging instead of pinning them
+    bool on_demand;
+    struct rdma_alloc_stats alloc_stats;
+
+    // Connected transports: access flags added to the registration of the
+    // receive ring, so the peer can write into it, and for clients the
+    // receive ring of the server (in host byte order) with the next of its
+    // slots to write. Remote slots are written in ring order.
+    int remote_access;
+    struct connection_info remote;
+    uint32_t remote_next;
+
+    // Credits of RC endpoints, so the client never writes a slot the server
+    // still uses. The server counts in 'credit_count' the slots reposted in
+    // ring order, the order the client writes them in, and publishes the
+    // count, big endian, in the registered 'credit', so every write it
+    // allows finds a posted Receive Request. The client may write
+    // 'num_slots' slots beyond the count it last read into 'credit' with an
+    // RDMA READ, and counts the slots it acquired in 'remote_acquired'.
+    _Atomic uint64_t *credit;
+    struct ibv_mr *credit_mr;
+    uint64_t credit_count;
+    bool *slot_reposted;
+    uint64_t remote_acquired;
+    bool credit_read_posted;
+    // Set once a read of the credits couldn't be posted, which fails the
+    // client instead of leaving it without credits forever
+    bool credit_failed;
+
+    // Block placement mode, NULL for a circular receive buffer. Clients with
+    // the send_sequence option number their datagrams with 'send_sequence'.
+    struct block_placement *placement;
+    uint32_t send_sequence;
+};
+
+// A set of receive endpoints sharing one device context and protection
+// domain. In RSS mode incoming traffic is hashed over the receive work queues
+// of the endpoints by a single raw packet queue pair, otherwise every
+// endpoint has its own UD queue pair. In SRQ mode those queue pairs all draw
+// their receive buffers from a single shared receive queue.
+struct rdma_server_group {
+    uint32_t max_mtu;
+    enum rdma_group_mode mode;
+    struct rdma_options options;
+    bool use_rss;
+    int numa_node;
+
+    struct ibv_context *context;
+    struct ibv_pd      *protection_domain;
+
+    struct ibv_rwq_ind_table *indirection_table;
+    struct ibv_qp            *rss_queue_pair;
+    struct ibv_flow          *flow;
+
+    int num_endpoints;
+    struct rdma_endpoint **endpoints;
+
+    // SRQ mode: the shared receive queue and the receive ring backing it. The
+    // pool is an endpoint without queue pair or completion queue. 'srq_lock'
+    // protects the pool, the reserve, and the counters, as every receive
+    // thread reposts into the same pool.
+    struct ibv_srq *srq;
+    struct rdma_endpoint *pool;
+    pthread_mutex_t srq_lock;
+    bool srq_lock_initialised;
+
+    // Estimate of the number of Receive Requests posted to the SRQ and the
+    // low watermark at which the device raises IBV_EVENT_SRQ_LIMIT_REACHED.
+    int srq_posted;
+    int srq_limit;
+    // Slots released with rdma_recv_release() since the last flush, no
+    // longer posted to the SRQ but not yet subtracted from 'srq_posted'
+    int srq_released;
+
+    // Slots held back from the SRQ, posted all at once when the low
+    // watermark is reached. Reposted slots refill the reserve while the SRQ
+    // is comfortably above the watermark.
+    int *reserve;
+    int reserve_count;
+    int reserve_size;
+    long emergency_refills;
+};
+
+static void internal_rdma_cleanup(struct rdma_endpoint *endpoint);
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Take a new reference pair of device clock cycles and CLOCK_MONOTONIC
+// nanoseconds, used to convert hardware completion timestamps.
+static int
+calibrate_device_clock(struct rdma_endpoint *endpoint)
+{
+    struct ibv_values_ex values = { .comp_mask = IBV_VALUES_MASK_RAW_CLOCK };
+
+    uint64_t before = now_ns();
+    if (ibv_query_rt_values_ex(endpoint->context, &values)) return 1;
+    uint64_t after = now_ns();
+
+    endpoint->reference_cycles =
+        (uint64_t) values.raw_clock.tv_sec * 1000000000 + values.raw_clock.tv_nsec;
+    endpoint->reference_ns = before + (after - before) / 2;
+    return 0;
+}
+
+static uint64_t
+device_cycles_to_ns(struct rdma_endpoint *endpoint, uint64_t cycles)
+{
+    // hca_core_clock is in kHz
+    int64_t delta = cycles - endpoint->reference_cycles;
+    return endpoint->reference_ns + (int64_t) (delta * 1e6 / endpoint->hca_core_clock);
+}
+
+// Current time in the timebase of the endpoint's completion timestamps
+static uint64_t
+timestamp_now(struct rdma_endpoint *endpoint)
+{
+    return endpoint->hardware_timestamps ? now_ns() : tsc_ns();
+}
+
+// Entries of the completion queue: one per slot, and on RC one more for the
+// signaled read of the server's credits, outstanding next to a full send
+// queue
+static int
+completion_queue_entries(struct rdma_endpoint *endpoint)
+{
+    return endpoint->queue_size + (endpoint->options.transport == RDMA_TRANSPORT_RC);
+}
+
+// Create an extended completion queue for the timestamps option. Completions
+// carry the device's clock when the device supports completion timestamps
+// and its clock can be read, otherwise fall back to TSC timestamps taken when
+// polling. Providers without extended CQs get a regular completion queue.
+static int
+create_timestamped_completion_queue(struct rdma_endpoint *endpoint)
+{
+    struct ibv_device_attr_ex device_attr;
+
+    endpoint->completion_timestamps =
+        malloc(endpoint->queue_size * (sizeof *endpoint->completion_timestamps));
+    if (!endpoint->completion_timestamps) {
+        fprintf(stderr, "Couldn't allocate completion timestamps.\n");
+        return 1;
+    }
+
+    latency_histogram_reset(&endpoint->nic_to_poll);
+    latency_histogram_reset(&endpoint->poll_to_repost);
+    tsc_calibrate();
+
+    endpoint->hardware_timestamps =
+        !ibv_query_device_ex(endpoint->context, NULL, &device_attr)
+        && device_attr.completion_timestamp_mask
+        && device_attr.hca_core_clock;
+    endpoint->hca_core_clock = device_attr.hca_core_clock;
+
+    if (endpoint->hardware_timestamps && calibrate_device_clock(endpoint)) {
+        endpoint->hardware_timestamps = false;
+    }
+
+    struct ibv_cq_init_attr_ex cq_attr = {
+        .cqe      = completion_queue_entries(endpoint),
+        .channel  = endpoint->completion_channel,
+        .wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM | IBV_WC_EX_WITH_SRC_QP,
+    };
+
+    if (endpoint->hardware_timestamps) {
+        cq_attr.wc_flags |= IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+        endpoint->completion_queue_ex = ibv_create_cq_ex(endpoint->context, &cq_attr);
+    }
+
+    if (!endpoint->completion_queue_ex) {
+        endpoint->hardware_timestamps = false;
+        cq_attr.wc_flags &= ~IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+        endpoint->completion_queue_ex = ibv_create_cq_ex(endpoint->context, &cq_attr);
+    }
+
+    if (endpoint->completion_queue_ex) {
+        endpoint->completion_queue = ibv_cq_ex_to_cq(endpoint->completion_queue_ex);
+    } else {
+        endpoint->completion_queue = ibv_create_cq
+            ( endpoint->context, completion_queue_entries(endpoint), NULL
+            , endpoint->completion_channel, 0);
+    }
+
+    fprintf(stderr, "Using %s completion timestamps\n",
+            endpoint->hardware_timestamps ? "hardware" : "TSC");
+
+    endpoint->last_poll = timestamp_now(endpoint);
+    return 0;
+}
+
+// Create the completion queue of an endpoint. With the completion_channel
+// option the queue gets its own (non-blocking) completion channel, so that
+// rdma_poll() can wait for completion events instead of busy polling.
+static int
+create_completion_queue(struct rdma_endpoint *endpoint)
+{
+    if (endpoint->options.completion_channel) {
+        endpoint->completion_channel = ibv_create_comp_channel(endpoint->context);
+        if (!endpoint->completion_channel) {
+            fprintf(stderr, "Failed to create completion channel.\n");
+            return 1;
+        }
+
+        int fd = endpoint->completion_channel->fd;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+            fprintf(stderr, "Couldn't make completion channel non-blocking.\n");
+            return 1;
+        }
+    }
+
+    if (endpoint->options.timestamps) {
+        if (create_timestamped_completion_queue(endpoint)) return 1;
+    } else {
+        endpoint->completion_queue = ibv_create_cq
+            ( endpoint->context, completion_queue_entries(endpoint), NULL
+            , endpoint->completion_channel, 0);
+    }
+
+    if (!endpoint->completion_queue) {
+        fprintf(stderr, "Failed to create completion queue.\n");
+        return 1;
+    }
+
+    endpoint->mode_start = endpoint->last_completion = now_ns();
+    return 0;
+}
+
+size_t
+rdma_parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (*end) {
+      case 'G': case 'g': size <<= 10; // fall through
+      case 'M': case 'm': size <<= 10; // fall through
+      case 'K': case 'k': size <<= 10; end++; break;
+      default: break;
+    }
+
+    return end == str || *end ? 0 : size;
+}
+
+int
+rdma_parse_transport(const char *str)
+{
+    if (!strcasecmp(str, "ud")) return RDMA_TRANSPORT_UD;
+    if (!strcasecmp(str, "rc")) return RDMA_TRANSPORT_RC;
+    if (!strcasecmp(str, "uc")) return RDMA_TRANSPORT_UC;
+    return -1;
+}
+
+int
+rdma_parse_header_policy(const char *str)
+{
+    if (!strcasecmp(str, "keep")) return RDMA_HEADERS_KEEP;
+    if (!strcasecmp(str, "discard")) return RDMA_HEADERS_DISCARD;
+    if (!strcasecmp(str, "compact")) return RDMA_HEADERS_COMPACT;
+    return -1;
+}
+
+static int
+slot_ring_init(struct slot_ring *ring, int size)
+{
+    ring->slots = malloc(size * (sizeof *ring->slots));
+    ring->size = size;
+    ring->head = 0;
+    ring->count = 0;
+    return ring->slots ? 0 : 1;
+}
+
+static void
+slot_ring_push(struct slot_ring *ring, int slot)
+{
+    ring->slots[(ring->head + ring->count++) % ring->size] = slot;
+}
+
+static int
+slot_ring_pop(struct slot_ring *ring)
+{
+    int slot = ring->slots[ring->head];
+    ring->head = (ring->head + 1) % ring->size;
+    ring->count--;
+    return slot;
+}
+
+// Reverse the order of 'count' slots of the ring, starting at 'start'
+static void
+slot_ring_reverse(struct slot_ring *ring, int start, int count)
+{
+    for (int i = 0, j = count - 1; i < j; i++, j--) {
+        int *first = &ring->slots[(start + i) % ring->size];
+        int *last = &ring->slots[(start + j) % ring->size];
+        int slot = *first;
+        *first = *last;
+        *last = slot;
+    }
+}
+
+// The i'th slot of a run starting at 'start': an index into the ring if
+// given, or a plain run of consecutive slots otherwise.
+static inline int
+run_slot(const struct slot_ring *ring, int start, int i, int size)
+{
+    return ring ? ring->slots[(start + i) % ring->size] : (start + i) % size;
+}
+
+// Deregister and release a buffer allocated by allocate_buf()
+static void
+free_buf(struct registered_buffer *buf)
+{
+    for (int i = 0; i < buf->num_mrs; i++) {
+        if (buf->mrs[i] && ibv_dereg_mr(buf->mrs[i])) {
+            fprintf(stderr, "Couldn't destroy memory region.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(buf->mrs);
+    buf->mrs = NULL;
+    buf->num_mrs = 0;
+
+    if (buf->addr) munmap(buf->addr, buf->size);
+    buf->addr = NULL;
+}
+
+// Map anonymous memory for a buffer of 'size' bytes, rounded up to a whole
+// number of pages of 'page_size' bytes. Page sizes above 'base_page_size' are
+// mapped from hugepages. Returns NULL if the kernel has no (or not enough)
+// hugepages of that size reserved.
+static void *
+map_pages(size_t size, size_t page_size, size_t base_page_size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (page_size > base_page_size) {
+        flags |= MAP_HUGETLB | (__builtin_ctzl(page_size) << MAP_HUGE_SHIFT);
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+// Read the NUMA node the device is attached to from sysfs, -1 if unknown
+// (e.g., on single node machines).
+static int
+device_numa_node(struct ibv_context *context)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "/sys/class/infiniband/%s/device/numa_node",
+             ibv_get_device_name(context->device));
+
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    int node;
+    if (fscanf(file, "%d", &node) != 1) node = -1;
+    fclose(file);
+
+    return node;
+}
+
+// Prefer allocating the pages of a (not yet touched) mapping on a NUMA node.
+// This calls mbind directly, to avoid depending on libnuma. The policy is a
+// preference, so allocation falls back to other nodes when the node is out
+// of (huge)pages rather than failing.
+static void
+bind_to_node(void *addr, size_t size, int node)
+{
+    unsigned long nodemask[NUMA_MAX_NODES / (8 * sizeof (unsigned long))] = { 0 };
+
+    if (node < 0 || node >= NUMA_MAX_NODES) return;
+
+    nodemask[node / (8 * sizeof *nodemask)] |= 1UL << (node % (8 * sizeof *nodemask));
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodemask, NUMA_MAX_NODES + 1, 0)) {
+        fprintf(stderr, "Couldn't bind buffer to NUMA node %d.\n", node);
+    }
+}
+
+// NUMA node of the page at 'addr', -1 if unknown
+static int
+page_numa_node(void *addr)
+{
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR)) {
+        return -1;
+    }
+    return node;
+}
+
+// Enable On-Demand Paging for an endpoint if the option is set and the device
+// supports it for the required operations of the endpoint's transport
+// ('caps', 0 for raw packet queue pairs, which have no per-transport
+// capabilities). Without support the buffers are pinned as usual.
+static void
+configure_on_demand_paging(struct rdma_endpoint *endpoint, uint32_t caps)
+{
+    struct ibv_device_attr_ex attr;
+
+    if (!endpoint->options.on_demand_paging) return;
+
+    int failed = ibv_query_device_ex(endpoint->context, NULL, &attr);
+    uint32_t supported = attr.odp_caps.per_transport_caps.ud_odp_caps;
+    if (endpoint->options.transport == RDMA_TRANSPORT_RC) {
+        supported = attr.odp_caps.per_transport_caps.rc_odp_caps;
+    } else if (endpoint->options.transport == RDMA_TRANSPORT_UC) {
+        supported = attr.odp_caps.per_transport_caps.uc_odp_caps;
+    }
+
+    if (failed || !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT)
+        || (supported & caps) != caps) {
+        fprintf(stderr, "Device lacks On-Demand Paging support, pinning buffers instead.\n");
+        return;
+    }
+
+    endpoint->on_demand = true;
+}
+
+// Have the NIC pace the Send Requests of a queue pair in RTS at the
+// rate_limit_kbps option. Packet pacing is limited to some transports and a
+// range of rates, outside of those the limit is left to the sender.
+static void
+configure_rate_limit(struct rdma_endpoint *endpoint)
+{
+    static const enum ibv_qp_type qp_types[] = {
+        [RDMA_TRANSPORT_UD] = IBV_QPT_UD,
+        [RDMA_TRANSPORT_RC] = IBV_QPT_RC,
+        [RDMA_TRANSPORT_UC] = IBV_QPT_UC,
+    };
+    struct ibv_device_attr_ex device_attr;
+    uint32_t rate = endpoint->options.rate_limit_kbps;
+
+    if (!rate) return;
+
+    if (ibv_query_device_ex(endpoint->context, NULL, &device_attr)
+        || !(device_attr.packet_pacing_caps.supported_qpts
+             & (1U << qp_types[endpoint->options.transport]))) {
+        fprintf(stderr, "Device lacks packet pacing, pacing in software instead.\n");
+        return;
+    }
+
+    struct ibv_packet_pacing_caps *caps = &device_attr.packet_pacing_caps;
+    if (rate < caps->qp_rate_limit_min || rate > caps->qp_rate_limit_max) {
+        fprintf(stderr, "Rate of %u kbit/s outside the device's pacing range of %u to %u "
+                "kbit/s, pacing in software instead.\n", rate, caps->qp_rate_limit_min,
+                caps->qp_rate_limit_max);
+        return;
+    }
+
+    struct ibv_qp_attr attr = { .rate_limit = rate };
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, IBV_QP_RATE_LIMIT)) {
+        fprintf(stderr, "Couldn't set queue pair rate limit, pacing in software instead.\n");
+        return;
+    }
+
+    endpoint->rate_limited = true;
+}
+
+// Prefetch the first odp_prefetch bytes of an On-Demand Paging buffer, so the
+// first datagrams don't all take a page fault on the NIC. Without
+// ibv_advise_mr() in the verbs headers the window is touched from the CPU,
+// which at least saves the NIC from faulting in fresh pages.
+static void
+prefetch_window(struct rdma_endpoint *endpoint, struct registered_buffer *buf)
+{
+    size_t window = endpoint->options.odp_prefetch;
+    if (window > buf->size) window = buf->size;
+
+#ifdef IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE
+    // The SGE length is 32 bits, so prefetch in pieces of at most 1 GiB that
+    // don't cross memory regions.
+    for (size_t offset = 0, length; offset < window; offset += length) {
+        size_t chunk_end = (offset / buf->chunk_size + 1) * buf->chunk_size;
+        if (offset / buf->chunk_size >= (size_t) buf->num_mrs - 1) chunk_end = window;
+
+        length = window < chunk_end ? window - offset : chunk_end - offset;
+        if (length > HUGEPAGE_1G) length = HUGEPAGE_1G;
+
+        struct ibv_sge sge = {
+            .addr = (uintptr_t) buf->addr + offset,
+            .length = length,
+            .lkey = buf_lkey(buf, (char *) buf->addr + offset),
+        };
+
+        if (ibv_advise_mr(endpoint->protection_domain, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+                          IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1)) {
+            fprintf(stderr, "Couldn't prefetch On-Demand Paging window.\n");
+            return;
+        }
+    }
+#else
+    memset(buf->addr, 0, window);
+#endif
+}
 
-static void internal_rdma_cleanup();
+// Fault in a contiguous share of the pages of a buffer. Anonymous mappings
+// are zero-filled already, so with the skip_zeroing option only one byte per
+// page is written instead of the whole buffer.
+static void *
+touch_pages(void *arg)
+{
+    struct init_task *task = arg;
+    struct registered_buffer *buf = task->buf;
+    size_t pages = buf->size / buf->page_size;
+    size_t first = pages * task->index / task->num_tasks;
+    size_t last = pages * (task->index + 1) / task->num_tasks;
+    char *addr = buf->addr;
+
+    if (task->endpoint->options.skip_zeroing) {
+        for (size_t page = first; page < last; page++) {
+            ((volatile char *) addr)[page * buf->page_size] = 0;
+        }
+    } else {
+        memset(addr + first * buf->page_size, 0, (last - first) * buf->page_size);
+    }
+
+    return NULL;
+}
+
+// Register every num_tasks'th memory region of a buffer, starting at the
+// index of the task.
+static void *
+register_chunks(void *arg)
+{
+    struct init_task *task = arg;
+    struct registered_buffer *buf = task->buf;
+
+    for (int i = task->index; i < buf->num_mrs; i += task->num_tasks) {
+        size_t offset = i * buf->chunk_size;
+        size_t length = i == buf->num_mrs - 1 ? buf->size - offset : buf->chunk_size;
+
+        buf->mrs[i] = ibv_reg_mr(task->endpoint->protection_domain,
+                                 (char *) buf->addr + offset, length, task->access);
+        if (!buf->mrs[i]) task->result = 1;
+    }
+
+    return NULL;
+}
+
+// Run 'function' on 'num_tasks' tasks in parallel, the first one on the
+// calling thread. Tasks whose thread can't be started run on the calling
+// thread as well. Returns non-zero if any task failed.
+static int
+run_parallel(struct init_task *tasks, int num_tasks, void *(*function)(void *))
+{
+    bool *started = calloc(num_tasks, sizeof *started);
+    int result = 0;
+
+    for (int i = 1; started && i < num_tasks; i++) {
+        started[i] = !pthread_create(&tasks[i].thread, NULL, function, &tasks[i]);
+    }
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (!started || !started[i]) function(&tasks[i]);
+    }
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (started && started[i]) pthread_join(tasks[i].thread, NULL);
+        result |= tasks[i].result;
+    }
+
+    free(started);
+    return result;
+}
 
-// Allocate a page-alligned buffer and corresponding ibverbs memory region
-static int allocate_buf(void **buf, struct ibv_mr **mr, size_t size)
+// Allocate a page-alligned buffer and corresponding ibverbs memory regions.
+// With the hugepage_size option the buffer is mapped from hugepages, falling
+// back from 1 GiB to 2 MiB hugepages, and from there to base pages, when the
+// kernel has none available. The buffer is placed on the NUMA node of the
+// device, if known.
+//
+// Large buffers are faulted in by init_threads threads in parallel, and
+// registered as registration_chunks memory regions, registered concurrently
+// by the same threads. Chunks are a multiple of 'element_size', so no slot of
+// the buffer straddles two memory regions. The time spent allocating,
+// touching, and registering the buffer is added to the endpoint's allocation
+// statistics.
+static int
+allocate_buf
+( struct rdma_endpoint *endpoint
+, struct registered_buffer *buf
+, size_t size
+, size_t element_size
+)
 {
-    if (posix_memalign(buf, page_size, size)) {
+    struct rdma_alloc_stats *stats = &endpoint->alloc_stats;
+    size_t base_page_size = endpoint->page_size;
+    size_t page_size = endpoint->options.hugepage_size;
+    int num_threads = endpoint->options.init_threads > 1 ? endpoint->options.init_threads : 1;
+    int num_mrs = endpoint->options.registration_chunks > 1 ? endpoint->options.registration_chunks : 1;
+    uint64_t start = now_ns();
+
+    // Rounding to whole pages and the MAP_HUGETLB size flag take a power of two
+    if (page_size & (page_size - 1)) {
+        fprintf(stderr, "Hugepages of %zu bytes aren't a power of two.\n", page_size);
+        return 1;
+    }
+    if (page_size < base_page_size) page_size = base_page_size;
+
+    buf->mrs = NULL;
+    buf->num_mrs = 0;
+    for (;;) {
+        buf->size = (size + page_size - 1) & ~(page_size - 1);
+        buf->page_size = page_size;
+        buf->addr = map_pages(buf->size, page_size, base_page_size);
+        if (buf->addr || page_size == base_page_size) break;
+
+        size_t next = page_size > HUGEPAGE_2M ? HUGEPAGE_2M : base_page_size;
+        fprintf(stderr, "Couldn't map %zu KiB hugepages, falling back to %zu KiB pages.\n",
+                page_size >> 10, next >> 10);
+        page_size = next;
+    }
+
+    if (!buf->addr) {
         fprintf(stderr, "Couldn't allocate work buffer.\n");
         return 1;
     }
 
-    memset(*buf, 0, size);
+    // Round chunks up to whole elements, which may leave fewer chunks
+    size_t elements = (size + element_size - 1) / element_size;
+    buf->chunk_size = ((elements + num_mrs - 1) / num_mrs) * element_size;
+    buf->num_mrs = (buf->size + buf->chunk_size - 1) / buf->chunk_size;
+    if (buf->num_mrs > num_mrs) buf->num_mrs = num_mrs;
+
+    buf->mrs = calloc(buf->num_mrs, sizeof *buf->mrs);
+    struct init_task *tasks = calloc(num_threads, sizeof *tasks);
+    if (!buf->mrs || !tasks) {
+        fprintf(stderr, "Couldn't allocate memory regions.\n");
+        free(tasks);
+        goto clean_buf;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        tasks[i].endpoint = endpoint;
+        tasks[i].buf = buf;
+        tasks[i].index = i;
+        tasks[i].num_tasks = num_threads;
+        tasks[i].access = IBV_ACCESS_LOCAL_WRITE | endpoint->remote_access;
+    }
+
+    // The policy only affects pages faulted in after this, so it must be set
+    // before the pages are touched.
+    bind_to_node(buf->addr, buf->size, endpoint->numa_node);
+    uint64_t allocated = now_ns();
+    uint64_t touched = allocated;
+
+    // With On-Demand Paging nothing is touched or pinned up front, the NIC
+    // faults pages in as it writes them, so startup time doesn't grow with
+    // the size of the buffer. Only the first window is prefetched, after
+    // registration.
+    if (endpoint->on_demand) {
+        for (int i = 0; i < num_threads; i++) tasks[i].access |= IBV_ACCESS_ON_DEMAND;
+    } else {
+        run_parallel(tasks, num_threads, touch_pages);
+        touched = now_ns();
+    }
+
+    int result = run_parallel(tasks, num_threads, register_chunks);
+    free(tasks);
+    if (result) {
+        fprintf(stderr, "Couldn't register memory region.\n");
+        goto clean_buf;
+    }
+
+    uint64_t registered = now_ns();
+    if (endpoint->on_demand) prefetch_window(endpoint, buf);
+
+    stats->alloc_ns += allocated - start;
+    stats->touch_ns += touched - allocated + now_ns() - registered;
+    stats->register_ns += registered - touched;
+
+    if (!stats->bytes) stats->numa_node = page_numa_node(buf->addr);
+    stats->on_demand = endpoint->on_demand;
+    stats->threads = num_threads;
+    stats->num_mrs += buf->num_mrs;
+    stats->bytes += buf->size;
+    if (!stats->page_size || buf->page_size < stats->page_size) {
+        stats->page_size = buf->page_size;
+    }
+
+    return 0;
+
+  clean_buf:
+    free_buf(buf);
+    return 1;
+}
+
+// Find the IB device with the specified name and open it. Returns NULL on
+// failure.
+static struct ibv_context *
+open_device(char *dev_name)
+{
+    int num_devs;
+    struct ibv_context *context = NULL;
+    struct ibv_device *ib_dev = NULL;
+    struct ibv_device **dev_list = ibv_get_device_list(&num_devs);
+    if (!dev_list) {
+        fprintf(stderr, "No IB devices found.\n");
+        return NULL;
+    }
+
+    for (int i = 0; dev_list[i]; ++i) {
+        if (!strcmp(ibv_get_device_name(dev_list[i]), dev_name)) {
+            ib_dev = dev_list[i];
+            break;
+        }
+    }
+
+    if (!ib_dev) {
+        fprintf(stderr, "No device with name: %s\n", dev_name);
+    } else {
+        context = ibv_open_device(ib_dev);
+        if (!context) {
+            fprintf(stderr, "Failed to open device: %s\n", ibv_get_device_name(ib_dev));
+        }
+    }
+
+    ibv_free_device_list(dev_list);
+    return context;
+}
+
+// Number of SGEs scattering the GRH of a datagram under the endpoint's header
+// policy, see init_recv_ring().
+static int
+header_sge_count(const struct rdma_options *options)
+{
+    return options->header_policy == RDMA_HEADERS_COMPACT ? 3 : 1;
+}
+
+// Number of SGEs per Receive Request of a UD receive ring: the GRH and every
+// segment of the payload.
+static int
+recv_sge_count(const struct rdma_options *options)
+{
+    int segments = options->scatter_segments > 1 ? options->scatter_segments : 1;
+    return header_sge_count(options) + segments;
+}
+
+// Query the active MTU of IB_PORT, returns 0 on failure.
+static uint32_t
+query_max_mtu(struct ibv_context *context)
+{
+    struct ibv_port_attr port_info;
+    if (ibv_query_port(context, IB_PORT, &port_info)) {
+        fprintf(stderr, "Failed to query port info.\n");
+        return 0;
+    }
+
+    return 1 << (port_info.active_mtu + 7);
+}
+
+// Create a queue pair of the endpoint's transport for its completion queue,
+// configure it to use IB_PORT, and transition an Unreliable Datagram queue
+// pair to the RTR (Ready-to-Receive) state. Connected queue pairs stay in the
+// INIT state, with remote writes enabled, until they are connected to their
+// peer (see connect_queue_pair()). Their Receive Requests carry no SGEs, the
+// payload is written by the peer. Endpoints of an SRQ group receive through
+// the shared receive queue of the group.
+static int
+create_queue_pair(struct rdma_endpoint *endpoint)
+{
+    static const enum ibv_qp_type qp_types[] = {
+        [RDMA_TRANSPORT_UD] = IBV_QPT_UD,
+        [RDMA_TRANSPORT_RC] = IBV_QPT_RC,
+        [RDMA_TRANSPORT_UC] = IBV_QPT_UC,
+    };
+    enum rdma_transport transport = endpoint->options.transport;
+    struct ibv_srq *srq = endpoint->group ? endpoint->group->srq : NULL;
+    int max_recv_sge = transport == RDMA_TRANSPORT_UD ? recv_sge_count(&endpoint->options) : 1;
+    int gather_segments = endpoint->options.gather_segments;
+    int max_send_sge = 1 + (gather_segments > 0 ? gather_segments : 0);
+
+    // Receive Requests scatter the GRH and every segment of the payload,
+    // gather Send Requests a header and every segment of the payload
+    if (max_recv_sge > 2 || max_send_sge > 1) {
+        struct ibv_device_attr device_attr;
+        if (ibv_query_device(endpoint->context, &device_attr)
+            || device_attr.max_sge < max_recv_sge || device_attr.max_sge < max_send_sge) {
+            fprintf(stderr, "Scatter layout, header policy, and gather segments need %d "
+                    "SGEs per Work Request, more than the device supports.\n",
+                    max_recv_sge > max_send_sge ? max_recv_sge : max_send_sge);
+            return 1;
+        }
+    }
+
+    struct ibv_qp_init_attr init_attr = {
+        .send_cq = endpoint->completion_queue,
+        .recv_cq = endpoint->completion_queue,
+        .srq     = srq,
+        .cap     = {
+            // RC clients keep room for the read of the server's credits
+            .max_send_wr  = endpoint->queue_size + (transport == RDMA_TRANSPORT_RC),
+            .max_recv_wr  = srq ? 0 : endpoint->queue_size,
+            .max_send_sge = max_send_sge,
+            .max_recv_sge = srq ? 0 : max_recv_sge,
+            .max_inline_data = endpoint->options.disable_inline ? 0 : MAX_INLINE_REQUEST
+        },
+        .qp_type = qp_types[transport],
+    };
+
+    endpoint->queue_pair = ibv_create_qp(endpoint->protection_domain, &init_attr);
+    if (!endpoint->queue_pair && init_attr.cap.max_inline_data) {
+        init_attr.cap.max_inline_data = 0;
+        endpoint->queue_pair = ibv_create_qp(endpoint->protection_domain, &init_attr);
+    }
+    if (!endpoint->queue_pair)  {
+        fprintf(stderr, "Couldn't create queue pair.\n");
+        return 1;
+    }
+
+    // Small messages are sent inline, see post_send_run()
+    struct ibv_qp_attr attr;
+    if (!endpoint->options.disable_inline
+        && !ibv_query_qp(endpoint->queue_pair, &attr, IBV_QP_CAP, &init_attr)) {
+        endpoint->max_inline = init_attr.cap.max_inline_data;
+    }
+
+    attr.qp_state   = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num   = IB_PORT;
+    attr.qkey       = 0x11111111;
+
+    if (transport != RDMA_TRANSPORT_UD) {
+        attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
+        if (ibv_modify_qp(endpoint->queue_pair, &attr,
+                          IBV_QP_STATE|IBV_QP_PKEY_INDEX|IBV_QP_PORT|IBV_QP_ACCESS_FLAGS)) {
+            fprintf(stderr, "Failed to initialise queue pair.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, IBV_QP_STATE|IBV_QP_PKEY_INDEX|IBV_QP_PORT|IBV_QP_QKEY)) {
+        fprintf(stderr, "Failed to initialise queue pair.\n");
+        return 1;
+    }
+
+    attr.qp_state = IBV_QPS_RTR;
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, IBV_QP_STATE)) {
+        fprintf(stderr, "Failed to make queue pair ready to receive.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Common ibverbs initialisation shared by the client and server:
+//
+//   - Allocate the endpoint state
+//   - Check for and open the specified IB device
+//   - Create an ibverbs context for the device
+//   - Find the IB_PORT to use
+//   - Create a protection domain
+//   - Create a completion queue, with a completion channel if requested
+//   - Create a queue pair of the requested transport (Unreliable Datagram by
+//     default) for the completion queue
+//   - Configure the queue pair to use the found IB_PORT and transition a UD
+//     queue pair to the RTR (Ready-to-Receive) state
+//
+// Returns NULL on failure, after reporting the error on stderr and releasing
+// everything allocated so far.
+static struct rdma_endpoint *
+rdma_init
+(char *dev_name, int completion_queue_size, const struct rdma_options *options)
+{
+    struct rdma_endpoint *endpoint = calloc(1, sizeof *endpoint);
+    if (!endpoint) {
+        fprintf(stderr, "Couldn't allocate endpoint.\n");
+        return NULL;
+    }
+
+    endpoint->page_size = sysconf(_SC_PAGESIZE);
+    endpoint->queue_size = completion_queue_size;
+    endpoint->send_flags = IBV_SEND_SIGNALED;
+    if (options) endpoint->options = *options;
+
+    endpoint->context = open_device(dev_name);
+    if (!endpoint->context) goto clean_endpoint;
+
+    endpoint->numa_node = device_numa_node(endpoint->context);
+
+    endpoint->max_mtu = query_max_mtu(endpoint->context);
+    if (!endpoint->max_mtu) goto clean_endpoint;
+
+    endpoint->protection_domain = ibv_alloc_pd(endpoint->context);
+    if (!endpoint->protection_domain) {
+        fprintf(stderr, "Failed to allocate protection domain.\n");
+        goto clean_endpoint;
+    }
+
+    if (create_completion_queue(endpoint)) goto clean_endpoint;
+    if (create_queue_pair(endpoint)) goto clean_endpoint;
+
+    return endpoint;
+
+  clean_endpoint:
+    internal_rdma_cleanup(endpoint);
+    fprintf(stderr, "Failed to initialise RDMA context.\n");
+    return NULL;
+}
+
+// Pick the message size and data buffer stride of an endpoint. Without the
+// message_size option the message size is the largest datagram the port
+// carries, up to MSG_SIZE, an explicit size must fit in the port MTU. The
+// messages of connected transports are segmented by the NIC, so they default
+// to MSG_SIZE and may exceed the MTU. The stride pads every slot to a
+// multiple of the stride_alignment option, a cache line by default.
+//
+// With the scatter layout option the message size is the sum of the segment
+// lengths, and every segment gets its own stride, padded the same way.
+static int
+configure_message_size(struct rdma_endpoint *endpoint)
+{
+    size_t size = endpoint->options.message_size;
+    size_t alignment = endpoint->options.stride_alignment;
+    bool connected = endpoint->options.transport != RDMA_TRANSPORT_UD;
+    int num_segments = endpoint->options.scatter_segments;
+
+    if (num_segments > 0) {
+        size_t total = 0;
+        for (int i = 0; i < num_segments; i++) total += endpoint->options.scatter_layout[i];
+        if (size && size != total) {
+            fprintf(stderr, "Message size %zu doesn't match the %zu bytes of the scatter "
+                    "layout.\n", size, total);
+            return 1;
+        }
+        size = total;
+    }
+
+    if (!size) size = MSG_SIZE < endpoint->max_mtu || connected ? MSG_SIZE : endpoint->max_mtu;
+    if (size > endpoint->max_mtu && !connected) {
+        fprintf(stderr, "Message size %zu exceeds the port MTU of %u bytes.\n",
+                size, endpoint->max_mtu);
+        return 1;
+    }
+
+    if (!alignment) alignment = CACHE_LINE_SIZE;
+    if (alignment & (alignment - 1)) {
+        fprintf(stderr, "Stride alignment %zu is not a power of two.\n", alignment);
+        return 1;
+    }
+
+    endpoint->message_size = size;
+    endpoint->stride = (size + alignment - 1) & ~(alignment - 1);
+
+    if (num_segments <= 0 || endpoint->segments) return 0;
+
+    endpoint->segments = calloc(num_segments, sizeof *endpoint->segments);
+    if (!endpoint->segments) {
+        fprintf(stderr, "Couldn't allocate scatter layout.\n");
+        return 1;
+    }
+
+    endpoint->num_segments = num_segments;
+    for (int i = 0; i < num_segments; i++) {
+        size_t length = endpoint->options.scatter_layout[i];
+        if (!length) {
+            fprintf(stderr, "Segment %d of the scatter layout is empty.\n", i);
+            return 1;
+        }
+        endpoint->segments[i].length = length;
+        endpoint->segments[i].stride = (length + alignment - 1) & ~(alignment - 1);
+    }
+    endpoint->stride = endpoint->segments[0].stride;
+
+    return 0;
+}
+
+// Allocate the receive ring of an endpoint: a data buffer and header buffer
+// with one slot per completion queue entry, the recv_buffer array indexing
+// them, and the SGEs and (circularly linked) Receive Requests for each slot.
+// Every Receive Request scatters 'header_size' bytes into its header slot and
+// the payload into its data slot. With 'trailer' set a third SGE receives the
+// invariant CRC that follows the payload of raw RoCEv2 frames, all Receive
+// Requests share a single trailer slot at the end of the header buffer. With
+// a 'header_size' of 0 there is no header buffer and the Receive Requests
+// carry no SGEs at all, for connected endpoints the peer writes the payload.
+// With a scatter layout the payload is scattered over an SGE per segment,
+// each into its own array, the first of which is the data buffer.
+//
+// The header policy applies to GRHs only. RDMA_HEADERS_DISCARD points the
+// header SGE of every Receive Request at one shared sink slot, which stays
+// hot in cache instead of streaming a header slot per datagram through it.
+// RDMA_HEADERS_COMPACT splits the header into three SGEs, scattering the
+// source GID into a compact side array and the rest of the GRH into the sink.
+static int
+init_recv_ring(struct rdma_endpoint *endpoint, size_t header_size, bool trailer)
+{
+    int queue_size = endpoint->queue_size;
+    enum rdma_header_policy policy = RDMA_HEADERS_KEEP;
+
+    if (header_size == sizeof (struct ib_grh) && !trailer) {
+        policy = endpoint->options.header_policy;
+    }
+
+    int header_slots = policy == RDMA_HEADERS_KEEP ? queue_size : 1;
+    size_t header_buffer_size = header_slots * header_size + (trailer ? ICRC_SIZE : 0);
+
+    if (configure_message_size(endpoint)) return 1;
+
+    int num_segments = endpoint->num_segments ? endpoint->num_segments : 1;
+    endpoint->header_size = header_size;
+    endpoint->recv_trailer = trailer;
+    endpoint->header_sges = policy == RDMA_HEADERS_COMPACT ? 3 : 1;
+    endpoint->num_recv_sge = header_size ? endpoint->header_sges + num_segments + trailer : 0;
+
+    // The pool of an SRQ group receives through the shared receive queue,
+    // raw RoCEv2 frames (with a trailer) through a raw packet queue pair, and
+    // the peer of a connected endpoint writes into the ring.
+    if (endpoint->group && endpoint->group->srq) {
+        configure_on_demand_paging(endpoint, IBV_ODP_SUPPORT_SRQ_RECV);
+    } else if (endpoint->remote_access) {
+        configure_on_demand_paging(endpoint, IBV_ODP_SUPPORT_WRITE);
+    } else {
+        configure_on_demand_paging(endpoint, trailer ? 0 : IBV_ODP_SUPPORT_RECV);
+    }
+
+    if (allocate_buf(endpoint, &endpoint->buffer, queue_size * endpoint->stride, endpoint->stride)) {
+        return 1;
+    }
+
+    for (int i = 1; i < endpoint->num_segments; i++) {
+        struct payload_segment *segment = &endpoint->segments[i];
+        if (allocate_buf(endpoint, &segment->buf, queue_size * segment->stride, segment->stride)) {
+            return 1;
+        }
+    }
+
+    if (header_size
+        && allocate_buf(endpoint, &endpoint->header_buffer, header_buffer_size, header_size)) {
+        return 1;
+    }
+
+    size_t compact_size = sizeof (struct rdma_compact_header);
+    if (policy == RDMA_HEADERS_COMPACT
+        && allocate_buf(endpoint, &endpoint->compact_headers, queue_size * compact_size,
+                        compact_size)) {
+        return 1;
+    }
+
+    struct recv_buffer *result = malloc(queue_size * (sizeof *result));
+    endpoint->recv_buffers = result;
+    if (!result) return 1;
+
+    int num_sge = endpoint->num_recv_sge;
+    struct ibv_sge *scatter_gather = malloc(queue_size * (num_sge ? num_sge : 1) * (sizeof *scatter_gather));
+    endpoint->scatter_gather = scatter_gather;
+    if (!scatter_gather) return 1;
+
+    struct ibv_recv_wr *recv_requests = malloc(queue_size * (sizeof *recv_requests));
+    endpoint->recv_requests = recv_requests;
+    if (!recv_requests) return 1;
+
+    if (slot_ring_init(&endpoint->recv_free, queue_size)) return 1;
+
+    // The recycling window holds as many slots, payload and header, as fit
+    // in the budget. Slots of a connected endpoint are picked by the peer.
+    endpoint->recv_window = queue_size;
+    size_t budget = endpoint->options.recycle_budget;
+    if (budget && !endpoint->remote_access) {
+        size_t slot_bytes = endpoint->stride;
+        for (int i = 1; i < endpoint->num_segments; i++) {
+            slot_bytes += endpoint->segments[i].stride;
+        }
+        if (policy == RDMA_HEADERS_KEEP) slot_bytes += header_size;
+
+        size_t window = budget / slot_bytes;
+        endpoint->recycle_lifo = true;
+        endpoint->recv_window = window < 1 ? 1 : window < (size_t) queue_size ? (int) window : queue_size;
+        fprintf(stderr, "Recycling %d of %d receive slots, most recently released first\n",
+                endpoint->recv_window, queue_size);
+    }
+
+    int window = endpoint->recv_window;
+    endpoint->recv_low_watermark = endpoint->options.recv_low_watermark;
+    if (endpoint->recv_low_watermark <= 0 || endpoint->recv_low_watermark >= window) {
+        endpoint->recv_low_watermark = window / 2;
+    }
+
+    if (endpoint->options.timestamps) {
+        endpoint->poll_times = calloc(queue_size, sizeof *endpoint->poll_times);
+        if (!endpoint->poll_times) return 1;
+    }
+
+    endpoint->lease_refs = calloc(queue_size, sizeof *endpoint->lease_refs);
+    endpoint->returned_next = malloc(queue_size * (sizeof *endpoint->returned_next));
+    if (!endpoint->lease_refs || !endpoint->returned_next) return 1;
+    atomic_init(&endpoint->returned_head, -1);
+    atomic_init(&endpoint->leases, 0);
+
+    char *header_buffers = endpoint->header_buffer.addr;
+    char *data_buffers = endpoint->buffer.addr;
+    struct rdma_compact_header *compact = endpoint->compact_headers.addr;
+    for (int i = 0; i < queue_size; i++) {
+        struct ibv_sge *sge = &scatter_gather[num_sge * i];
+        char *header = &header_buffers[(policy == RDMA_HEADERS_KEEP ? i : 0) * header_size];
+
+        result[i].header_buffer = header_size && policy == RDMA_HEADERS_KEEP
+                                ? (struct ib_grh *) header : NULL;
+        result[i].data_buffer = &data_buffers[i * endpoint->stride];
+        result[i].source = compact ? &compact[i] : NULL;
+
+        recv_requests[i].wr_id = i;
+        if (i == queue_size - 1) {
+            recv_requests[i].next = &recv_requests[0];
+        } else {
+            recv_requests[i].next = &recv_requests[i+1];
+        }
+        recv_requests[i].sg_list = sge;
+        recv_requests[i].num_sge = num_sge;
+
+        if (!num_sge) continue;
+
+        sge[0].addr = (uintptr_t) header;
+        sge[0].length = header_size;
+        sge[0].lkey = buf_lkey(&endpoint->header_buffer, header);
+
+        if (policy == RDMA_HEADERS_COMPACT) {
+            // GRH bytes 8 to 24 hold the source GID
+            struct ib_grh *grh = (struct ib_grh *) header;
+            size_t sgid_offset = offsetof(struct ib_grh, source);
+            size_t dgid_offset = offsetof(struct ib_grh, dest);
+
+            sge[0].length = sgid_offset;
+            sge[1].addr = (uintptr_t) &compact[i].sgid;
+            sge[1].length = sizeof compact[i].sgid;
+            sge[1].lkey = buf_lkey(&endpoint->compact_headers, &compact[i]);
+            sge[2].addr = (uintptr_t) grh->dest;
+            sge[2].length = header_size - dgid_offset;
+            sge[2].lkey = sge[0].lkey;
+        }
+
+        struct ibv_sge *payload = &sge[endpoint->header_sges];
+        payload[0].addr = (uintptr_t) result[i].data_buffer;
+        payload[0].length = endpoint->message_size;
+        payload[0].lkey = buf_lkey(&endpoint->buffer, result[i].data_buffer);
+
+        for (int j = 1; j < endpoint->num_segments; j++) {
+            struct payload_segment *segment = &endpoint->segments[j];
+            char *slot = (char *) segment->buf.addr + i * segment->stride;
+
+            payload[j].addr = (uintptr_t) slot;
+            payload[j].length = segment->length;
+            payload[j].lkey = buf_lkey(&segment->buf, slot);
+        }
+        if (endpoint->num_segments) payload[0].length = endpoint->segments[0].length;
+
+        if (trailer) {
+            struct ibv_sge *crc = &sge[num_sge - 1];
+            crc->addr = (uintptr_t) &header_buffers[header_slots * header_size];
+            crc->length = ICRC_SIZE;
+            crc->lkey = buf_lkey(&endpoint->header_buffer, (void *) (uintptr_t) crc->addr);
+        }
+    }
+
+    return 0;
+}
+
+// Allocate the buffers of the block placement mode: 'placement_blocks' block
+// buffers of 'block_packets' data slots, a single GRH sink slot shared by all
+// Receive Requests, since blocks never expose the headers, a spill slot per
+// Receive Request, and the Receive
+// Requests themselves. Receive Requests are not tied to a slot, they are
+// pointed at the slot of the sequence number they expect when posted.
+static int
+init_block_placement(struct rdma_endpoint *endpoint)
+{
+    int queue_size = endpoint->queue_size;
+    size_t header_size = sizeof (struct ib_grh);
+
+    struct block_placement *placement = calloc(1, sizeof *placement);
+    endpoint->placement = placement;
+    if (!placement) return 1;
+
+    placement->block_packets = endpoint->options.block_packets;
+    placement->num_blocks = endpoint->options.placement_blocks > 0
+                          ? endpoint->options.placement_blocks : 4;
+    placement->bitmap_words = (placement->block_packets + 63) / 64;
+
+    endpoint->header_size = header_size;
+    endpoint->header_sges = 1;
+    endpoint->num_recv_sge = 2;
+
+    if (configure_message_size(endpoint)) return 1;
+    configure_on_demand_paging(endpoint, IBV_ODP_SUPPORT_RECV);
+
+    int num_slots = placement->num_blocks * placement->block_packets;
+    placement->block_bytes = placement->block_packets * endpoint->stride;
+    if (allocate_buf(endpoint, &endpoint->buffer, num_slots * endpoint->stride, endpoint->stride)
+        || allocate_buf(endpoint, &endpoint->header_buffer, header_size, header_size)) {
+        return 1;
+    }
+
+    int words = placement->num_blocks * placement->bitmap_words;
+    placement->slot_pending = calloc(num_slots, sizeof *placement->slot_pending);
+    placement->block_pending = calloc(placement->num_blocks, sizeof *placement->block_pending);
+    placement->block_received = calloc(placement->num_blocks, sizeof *placement->block_received);
+    placement->received = calloc(words, sizeof *placement->received);
+    placement->missing = calloc(words, sizeof *placement->missing);
+    placement->spill = malloc(queue_size * endpoint->stride);
+    placement->spill_of = malloc(num_slots * (sizeof *placement->spill_of));
+    if (!placement->slot_pending || !placement->block_pending || !placement->block_received
+        || !placement->received || !placement->missing || !placement->spill
+        || !placement->spill_of || slot_ring_init(&placement->spill_free, queue_size)) {
+        fprintf(stderr, "Couldn't allocate block placement state.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < num_slots; i++) placement->spill_of[i] = -1;
+    for (int i = 0; i < queue_size; i++) slot_ring_push(&placement->spill_free, i);
+
+    struct ibv_sge *scatter_gather = calloc(queue_size * 2, sizeof *scatter_gather);
+    struct ibv_recv_wr *recv_requests = calloc(queue_size, sizeof *recv_requests);
+    endpoint->scatter_gather = scatter_gather;
+    endpoint->recv_requests = recv_requests;
+    if (!scatter_gather || !recv_requests) return 1;
+
+    char *header_buffers = endpoint->header_buffer.addr;
+    for (int i = 0; i < queue_size; i++) {
+        struct ibv_sge *sge = &scatter_gather[2 * i];
+
+        sge[0].addr = (uintptr_t) header_buffers;
+        sge[0].length = header_size;
+        sge[0].lkey = buf_lkey(&endpoint->header_buffer, header_buffers);
+        sge[1].length = endpoint->message_size;
+
+        recv_requests[i].sg_list = sge;
+        recv_requests[i].num_sge = 2;
+    }
+
+    return 0;
+}
+
+int
+rdma_local_address(struct rdma_endpoint *endpoint, int *lid, union ibv_gid *gid)
+{
+    struct ibv_port_attr port_attr;
+    if (ibv_query_gid(endpoint->context, IB_PORT, 0, gid)
+        || ibv_query_port(endpoint->context, IB_PORT, &port_attr)) {
+        fprintf(stderr, "Couldn't query local address\n");
+        return -1;
+    }
+
+    *lid = port_attr.lid;
+    return 0;
+}
+
+// Query and report the Local ID, queue pair number, and global ID on stderr
+static int
+report_address(struct ibv_context *context, uint32_t qpn)
+{
+    union ibv_gid gid;
+    char gid_string[INET6_ADDRSTRLEN];
+
+    if (ibv_query_gid(context, IB_PORT, 0, &gid)) {
+        fprintf(stderr, "Could not get local gid for gid index 0\n");
+        return 1;
+    }
+
+    struct ibv_port_attr port_attr;
+    if (ibv_query_port(context, IB_PORT, &port_attr)) {
+        fprintf(stderr, "Couldn't get port info\n");
+        return 1;
+    }
+
+    if (!inet_ntop(AF_INET6, &gid, gid_string, sizeof gid_string)) {
+        fprintf(stderr, "Couldn't get global id\n");
+        return 1;
+    }
+
+    fprintf(stderr, "LID: %d\nQPN: %d\nGID: %s\n", port_attr.lid, qpn, gid_string);
+    return 0;
+}
+
+// Allocate and register the credit counter of an RC endpoint, readable by
+// the client for a server. Returns 1 on failure.
+static int
+init_credit(struct rdma_endpoint *endpoint, int access)
+{
+    if (posix_memalign((void **) &endpoint->credit, CACHE_LINE_SIZE, CACHE_LINE_SIZE)) {
+        endpoint->credit = NULL;
+        fprintf(stderr, "Couldn't allocate credit counter.\n");
+        return 1;
+    }
+    atomic_init(endpoint->credit, 0);
+
+    endpoint->credit_mr = ibv_reg_mr(endpoint->protection_domain, endpoint->credit,
+                                     sizeof *endpoint->credit, access);
+    if (!endpoint->credit_mr) {
+        fprintf(stderr, "Couldn't register credit counter.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Server specific ibverbs initialisation. The endpoint holds an array of
+// "struct recv_buffer", we allocate one entry per (potential) completion queue
+// element. These struct hold offsets into the header and data buffers used to
+// receive ibverbs datagrams, splitting these buffers into 1 entry per incoming
+// ibverbs datagram.
+//
+// Initialisation steps:
+//   - Call the shared ibverbs initialisation
+//   - Allocate a data buffer big enough to store the payload for a number of
+//     messages equal to the completion queue size
+//   - Allocate a header buffer big enough to store the header information for
+//     a number of messages equal to the completion queue size
+//   - Allocate a recv_buffer array, contains offsets into data and header
+//     buffers to easily index the data "per datagram"
+//   - Allocate an array for the sge (scatter-gather) configurations for each
+//     of the recv_buffer entries
+//   - Allocate an array of Receive Requests for each of the recv_buffer
+//     entries
+//   - Finally query and report the Local ID, queue pair number, and global ID
+//     on stderr
+//
+// Endpoints of a connected transport have no header buffer, the client writes
+// the payload into the data buffer, which is registered for remote writes.
+// They only receive once connected with rdma_accept().
+//
+// Returns NULL on failure.
+struct rdma_endpoint *
+rdma_init_server
+(char *dev_name, int completion_queue_size, const struct rdma_options *options)
+{
+    struct rdma_endpoint *endpoint;
+
+    endpoint = rdma_init(dev_name, completion_queue_size, options);
+    if (!endpoint) return NULL;
+
+    bool connected = endpoint->options.transport != RDMA_TRANSPORT_UD;
+    if (connected) endpoint->remote_access = IBV_ACCESS_REMOTE_WRITE;
+
+    int failed;
+    if (endpoint->options.scatter_segments > 0
+        && (connected || endpoint->options.block_packets > 0)) {
+        fprintf(stderr, "Scatter layouts need an Unreliable Datagram endpoint with a "
+                "circular buffer.\n");
+        failed = 1;
+    } else if (endpoint->options.block_packets > 0) {
+        failed = connected || init_block_placement(endpoint);
+        if (connected) fprintf(stderr, "Block placement needs an Unreliable Datagram endpoint.\n");
+    } else {
+        failed = init_recv_ring(endpoint, connected ? 0 : sizeof (struct ib_grh), false);
+    }
+
+    // UC has no RDMA READ, so its clients can't read credits
+    if (!failed && endpoint->options.transport == RDMA_TRANSPORT_RC) {
+        endpoint->slot_reposted = calloc(endpoint->queue_size, sizeof *endpoint->slot_reposted);
+        failed = !endpoint->slot_reposted || init_credit(endpoint, IBV_ACCESS_REMOTE_READ);
+    }
+
+    if (failed || report_address(endpoint->context, endpoint->queue_pair->qp_num)) {
+        rdma_cleanup(endpoint);
+        return NULL;
+    }
+
+    return endpoint;
+}
+
+// Allocate the send ring of a client endpoint: a data buffer with one slot
+// per completion queue entry, the send_buffer array indexing it, the free
+// list and signaling state, and an SGE and (circularly linked) Send Request
+// for each slot. The transport specific fields of the Send Requests are left
+// to the caller. Returns 1 on failure.
+static int
+init_send_ring(struct rdma_endpoint *endpoint)
+{
+    int queue_size = endpoint->queue_size;
+
+    // Gather sends acquire their slot, which concurrent senders never do
+    if (endpoint->options.gather_segments > 0 && endpoint->options.concurrent_send) {
+        fprintf(stderr, "Gather sends don't work with concurrent senders.\n");
+        return 1;
+    }
+
+    configure_on_demand_paging(endpoint, IBV_ODP_SUPPORT_SEND);
+
+    if (configure_message_size(endpoint)
+        || allocate_buf(endpoint, &endpoint->buffer, queue_size * endpoint->stride,
+                        endpoint->stride)) {
+        return 1;
+    }
+
+    // A signal interval beyond the queue size would never signal a full send
+    // queue, leaving no completion to free it.
+    endpoint->signal_interval = endpoint->options.signal_interval;
+    if (endpoint->signal_interval < 1) endpoint->signal_interval = 1;
+    if (endpoint->signal_interval > queue_size) {
+        endpoint->signal_interval = queue_size;
+    }
+
+    struct send_buffer *result = malloc(queue_size * (sizeof *result));
+    endpoint->send_buffers = result;
+    if (!result) return 1;
+
+    endpoint->send_covers = calloc(queue_size, sizeof *endpoint->send_covers);
+    if (!endpoint->send_covers
+        || slot_ring_init(&endpoint->send_free, queue_size)
+        || slot_ring_init(&endpoint->send_posted, queue_size)) {
+        fprintf(stderr, "Couldn't allocate send slots.\n");
+        return 1;
+    }
+
+    // Concurrent senders reserve tickets instead of acquiring slots
+    if (endpoint->options.concurrent_send) {
+        endpoint->send_ready = calloc(queue_size, sizeof *endpoint->send_ready);
+        if (!endpoint->send_ready) {
+            fprintf(stderr, "Couldn't allocate send slots.\n");
+            return 1;
+        }
+        atomic_flag_clear(&endpoint->send_combining);
+    } else {
+        for (int i = 0; i < queue_size; i++) {
+            slot_ring_push(&endpoint->send_free, i);
+        }
+    }
+
+    // Gather sends draw their payload from application memory, registered
+    // through a cache
+    int gather = endpoint->options.gather_segments > 0 ? endpoint->options.gather_segments : 0;
+    endpoint->gather_segments = gather;
+    if (gather) {
+        int entries = endpoint->options.mr_cache_entries;
+        endpoint->mr_cache = mr_cache_create(endpoint->protection_domain,
+                                             entries > 0 ? entries : 64, 0);
+        endpoint->gather_refs = calloc(queue_size * gather, sizeof *endpoint->gather_refs);
+        endpoint->gather_counts = calloc(queue_size, sizeof *endpoint->gather_counts);
+        if (!endpoint->mr_cache) return 1;
+        if (!endpoint->gather_refs || !endpoint->gather_counts) {
+            fprintf(stderr, "Couldn't allocate gather references.\n");
+            return 1;
+        }
+    }
+
+    int num_sge = 1 + gather;
+    struct ibv_sge *scatter_gather = calloc(queue_size * num_sge, sizeof *scatter_gather);
+    endpoint->scatter_gather = scatter_gather;
+    if (!scatter_gather) return 1;
+
+    struct ibv_send_wr *send_requests = calloc(queue_size, sizeof *send_requests);
+    endpoint->send_requests = send_requests;
+    if (!send_requests) return 1;
+
+    char *data_buffers = endpoint->buffer.addr;
+    for (int i = 0; i < queue_size; i++) {
+        result[i].data_buffer = &data_buffers[i * endpoint->stride];
+
+        struct ibv_sge *sge = &scatter_gather[i * num_sge];
+        sge->addr = (uintptr_t) result[i].data_buffer;
+        sge->length = endpoint->message_size;
+        sge->lkey = buf_lkey(&endpoint->buffer, result[i].data_buffer);
+
+        send_requests[i].wr_id = i;
+        if (i == queue_size - 1) {
+            send_requests[i].next = &send_requests[0];
+        } else {
+            send_requests[i].next = &send_requests[i+1];
+        }
+        send_requests[i].sg_list = sge;
+        send_requests[i].num_sge = 1;
+        send_requests[i].opcode = IBV_WR_SEND;
+        send_requests[i].send_flags = endpoint->send_flags;
+    }
+
+    return 0;
+}
+
+// Release the cached registrations a gather send from 'slot' referenced
+static void
+release_gather_refs(struct rdma_endpoint *endpoint, int slot)
+{
+    struct mr_cache_entry **refs = &endpoint->gather_refs[slot * endpoint->gather_segments];
+
+    for (int i = 0; i < endpoint->gather_counts[slot]; i++) {
+        mr_cache_release(endpoint->mr_cache, refs[i]);
+    }
+    endpoint->gather_counts[slot] = 0;
+}
+
+// Client specific ibverbs initialisation. The endpoint holds an array of
+// "struct send_buffer", we allocate one entry per (potential) completion queue
+// element. These struct hold offsets into the data buffer used to
+// receive ibverbs datagrams, splitting it into 1 entry per outgoing ibverbs
+// datagram.
+//
+// Initialisation steps:
+//   - Call the shared ibverbs initialisation
+//   - Allocate the send ring (see init_send_ring())
+//   - Transition the queue pair from RTR (Ready-to-Receive) to RTS
+//     (Ready-to-Send)
+//   - Create an Address Handle to address for the server using its local ID,
+//     global ID, and queue pair number
+//   - Address the Send Requests of every slot to the server
+//
+// Returns NULL on failure.
+struct rdma_endpoint *
+rdma_init_client
+( char *dev_name
+, int completion_queue_size
+, int lid
+, union ibv_gid gid
+, uint32_t qpn
+, const struct rdma_options *options
+)
+{
+    struct rdma_endpoint *endpoint = rdma_init(dev_name, completion_queue_size, options);
+    if (!endpoint) return NULL;
+
+    if (endpoint->options.transport != RDMA_TRANSPORT_UD) {
+        fprintf(stderr, "Connected endpoints are created with rdma_connect().\n");
+        rdma_cleanup(endpoint);
+        return NULL;
+    }
+
+    if (init_send_ring(endpoint)) {
+        rdma_cleanup(endpoint);
+        return NULL;
+    }
+
+    struct ibv_qp_attr attr;
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn   = 0;
+
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, IBV_QP_STATE|IBV_QP_SQ_PSN)) {
+        fprintf(stderr, "Failed to make queue pair ready to send.\n");
+        rdma_cleanup(endpoint);
+        return NULL;
+    }
+
+    struct ibv_ah_attr ah_attr;
+    memset(&ah_attr, 0, sizeof(ah_attr));
+    ah_attr.dlid          = lid;
+    ah_attr.sl            = 0; // ??
+    ah_attr.src_path_bits = 0;
+    ah_attr.port_num      = IB_PORT;
+    ah_attr.is_global = 1;
+    ah_attr.grh.hop_limit = 1;
+    ah_attr.grh.dgid = gid;
+    ah_attr.grh.sgid_index = 0; // ??
+
+    errno = 0;
+    endpoint->ah = ibv_create_ah(endpoint->protection_domain, &ah_attr);
+    if (!endpoint->ah) {
+        char *msg = errno != 0 ? strerror(errno) : "";
+        fprintf(stderr, "Failed to create AH: %s\n", msg);
+        rdma_cleanup(endpoint);
+        return NULL;
+    }
+
+    for (int i = 0; i < completion_queue_size; i++) {
+        struct ibv_send_wr *wr = &endpoint->send_requests[i];
+        wr->wr.ud.ah = endpoint->ah;
+        wr->wr.ud.remote_qpn = qpn;
+        wr->wr.ud.remote_qkey = 0x11111111;
+    }
+
+    configure_rate_limit(endpoint);
+    return endpoint;
+}
+
+// Fill in the connection_info of an endpoint, in network byte order: its
+// queue pair, and for server endpoints the location and remote keys of its
+// receive ring.
+static int
+local_connection_info(struct rdma_endpoint *endpoint, struct connection_info *info)
+{
+    struct registered_buffer *buf = &endpoint->buffer;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+
+    memset(info, 0, sizeof *info);
+
+    if (ibv_query_gid(endpoint->context, IB_PORT, 0, &gid)
+        || ibv_query_port(endpoint->context, IB_PORT, &port_attr)) {
+        fprintf(stderr, "Couldn't get port info\n");
+        return 1;
+    }
+
+    info->qpn = htonl(endpoint->queue_pair->qp_num);
+    info->lid = htonl(port_attr.lid);
+    memcpy(info->gid, gid.raw, sizeof info->gid);
+
+    if (!endpoint->recv_requests) return 0;
+
+    if (buf->num_mrs > MAX_REMOTE_MRS) {
+        fprintf(stderr, "Receive ring has more than %d memory regions.\n", MAX_REMOTE_MRS);
+        return 1;
+    }
+
+    info->ring_addr = htobe64((uintptr_t) buf->addr);
+    info->stride = htobe64(endpoint->stride);
+    info->message_size = htobe64(endpoint->message_size);
+    info->chunk_size = htobe64(buf->chunk_size);
+    info->num_slots = htonl(endpoint->queue_size);
+    info->num_mrs = htonl(buf->num_mrs);
+    for (int i = 0; i < buf->num_mrs; i++) {
+        info->rkeys[i] = htonl(buf->mrs[i]->rkey);
+    }
+    if (endpoint->credit_mr) {
+        info->credit_addr = htobe64((uintptr_t) endpoint->credit);
+        info->credit_rkey = htonl(endpoint->credit_mr->rkey);
+    }
+
+    return 0;
+}
+
+// Convert a connection_info received from the peer to host byte order
+static void
+remote_connection_info(struct connection_info *info)
+{
+    info->ring_addr = be64toh(info->ring_addr);
+    info->credit_addr = be64toh(info->credit_addr);
+    info->credit_rkey = ntohl(info->credit_rkey);
+    info->stride = be64toh(info->stride);
+    info->message_size = be64toh(info->message_size);
+    info->chunk_size = be64toh(info->chunk_size);
+    info->qpn = ntohl(info->qpn);
+    info->psn = ntohl(info->psn);
+    info->num_slots = ntohl(info->num_slots);
+    info->num_mrs = ntohl(info->num_mrs);
+    info->lid = ntohl(info->lid);
+    for (int i = 0; i < MAX_REMOTE_MRS; i++) info->rkeys[i] = ntohl(info->rkeys[i]);
+}
+
+// Send our connection_info over a connected TCP socket and receive the
+// peer's, in host byte order.
+static int
+exchange_connection_info
+(struct rdma_endpoint *endpoint, int sock, struct connection_info *remote)
+{
+    struct connection_info local;
+    if (local_connection_info(endpoint, &local)) return 1;
+
+    char *out = (char *) &local;
+    for (size_t sent = 0; sent < sizeof local;) {
+        ssize_t n = write(sock, out + sent, sizeof local - sent);
+        if (n <= 0) {
+            perror("Couldn't send connection info");
+            return 1;
+        }
+        sent += n;
+    }
+
+    char *in = (char *) remote;
+    for (size_t received = 0; received < sizeof *remote;) {
+        ssize_t n = read(sock, in + received, sizeof *remote - received);
+        if (n <= 0) {
+            fprintf(stderr, "Couldn't receive connection info.\n");
+            return 1;
+        }
+        received += n;
+    }
+
+    remote_connection_info(remote);
+    return 0;
+}
+
+// Transition a connected queue pair from INIT to RTR (Ready-to-Receive),
+// addressing the peer's queue pair, and on to RTS (Ready-to-Send). RC queue
+// pairs retry indefinitely when the receiver has no Receive Request posted.
+static int
+connect_queue_pair(struct rdma_endpoint *endpoint, const struct connection_info *remote)
+{
+    bool reliable = endpoint->options.transport == RDMA_TRANSPORT_RC;
+    struct ibv_port_attr port_attr;
+
+    if (ibv_query_port(endpoint->context, IB_PORT, &port_attr)) {
+        fprintf(stderr, "Failed to query port info.\n");
+        return 1;
+    }
+
+    struct ibv_qp_attr attr = {
+        .qp_state           = IBV_QPS_RTR,
+        .path_mtu           = port_attr.active_mtu,
+        .dest_qp_num        = remote->qpn,
+        .rq_psn             = remote->psn,
+        .max_dest_rd_atomic = 1,
+        .min_rnr_timer      = 12,
+        .ah_attr            = {
+            .dlid      = remote->lid,
+            .is_global = 1,
+            .port_num  = IB_PORT,
+            .grh       = { .hop_limit = 1, .sgid_index = 0 },
+        },
+    };
+    memcpy(attr.ah_attr.grh.dgid.raw, remote->gid, sizeof remote->gid);
+
+    int mask = IBV_QP_STATE|IBV_QP_AV|IBV_QP_PATH_MTU|IBV_QP_DEST_QPN|IBV_QP_RQ_PSN;
+    if (reliable) mask |= IBV_QP_MAX_DEST_RD_ATOMIC|IBV_QP_MIN_RNR_TIMER;
+
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, mask)) {
+        fprintf(stderr, "Failed to make queue pair ready to receive.\n");
+        return 1;
+    }
+
+    attr.qp_state      = IBV_QPS_RTS;
+    attr.sq_psn        = 0;
+    attr.timeout       = 14;
+    attr.retry_cnt     = 7;
+    attr.rnr_retry     = 7;
+    attr.max_rd_atomic = 1;
+
+    mask = IBV_QP_STATE|IBV_QP_SQ_PSN;
+    if (reliable) {
+        mask |= IBV_QP_TIMEOUT|IBV_QP_RETRY_CNT|IBV_QP_RNR_RETRY|IBV_QP_MAX_QP_RD_ATOMIC;
+    }
+
+    if (ibv_modify_qp(endpoint->queue_pair, &attr, mask)) {
+        fprintf(stderr, "Failed to make queue pair ready to send.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Accept a single client of a connected server endpoint on TCP port 'port'.
+// Every receive slot is posted before the connection info is sent, so the
+// client never finds the receive queue empty when it starts writing. Returns
+// 1 on failure.
+int
+rdma_accept(struct rdma_endpoint *endpoint, const char *port)
+{
+    struct addrinfo hints = {
+        .ai_flags    = AI_PASSIVE,
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addrs;
+    struct connection_info remote;
+    int listener = -1, sock = -1, result = 1;
+
+    if (endpoint->options.transport == RDMA_TRANSPORT_UD) {
+        fprintf(stderr, "Unreliable Datagram endpoints need no connection.\n");
+        return 1;
+    }
+
+    int error = getaddrinfo(NULL, port, &hints, &addrs);
+    if (error) {
+        fprintf(stderr, "Couldn't resolve port %s: %s\n", port, gai_strerror(error));
+        return 1;
+    }
+
+    for (struct addrinfo *addr = addrs; addr && listener < 0; addr = addr->ai_next) {
+        listener = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (listener < 0) continue;
+
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+        if (bind(listener, addr->ai_addr, addr->ai_addrlen) || listen(listener, 1)) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (listener < 0) {
+        fprintf(stderr, "Couldn't listen on port %s\n", port);
+        return 1;
+    }
+
+    fprintf(stderr, "Waiting for a client on port %s\n", port);
+    sock = accept(listener, NULL, NULL);
+    close(listener);
+    if (sock < 0) {
+        perror("Couldn't accept client");
+        return 1;
+    }
+
+    if (post_recvs(endpoint, 0, endpoint->queue_size)) goto close_socket;
+
+    if (exchange_connection_info(endpoint, sock, &remote)
+        || connect_queue_pair(endpoint, &remote)) {
+        goto close_socket;
+    }
+
+    result = 0;
+
+  close_socket:
+    close(sock);
+    return result;
+}
+
+// Create a client endpoint of a connected transport and connect it to the
+// server accepting on 'host' and 'port'. The Send Requests of the endpoint
+// are RDMA WRITEs with immediate into the receive ring of the server, which
+// post_send_run() points at the next remote slot. Returns NULL on failure.
+struct rdma_endpoint *
+rdma_connect
+( char *dev_name
+, int completion_queue_size
+, const char *host
+, const char *port
+, const struct rdma_options *options
+)
+{
+    struct rdma_options connected_options = { .transport = RDMA_TRANSPORT_RC };
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addrs;
+    int sock = -1;
+
+    if (options) connected_options = *options;
+    if (connected_options.transport == RDMA_TRANSPORT_UD) {
+        connected_options.transport = RDMA_TRANSPORT_RC;
+    }
+
+    struct rdma_endpoint *endpoint =
+        rdma_init(dev_name, completion_queue_size, &connected_options);
+    if (!endpoint) return NULL;
+
+    if (connected_options.concurrent_send) {
+        fprintf(stderr, "Connected endpoints need the single-threaded send path for credits.\n");
+        goto clean_endpoint;
+    }
+
+    if (init_send_ring(endpoint)) goto clean_endpoint;
+
+    int error = getaddrinfo(host, port, &hints, &addrs);
+    if (error) {
+        fprintf(stderr, "Couldn't resolve %s:%s: %s\n", host, port, gai_strerror(error));
+        goto clean_endpoint;
+    }
+
+    for (struct addrinfo *addr = addrs; addr && sock < 0; addr = addr->ai_next) {
+        sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sock >= 0 && connect(sock, addr->ai_addr, addr->ai_addrlen)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (sock < 0) {
+        fprintf(stderr, "Couldn't connect to %s:%s\n", host, port);
+        goto clean_endpoint;
+    }
+
+    int failed = exchange_connection_info(endpoint, sock, &endpoint->remote);
+    close(sock);
+    if (failed) goto clean_endpoint;
+
+    struct connection_info *remote = &endpoint->remote;
+    if (!remote->num_slots || !remote->num_mrs || remote->num_mrs > MAX_REMOTE_MRS) {
+        fprintf(stderr, "Server advertised no usable receive ring.\n");
+        goto clean_endpoint;
+    }
+
+    if (endpoint->message_size > remote->message_size) {
+        fprintf(stderr, "Message size %zu exceeds the server's message size of %zu bytes.\n",
+                endpoint->message_size, (size_t) remote->message_size);
+        goto clean_endpoint;
+    }
+
+    if (connected_options.transport == RDMA_TRANSPORT_RC) {
+        if (!remote->credit_addr) {
+            fprintf(stderr, "Server advertised no credit counter.\n");
+            goto clean_endpoint;
+        }
+        if (init_credit(endpoint, IBV_ACCESS_LOCAL_WRITE)) goto clean_endpoint;
+    }
+
+    if (connect_queue_pair(endpoint, remote)) goto clean_endpoint;
+
+    for (int i = 0; i < completion_queue_size; i++) {
+        endpoint->send_requests[i].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    }
+
+    configure_rate_limit(endpoint);
+    return endpoint;
+
+  clean_endpoint:
+    rdma_cleanup(endpoint);
+    return NULL;
+}
+
+// Allocate an endpoint belonging to a server group. It borrows the device
+// context, protection domain, and options of the group and gets its own
+// completion queue. Returns NULL on failure.
+static struct rdma_endpoint *
+group_endpoint(struct rdma_server_group *group, int completion_queue_size)
+{
+    struct rdma_endpoint *endpoint = calloc(1, sizeof *endpoint);
+    if (!endpoint) {
+        fprintf(stderr, "Couldn't allocate endpoint.\n");
+        return NULL;
+    }
+
+    endpoint->page_size = sysconf(_SC_PAGESIZE);
+    endpoint->queue_size = completion_queue_size;
+    endpoint->send_flags = IBV_SEND_SIGNALED;
+    endpoint->max_mtu = group->max_mtu;
+    endpoint->options = group->options;
+    endpoint->numa_node = group->numa_node;
+    endpoint->group = group;
+    endpoint->context = group->context;
+    endpoint->protection_domain = group->protection_domain;
+
+    group->endpoints[group->num_endpoints++] = endpoint;
+
+    if (create_completion_queue(endpoint)) return NULL;
+
+    return endpoint;
+}
+
+// Release all endpoints of a group and the RSS objects referring to them.
+static void
+release_group_endpoints(struct rdma_server_group *group)
+{
+    if (group->flow) {
+        if (ibv_destroy_flow(group->flow)) {
+            fprintf(stderr, "Couldn't destroy flow.\n");
+            exit(EXIT_FAILURE);
+        }
+        group->flow = NULL;
+    }
+
+    if (group->rss_queue_pair) {
+        if (ibv_destroy_qp(group->rss_queue_pair)) {
+            fprintf(stderr, "Couldn't destroy RSS queue pair.\n");
+            exit(EXIT_FAILURE);
+        }
+        group->rss_queue_pair = NULL;
+    }
+
+    if (group->indirection_table) {
+        if (ibv_destroy_rwq_ind_table(group->indirection_table)) {
+            fprintf(stderr, "Couldn't destroy indirection table.\n");
+            exit(EXIT_FAILURE);
+        }
+        group->indirection_table = NULL;
+    }
+
+    for (int i = 0; i < group->num_endpoints; i++) {
+        rdma_cleanup(group->endpoints[i]);
+    }
+    group->num_endpoints = 0;
+}
+
+// Check whether the device can hash raw RoCEv2 frames over 'num_queues'
+// receive work queues.
+static bool
+rss_supported(struct ibv_context *context, int num_queues)
+{
+    struct ibv_device_attr_ex attr;
+    if (ibv_query_device_ex(context, NULL, &attr)) return false;
+
+    struct ibv_rss_caps *caps = &attr.rss_caps;
+    return (caps->supported_qpts & (1 << IBV_QPT_RAW_PACKET))
+        && (caps->rx_hash_function & IBV_RX_HASH_FUNC_TOEPLITZ)
+        && (caps->rx_hash_fields_mask & RSS_HASH_FIELDS) == RSS_HASH_FIELDS
+        && caps->max_rwq_indirection_tables > 0
+        && caps->max_rwq_indirection_table_size >= (uint32_t) num_queues
+        && attr.max_wq_type_rq >= (uint32_t) num_queues;
+}
+
+// RSS initialisation of a server group:
+//
+//   - Create one endpoint per queue, each with its own completion queue,
+//     receive work queue, and receive ring. The ring scatters the raw
+//     Ethernet/IPv4/UDP/BTH/DETH headers into the header slots.
+//   - Create an indirection table spreading its entries round-robin over the
+//     work queues
+//   - Create a raw packet queue pair hashing incoming frames over the
+//     indirection table
+//   - Steer all RoCEv2 traffic arriving at IB_PORT to that queue pair
+static int
+init_rss_group
+(struct rdma_server_group *group, int completion_queue_size, int num_queues)
+{
+    int log_table_size = 0;
+    while ((1 << log_table_size) < num_queues) log_table_size++;
+
+    struct ibv_wq **table = malloc((1 << log_table_size) * (sizeof *table));
+    if (!table) return 1;
+
+    for (int i = 0; i < num_queues; i++) {
+        struct rdma_endpoint *endpoint = group_endpoint(group, completion_queue_size);
+        if (!endpoint) goto clean_table;
+
+        struct ibv_wq_init_attr wq_attr = {
+            .wq_type = IBV_WQT_RQ,
+            .max_wr  = completion_queue_size,
+            .max_sge = 3,
+            .pd      = group->protection_domain,
+            .cq      = endpoint->completion_queue,
+        };
+
+        endpoint->work_queue = ibv_create_wq(group->context, &wq_attr);
+        if (!endpoint->work_queue) {
+            fprintf(stderr, "Couldn't create receive work queue.\n");
+            goto clean_table;
+        }
+
+        struct ibv_wq_attr attr = {
+            .attr_mask = IBV_WQ_ATTR_STATE,
+            .wq_state  = IBV_WQS_RDY,
+        };
+
+        if (ibv_modify_wq(endpoint->work_queue, &attr)) {
+            fprintf(stderr, "Failed to make receive work queue ready.\n");
+            goto clean_table;
+        }
+
+        if (init_recv_ring(endpoint, ROCE_V2_HEADER_SIZE, true)) goto clean_table;
+    }
+
+    for (int i = 0; i < (1 << log_table_size); i++) {
+        table[i] = group->endpoints[i % num_queues]->work_queue;
+    }
+
+    struct ibv_rwq_ind_table_init_attr table_attr = {
+        .log_ind_tbl_size = log_table_size,
+        .ind_tbl          = table,
+    };
+
+    group->indirection_table = ibv_create_rwq_ind_table(group->context, &table_attr);
+    if (!group->indirection_table) {
+        fprintf(stderr, "Couldn't create indirection table.\n");
+        goto clean_table;
+    }
+
+    struct ibv_qp_init_attr_ex qp_attr = {
+        .qp_type      = IBV_QPT_RAW_PACKET,
+        .comp_mask    = IBV_QP_INIT_ATTR_PD
+                      | IBV_QP_INIT_ATTR_IND_TABLE
+                      | IBV_QP_INIT_ATTR_RX_HASH,
+        .pd           = group->protection_domain,
+        .rwq_ind_tbl  = group->indirection_table,
+        .rx_hash_conf = {
+            .rx_hash_function    = IBV_RX_HASH_FUNC_TOEPLITZ,
+            .rx_hash_key_len     = sizeof rss_key,
+            .rx_hash_key         = rss_key,
+            .rx_hash_fields_mask = RSS_HASH_FIELDS,
+        },
+    };
+
+    group->rss_queue_pair = ibv_create_qp_ex(group->context, &qp_attr);
+    if (!group->rss_queue_pair) {
+        fprintf(stderr, "Couldn't create RSS queue pair.\n");
+        goto clean_table;
+    }
+
+    struct __attribute__((__packed__)) {
+        struct ibv_flow_attr attr;
+        struct ibv_flow_spec_eth eth;
+        struct ibv_flow_spec_ipv4 ipv4;
+        struct ibv_flow_spec_tcp_udp udp;
+    } __attribute__((__aligned__(8))) flow = {
+        .attr = {
+            .type         = IBV_FLOW_ATTR_NORMAL,
+            .size         = sizeof flow,
+            .num_of_specs = 3,
+            .port         = IB_PORT,
+        },
+        .eth  = { .type = IBV_FLOW_SPEC_ETH, .size = sizeof flow.eth },
+        .ipv4 = { .type = IBV_FLOW_SPEC_IPV4, .size = sizeof flow.ipv4 },
+        .udp  = {
+            .type = IBV_FLOW_SPEC_UDP,
+            .size = sizeof flow.udp,
+            .val  = { .dst_port = htons(ROCE_V2_UDP_PORT) },
+            .mask = { .dst_port = 0xffff },
+        },
+    };
+
+    group->flow = ibv_create_flow(group->rss_queue_pair, (struct ibv_flow_attr *) (void *) &flow);
+    if (!group->flow) {
+        fprintf(stderr, "Couldn't steer RoCEv2 traffic to RSS queue pair.\n");
+        goto clean_table;
+    }
+
+    free(table);
+    return 0;
+
+  clean_table:
+    free(table);
+    return 1;
+}
+
+// Fallback initialisation of a server group: one endpoint per queue, each
+// with its own completion queue, UD queue pair, and receive ring. Senders
+// have to spread their traffic over the reported queue pairs themselves.
+static int
+init_plain_group
+(struct rdma_server_group *group, int completion_queue_size, int num_queues)
+{
+    for (int i = 0; i < num_queues; i++) {
+        struct rdma_endpoint *endpoint = group_endpoint(group, completion_queue_size);
+        if (!endpoint) return 1;
+
+        if (create_queue_pair(endpoint)
+            || init_recv_ring(endpoint, sizeof (struct ib_grh), false)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Post Receive Requests for a run of 'count' slots of the shared pool (see
+// run_slot()) in a single chain. 'consumed' is the number of those slots whose datagram has
+// been received and processed, i.e. that are no longer posted to the SRQ.
+// While the SRQ holds well over its low watermark, slots go to the reserve
+// until it is full again. Must be called with 'srq_lock' held.
+static int
+srq_post
+( struct rdma_server_group *group
+, const struct slot_ring *ring
+, int start
+, int count
+, int consumed
+)
+{
+    struct rdma_endpoint *pool = group->pool;
+    struct ibv_recv_wr *head = NULL, *tail = NULL, *bad_wr;
+    int posted = 0;
+
+    group->srq_posted -= consumed;
+
+    for (int i = 0; i < count; i++) {
+        int slot = run_slot(ring, start, i, pool->queue_size);
+
+        if (group->srq_posted + posted > 2 * group->srq_limit
+            && group->reserve_count < group->reserve_size) {
+            group->reserve[group->reserve_count++] = slot;
+            continue;
+        }
+
+        struct ibv_recv_wr *wr = &pool->recv_requests[slot];
+        if (tail) tail->next = wr;
+        else head = wr;
+        tail = wr;
+        posted++;
+    }
+
+    if (!head) return 0;
+    tail->next = NULL;
+
+    int result = ibv_post_srq_recv(group->srq, head, &bad_wr);
+    if (result) {
+        fprintf(stderr, "post SRQ receive failed (%d) with errno: %d\n", result, errno);
+        return -1;
+    }
+
+    group->srq_posted += posted;
+    return 0;
+}
+
+// Emergency refill after the SRQ dropped below its low watermark: post the
+// whole reserve in one chain and re-arm the limit event, which the device
+// disarms every time it fires.
+static int
+srq_refill(struct rdma_server_group *group)
+{
+    struct rdma_endpoint *pool = group->pool;
+    struct ibv_recv_wr *bad_wr;
+    int result = 0;
+
+    pthread_mutex_lock(&group->srq_lock);
+
+    int count = group->reserve_count;
+    if (count) {
+        for (int i = 0; i < count; i++) {
+            int slot = group->reserve[i];
+            pool->recv_requests[slot].next =
+                i == count - 1 ? NULL : &pool->recv_requests[group->reserve[i + 1]];
+        }
+
+        if (ibv_post_srq_recv(group->srq, &pool->recv_requests[group->reserve[0]], &bad_wr)) {
+            fprintf(stderr, "Emergency SRQ refill failed with errno: %d\n", errno);
+            result = -1;
+        } else {
+            group->srq_posted += count;
+            group->reserve_count = 0;
+        }
+    }
+
+    group->emergency_refills++;
+    fprintf(stderr, "SRQ low watermark reached, posted %d reserve buffers\n", count);
+
+    struct ibv_srq_attr attr = { .srq_limit = group->srq_limit };
+    if (ibv_modify_srq(group->srq, &attr, IBV_SRQ_LIMIT)) {
+        fprintf(stderr, "Couldn't re-arm SRQ limit.\n");
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&group->srq_lock);
+    return result;
+}
+
+// SRQ initialisation of a server group:
+//
+//   - Allocate a single receive ring of 'completion_queue_size' slots as the
+//     shared buffer pool, independent of the number of queue pairs
+//   - Create a shared receive queue and post all of the pool to it, except
+//     for a reserve of one eighth of the slots
+//   - Arm the SRQ limit at the same size as the reserve
+//   - Create one endpoint per queue pair, each with its own completion queue
+//     and a UD queue pair receiving through the shared receive queue
+static int
+init_srq_group
+(struct rdma_server_group *group, int completion_queue_size, int num_queues)
+{
+    struct ibv_device_attr device_attr;
+    if (ibv_query_device(group->context, &device_attr)) {
+        fprintf(stderr, "Failed to query device.\n");
+        return 1;
+    }
+
+    if (device_attr.max_srq < 1 || device_attr.max_srq_wr < completion_queue_size) {
+        fprintf(stderr, "Device lacks support for an SRQ of %d entries.\n", completion_queue_size);
+        return 1;
+    }
+
+    struct rdma_endpoint *pool = calloc(1, sizeof *pool);
+    if (!pool) {
+        fprintf(stderr, "Couldn't allocate buffer pool.\n");
+        return 1;
+    }
+
+    pool->page_size = sysconf(_SC_PAGESIZE);
+    pool->queue_size = completion_queue_size;
+    pool->max_mtu = group->max_mtu;
+    pool->options = group->options;
+    pool->numa_node = group->numa_node;
+    pool->group = group;
+    pool->context = group->context;
+    pool->protection_domain = group->protection_domain;
+    group->pool = pool;
+
+    if (init_recv_ring(pool, sizeof (struct ib_grh), false)) return 1;
+
+    if (pthread_mutex_init(&group->srq_lock, NULL)) {
+        fprintf(stderr, "Couldn't initialise SRQ lock.\n");
+        return 1;
+    }
+    group->srq_lock_initialised = true;
+
+    group->reserve_size = completion_queue_size / 8;
+    if (group->reserve_size < 1) group->reserve_size = 1;
+    group->srq_limit = group->reserve_size;
+
+    group->reserve = malloc(group->reserve_size * (sizeof *group->reserve));
+    if (!group->reserve) {
+        fprintf(stderr, "Couldn't allocate SRQ reserve.\n");
+        return 1;
+    }
+
+    struct ibv_srq_init_attr srq_attr = {
+        .attr = {
+            .max_wr  = completion_queue_size,
+            .max_sge = recv_sge_count(&group->options),
+        },
+    };
+
+    group->srq = ibv_create_srq(group->protection_domain, &srq_attr);
+    if (!group->srq) {
+        fprintf(stderr, "Couldn't create shared receive queue.\n");
+        return 1;
+    }
+
+    int initial = completion_queue_size - group->reserve_size;
+    for (int i = 0; i < group->reserve_size; i++) {
+        group->reserve[group->reserve_count++] = initial + i;
+    }
+
+    if (srq_post(group, NULL, 0, initial, 0)) return 1;
+
+    struct ibv_srq_attr attr = { .srq_limit = group->srq_limit };
+    if (ibv_modify_srq(group->srq, &attr, IBV_SRQ_LIMIT)) {
+        fprintf(stderr, "Couldn't arm SRQ limit.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < num_queues; i++) {
+        struct rdma_endpoint *endpoint = group_endpoint(group, completion_queue_size);
+        if (!endpoint || create_queue_pair(endpoint)) return 1;
+    }
+
+    return 0;
+}
+
+// Initialise a group of 'num_queues' receive endpoints on a single device.
+//
+// In RDMA_GROUP_RSS mode, if the device supports RSS over raw packet queue
+// pairs, incoming RoCEv2 traffic is spread over the receive work queues of
+// the endpoints by the NIC. Otherwise, or if setting up RSS fails, fall back
+// to one UD queue pair per endpoint. Each endpoint has its own completion
+// queue and receive ring and can be drained by its own thread.
+//
+// In RDMA_GROUP_SRQ mode every endpoint has its own completion queue and UD
+// queue pair, but all of them receive into one shared pool of
+// 'completion_queue_size' buffers. The pool is posted by the group, so the
+// endpoints only repost what they received.
+//
+// The asynchronous event file descriptor of the device is made non-blocking,
+// see rdma_server_group_handle_events().
+//
+// Returns NULL on failure.
+struct rdma_server_group *
+rdma_init_server_group
+( char *dev_name
+, int completion_queue_size
+, int num_queues
+, enum rdma_group_mode mode
+, const struct rdma_options *options
+)
+{
+    struct rdma_server_group *group = calloc(1, sizeof *group);
+    if (!group) {
+        fprintf(stderr, "Couldn't allocate server group.\n");
+        return NULL;
+    }
+
+    group->mode = mode;
+    if (options) group->options = *options;
+    if (group->options.transport != RDMA_TRANSPORT_UD || group->options.block_packets > 0
+        || group->options.scatter_segments > 0
+        || (mode == RDMA_GROUP_SRQ && group->options.recycle_budget)) {
+        fprintf(stderr, "Server groups only support Unreliable Datagram endpoints with "
+                "a single circular buffer.\n");
+        free(group);
+        return NULL;
+    }
+
+    group->endpoints = calloc(num_queues, sizeof *group->endpoints);
+    if (!group->endpoints) {
+        fprintf(stderr, "Couldn't allocate server group.\n");
+        free(group);
+        return NULL;
+    }
+
+    group->context = open_device(dev_name);
+    if (!group->context) goto clean_group;
+
+    group->numa_node = device_numa_node(group->context);
+
+    int flags = fcntl(group->context->async_fd, F_GETFL);
+    if (flags < 0 || fcntl(group->context->async_fd, F_SETFL, flags | O_NONBLOCK)) {
+        fprintf(stderr, "Couldn't make async event queue non-blocking.\n");
+        goto clean_group;
+    }
+
+    group->max_mtu = query_max_mtu(group->context);
+    if (!group->max_mtu) goto clean_group;
+
+    group->protection_domain = ibv_alloc_pd(group->context);
+    if (!group->protection_domain) {
+        fprintf(stderr, "Failed to allocate protection domain.\n");
+        goto clean_group;
+    }
+
+    if (mode == RDMA_GROUP_SRQ) {
+        if (init_srq_group(group, completion_queue_size, num_queues)) {
+            goto clean_group;
+        }
+        fprintf(stderr, "%d queue pairs sharing an SRQ of %d buffers\n", num_queues, completion_queue_size);
+    } else if (rss_supported(group->context, num_queues)) {
+        if (!init_rss_group(group, completion_queue_size, num_queues)) {
+            group->use_rss = true;
+        } else {
+            fprintf(stderr, "Couldn't set up RSS, falling back to %d queue pairs.\n", num_queues);
+            release_group_endpoints(group);
+        }
+    } else {
+        fprintf(stderr, "Device lacks RSS support, using %d queue pairs.\n", num_queues);
+    }
+
+    if (mode == RDMA_GROUP_RSS && !group->use_rss) {
+        if (init_plain_group(group, completion_queue_size, num_queues)) {
+            goto clean_group;
+        }
+    }
+
+    if (group->use_rss) {
+        fprintf(stderr, "RSS over %d receive work queues\n", num_queues);
+        if (report_address(group->context, group->rss_queue_pair->qp_num)) {
+            goto clean_group;
+        }
+    } else {
+        for (int i = 0; i < group->num_endpoints; i++) {
+            uint32_t qpn = group->endpoints[i]->queue_pair->qp_num;
+            if (report_address(group->context, qpn)) goto clean_group;
+        }
+    }
+
+    return group;
+
+  clean_group:
+    rdma_server_group_cleanup(group);
+    fprintf(stderr, "Failed to initialise RDMA server group.\n");
+    return NULL;
+}
+
+// Cleanup all endpoints of a group, followed by the shared receive queue and
+// its buffer pool, the shared protection domain, and device context.
+void
+rdma_server_group_cleanup(struct rdma_server_group *group)
+{
+    release_group_endpoints(group);
+
+    if (group->srq) {
+        if (ibv_destroy_srq(group->srq)) {
+            fprintf(stderr, "Couldn't destroy shared receive queue.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (group->pool) rdma_cleanup(group->pool);
+    if (group->srq_lock_initialised) pthread_mutex_destroy(&group->srq_lock);
+    free(group->reserve);
+
+    if (group->protection_domain) {
+        if (ibv_dealloc_pd(group->protection_domain)) {
+            fprintf(stderr, "Couldn't deallocate protection domain.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (group->context) {
+        if (ibv_close_device(group->context)) {
+            fprintf(stderr, "Couldn't release context\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(group->endpoints);
+    free(group);
+}
+
+int
+rdma_server_group_size(struct rdma_server_group *group)
+{
+    return group->num_endpoints;
+}
+
+struct rdma_endpoint *
+rdma_server_group_endpoint(struct rdma_server_group *group, int index)
+{
+    return group->endpoints[index];
+}
+
+bool
+rdma_server_group_uses_rss(struct rdma_server_group *group)
+{
+    return group->use_rss;
+}
+
+// Wait up to 'timeout' milliseconds for asynchronous events of the group's
+// device and handle all pending ones. In SRQ mode reaching the low watermark
+// triggers an emergency refill from the reserve. The async_fd of the device
+// context can be added to an epoll set to only call this when events are
+// pending. Returns -1 on fatal errors.
+int
+rdma_server_group_handle_events(struct rdma_server_group *group, int timeout)
+{
+    struct pollfd fd = { .fd = group->context->async_fd, .events = POLLIN };
+    struct ibv_async_event event;
+    int result = 0;
+
+    int ready = poll(&fd, 1, timeout);
+    if (ready < 0) return errno == EINTR ? 0 : -1;
+
+    while (ready && !ibv_get_async_event(group->context, &event)) {
+        switch (event.event_type) {
+          case IBV_EVENT_SRQ_LIMIT_REACHED:
+            if (srq_refill(group)) result = -1;
+            break;
+
+          case IBV_EVENT_SRQ_ERR:
+          case IBV_EVENT_QP_FATAL:
+          case IBV_EVENT_CQ_ERR:
+          case IBV_EVENT_DEVICE_FATAL:
+            fprintf(stderr, "Fatal async event: %s\n", ibv_event_type_str(event.event_type));
+            result = -1;
+            break;
+
+          default:
+            fprintf(stderr, "Async event: %s\n", ibv_event_type_str(event.event_type));
+            break;
+        }
+
+        ibv_ack_async_event(&event);
+    }
+
+    return result;
+}
+
+long
+rdma_server_group_emergency_refills(struct rdma_server_group *group)
+{
+    return group->emergency_refills;
+}
+
+// Cleanup all the allocations done during the initialisation of an endpoint
+// and release the endpoint itself.
+void rdma_cleanup(struct rdma_endpoint *endpoint)
+{
+    free_buf(&endpoint->buffer);
+    free_buf(&endpoint->header_buffer);
+    free_buf(&endpoint->compact_headers);
+    for (int i = 1; i < endpoint->num_segments; i++) free_buf(&endpoint->segments[i].buf);
+    free(endpoint->segments);
+
+    free(endpoint->scatter_gather);
+    free(endpoint->recv_requests);
+    free(endpoint->send_requests);
+    free(endpoint->recv_buffers);
+    free(endpoint->send_buffers);
+    free(endpoint->poll_times);
+    free(endpoint->completion_timestamps);
+    free(endpoint->recv_free.slots);
+    free(endpoint->lease_refs);
+    free(endpoint->returned_next);
+    free(endpoint->send_free.slots);
+    free(endpoint->send_posted.slots);
+    free(endpoint->send_covers);
+    free(endpoint->send_ready);
+
+    if (endpoint->credit_mr && ibv_dereg_mr(endpoint->credit_mr)) {
+        fprintf(stderr, "Couldn't destroy memory region.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(endpoint->credit);
+    free(endpoint->slot_reposted);
+
+    // The registrations of slots still posted are released with the cache
+    for (int i = 0; endpoint->gather_counts && i < endpoint->queue_size; i++) {
+        release_gather_refs(endpoint, i);
+    }
+    mr_cache_destroy(endpoint->mr_cache);
+    free(endpoint->gather_refs);
+    free(endpoint->gather_counts);
+
+    struct block_placement *placement = endpoint->placement;
+    if (placement) {
+        free(placement->slot_pending);
+        free(placement->block_pending);
+        free(placement->block_received);
+        free(placement->received);
+        free(placement->missing);
+        free(placement->spill);
+        free(placement->spill_of);
+        free(placement->spill_free.slots);
+        free(placement);
+    }
+
+    internal_rdma_cleanup(endpoint);
+}
+
+// Cleanup that's shared between rdma_cleanup() and the error handling in this
+// file. Releases the ibverbs objects created by rdma_init() and the endpoint.
+static void internal_rdma_cleanup(struct rdma_endpoint *endpoint)
+{
+    if (endpoint->ah) {
+        if (ibv_destroy_ah(endpoint->ah)) {
+            fprintf(stderr, "Couldn't destroy AH.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (endpoint->queue_pair) {
+        if (ibv_destroy_qp(endpoint->queue_pair)) {
+            fprintf(stderr, "Couldn't destroy queue pair.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (endpoint->work_queue) {
+        if (ibv_destroy_wq(endpoint->work_queue)) {
+            fprintf(stderr, "Couldn't destroy work queue.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (endpoint->completion_queue) {
+        if (ibv_destroy_cq(endpoint->completion_queue)) {
+            fprintf(stderr, "Couldn't destroy completion queue.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (endpoint->completion_channel) {
+        if (ibv_destroy_comp_channel(endpoint->completion_channel)) {
+            fprintf(stderr, "Couldn't destroy completion channel.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The device context and protection domain of grouped endpoints are
+    // released by rdma_server_group_cleanup()
+    if (!endpoint->group && endpoint->protection_domain) {
+        if (ibv_dealloc_pd(endpoint->protection_domain)) {
+            fprintf(stderr, "Couldn't deallocate protection domain.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!endpoint->group && endpoint->context) {
+        if (ibv_close_device(endpoint->context)) {
+            fprintf(stderr, "Couldn't release context\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(endpoint);
+}
+
+// Endpoints of an SRQ group all share the receive buffers of the group's pool
+struct recv_buffer *
+rdma_recv_buffers(struct rdma_endpoint *endpoint)
+{
+    if (endpoint->group && endpoint->group->pool) {
+        return endpoint->group->pool->recv_buffers;
+    }
+    return endpoint->recv_buffers;
+}
+
+struct send_buffer *
+rdma_send_buffers(struct rdma_endpoint *endpoint)
+{
+    return endpoint->send_buffers;
+}
+
+struct ibv_cq *
+rdma_completion_queue(struct rdma_endpoint *endpoint)
+{
+    return endpoint->completion_queue;
+}
+
+// The number of the queue pair receiving for this endpoint, in RSS mode this
+// is the raw packet queue pair shared by the whole group.
+uint32_t
+rdma_queue_pair_number(struct rdma_endpoint *endpoint)
+{
+    if (endpoint->work_queue) return endpoint->group->rss_queue_pair->qp_num;
+    return endpoint->queue_pair->qp_num;
+}
+
+// File descriptor of the endpoint's completion channel, for use with epoll,
+// or -1 if the endpoint was created without one.
+int
+rdma_completion_fd(struct rdma_endpoint *endpoint)
+{
+    if (!endpoint->completion_channel) return -1;
+    return endpoint->completion_channel->fd;
+}
+
+// Poll an extended completion queue, copying the fields we use into 'wc' and
+// the completion timestamps into the endpoint's completion_timestamps.
+static int
+poll_extended_cq(struct rdma_endpoint *endpoint, int num_entries, struct ibv_wc *wc)
+{
+    struct ibv_cq_ex *cq = endpoint->completion_queue_ex;
+    struct ibv_poll_cq_attr attr = { .comp_mask = 0 };
+    int ne = 0;
+
+    int result = ibv_start_poll(cq, &attr);
+    if (result == ENOENT) return 0;
+    if (result) return -1;
+
+    do {
+        memset(&wc[ne], 0, sizeof wc[ne]);
+        wc[ne].wr_id = cq->wr_id;
+        wc[ne].status = cq->status;
+        if (cq->status == IBV_WC_SUCCESS) {
+            wc[ne].opcode = ibv_wc_read_opcode(cq);
+            wc[ne].byte_len = ibv_wc_read_byte_len(cq);
+            wc[ne].wc_flags = ibv_wc_read_wc_flags(cq);
+            if (wc[ne].wc_flags & IBV_WC_WITH_IMM) wc[ne].imm_data = ibv_wc_read_imm_data(cq);
+            if (wc[ne].opcode & IBV_WC_RECV) wc[ne].src_qp = ibv_wc_read_src_qp(cq);
+        }
+
+        if (endpoint->hardware_timestamps) {
+            endpoint->completion_timestamps[ne] = ibv_wc_read_completion_ts(cq);
+        }
+
+        ne++;
+    } while (ne < num_entries && !(result = ibv_next_poll(cq)));
+
+    ibv_end_poll(cq);
+
+    if (result && result != ENOENT) return -1;
+    return ne;
+}
+
+// The endpoint whose receive ring the wr_ids of this endpoint index
+static struct rdma_endpoint *
+receive_ring(struct rdma_endpoint *endpoint)
+{
+    if (endpoint->group && endpoint->group->pool) return endpoint->group->pool;
+    return endpoint;
+}
+
+// Receive slot of a successful receive completion: the wr_id of its Receive
+// Request, or for connected transports the slot the peer wrote into, carried
+// in the immediate data. -1 if the slot is out of range.
+static int
+completion_slot(struct rdma_endpoint *endpoint, const struct ibv_wc *wc)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+    int slot = wc->wr_id;
+
+    if (ring->placement) return -1;
+
+    if (ring->remote_access) {
+        if (!(wc->wc_flags & IBV_WC_WITH_IMM)) return -1;
+        uint32_t imm = ntohl(wc->imm_data);
+        slot = imm < (uint32_t) ring->queue_size ? (int) imm : -1;
+    }
+
+    return slot;
+}
+
+// Poll the completion queue. With the timestamps option record the delay
+// between arrival and poll of each completion and remember when each receive
+// slot was polled.
+static int
+poll_completions(struct rdma_endpoint *endpoint, int num_entries, struct ibv_wc *wc)
+{
+    if (!endpoint->options.timestamps) {
+        return ibv_poll_cq(endpoint->completion_queue, num_entries, wc);
+    }
+
+    if (num_entries > endpoint->queue_size) num_entries = endpoint->queue_size;
+
+    int ne;
+    if (endpoint->completion_queue_ex) {
+        ne = poll_extended_cq(endpoint, num_entries, wc);
+    } else {
+        ne = ibv_poll_cq(endpoint->completion_queue, num_entries, wc);
+    }
+
+    uint64_t now = timestamp_now(endpoint);
+    uint64_t previous_poll = endpoint->last_poll;
+    endpoint->last_poll = now;
+    if (ne <= 0) return ne;
+
+    if (endpoint->hardware_timestamps && now - endpoint->reference_ns > 1000000000) {
+        calibrate_device_clock(endpoint);
+    }
+
+    uint64_t *poll_times = receive_ring(endpoint)->poll_times;
+    for (int i = 0; i < ne; i++) {
+        uint64_t arrival = previous_poll;
+        if (endpoint->hardware_timestamps) {
+            arrival = device_cycles_to_ns(endpoint, endpoint->completion_timestamps[i]);
+        }
+
+        latency_histogram_record(&endpoint->nic_to_poll, now > arrival ? now - arrival : 0);
+
+        if (poll_times && wc[i].status == IBV_WC_SUCCESS && (wc[i].opcode & IBV_WC_RECV)) {
+            int slot = completion_slot(endpoint, &wc[i]);
+            if (slot >= 0) poll_times[slot] = now;
+        }
+    }
+
+    return ne;
+}
+
+// Switch from busy polling to waiting for a completion event: arm the
+// completion queue, check for completions that arrived before it was armed,
+// and otherwise block on the completion channel for up to 'timeout'
+// milliseconds.
+static int
+wait_for_completions
+(struct rdma_endpoint *endpoint, int num_entries, struct ibv_wc *wc, int timeout)
+{
+    struct rdma_poll_stats *stats = &endpoint->poll_stats;
+    struct ibv_cq *completion_queue = endpoint->completion_queue;
+
+    if (ibv_req_notify_cq(completion_queue, 0)) {
+        fprintf(stderr, "Couldn't request completion notification.\n");
+        return -1;
+    }
+
+    int ne = poll_completions(endpoint, num_entries, wc);
+    if (ne) return ne;
+
+    uint64_t start = now_ns();
+    if (!endpoint->interrupt_mode) {
+        stats->busy_poll_ns += start - endpoint->mode_start;
+        stats->mode_switches++;
+        endpoint->interrupt_mode = true;
+    }
+
+    struct pollfd fd = { .fd = endpoint->completion_channel->fd, .events = POLLIN };
+    int ready = poll(&fd, 1, timeout);
+    if (ready < 0 && errno != EINTR) {
+        fprintf(stderr, "Waiting for completion events failed.\n");
+        return -1;
+    }
+
+    struct ibv_cq *event_cq;
+    void *event_context;
+    while (!ibv_get_cq_event(endpoint->completion_channel, &event_cq, &event_context)) {
+        ibv_ack_cq_events(event_cq, 1);
+        stats->interrupts++;
+    }
+
+    uint64_t end = now_ns();
+    stats->interrupt_ns += end - start;
+
+    ne = poll_completions(endpoint, num_entries, wc);
+    if (ne > 0) {
+        endpoint->interrupt_mode = false;
+        endpoint->mode_start = endpoint->last_completion = end;
+    }
+
+    return ne;
+}
+
+// Poll the completion queue of an endpoint for up to 'num_entries'
+// completions. While completions keep arriving this busy polls. Once no
+// completion arrived for the endpoint's idle_usec option, and the endpoint
+// has a completion channel, it instead blocks for up to 'timeout'
+// milliseconds waiting for a completion event, and returns to busy polling
+// as soon as one arrives. Returns the number of completions, 0 on timeout, or
+// a negative value on failure.
+int
+rdma_poll
+(struct rdma_endpoint *endpoint, int num_entries, struct ibv_wc *wc, int timeout)
+{
+    struct rdma_poll_stats *stats = &endpoint->poll_stats;
+
+    int ne = poll_completions(endpoint, num_entries, wc);
+    if (ne < 0) return ne;
+
+    uint64_t now = now_ns();
+    if (ne > 0) {
+        if (endpoint->interrupt_mode) {
+            endpoint->interrupt_mode = false;
+            endpoint->mode_start = now;
+        }
+        endpoint->last_completion = now;
+        stats->completions += ne;
+        if (endpoint->recv_requests) endpoint->recv_posted -= ne;
+        return ne;
+    }
+
+    stats->empty_polls++;
+    if (!endpoint->completion_channel) return 0;
+
+    uint64_t idle = (uint64_t) endpoint->options.idle_usec * 1000;
+    if (now - endpoint->last_completion < idle) return 0;
+
+    ne = wait_for_completions(endpoint, num_entries, wc, timeout);
+    if (ne > 0) {
+        stats->completions += ne;
+        if (endpoint->recv_requests) endpoint->recv_posted -= ne;
+    }
+    return ne;
+}
+
+// Latency histograms of the timestamps option, in nanoseconds: from the
+// arrival of a completion to its poll, and from the poll of a received
+// datagram to the repost of its buffer. NULL without the timestamps option.
+const struct latency_histogram *
+rdma_nic_to_poll_histogram(struct rdma_endpoint *endpoint)
+{
+    return endpoint->options.timestamps ? &endpoint->nic_to_poll : NULL;
+}
+
+const struct latency_histogram *
+rdma_poll_to_repost_histogram(struct rdma_endpoint *endpoint)
+{
+    return endpoint->options.timestamps ? &endpoint->poll_to_repost : NULL;
+}
+
+bool
+rdma_hardware_timestamps(struct rdma_endpoint *endpoint)
+{
+    return endpoint->hardware_timestamps;
+}
+
+size_t
+rdma_message_size(struct rdma_endpoint *endpoint)
+{
+    return receive_ring(endpoint)->message_size;
+}
+
+size_t
+rdma_buffer_stride(struct rdma_endpoint *endpoint)
+{
+    return receive_ring(endpoint)->stride;
+}
+
+char *
+rdma_segment_buffer(struct rdma_endpoint *endpoint, int segment, size_t *stride)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+
+    if (segment == 0) {
+        *stride = ring->stride;
+        return ring->buffer.addr;
+    }
+
+    if (segment < 0 || segment >= ring->num_segments) return NULL;
+
+    *stride = ring->segments[segment].stride;
+    return ring->segments[segment].buf.addr;
+}
+
+int
+rdma_numa_node(struct rdma_endpoint *endpoint)
+{
+    return endpoint->numa_node;
+}
+
+// Time spent allocating, touching, and registering the buffers of an endpoint,
+// for the endpoints of an SRQ group this covers the shared pool.
+void
+rdma_get_alloc_stats(struct rdma_endpoint *endpoint, struct rdma_alloc_stats *stats)
+{
+    *stats = receive_ring(endpoint)->alloc_stats;
+}
+
+// Copy the polling statistics of an endpoint, including the busy polling time
+// of the current busy polling period.
+void
+rdma_get_poll_stats(struct rdma_endpoint *endpoint, struct rdma_poll_stats *stats)
+{
+    *stats = endpoint->poll_stats;
+    if (!endpoint->interrupt_mode) {
+        stats->busy_poll_ns += now_ns() - endpoint->mode_start;
+    }
+}
+
+// Link the Send Requests of a run of 'count' acquired slots (see run_slot())
+// into one chain and post it with a single doorbell. Every
+// signal_interval'th request, counting across calls, is signaled and records
+// how many posted slots its completion frees. Requests of no more than
+// 'max_inline' bytes are sent inline, the CPU copies them into the Work
+// Queue Element, saving the NIC a DMA read of the slot. Clients of a connected
+// transport write every request into the next slot of the server's receive
+// ring, with the slot index as immediate data.
+static int
+post_send_run(struct rdma_endpoint *endpoint, const int *slots, int start, int count)
+{
+    struct ibv_send_wr *send_requests = endpoint->send_requests;
+    struct ibv_send_wr *bad_wr;
+    int size = endpoint->queue_size;
+
+    if (count <= 0) return 0;
+
+    if (endpoint->send_posted.count + count > size) {
+        fprintf(stderr, "Send queue full, posting %d with %d slots posted\n",
+                count, endpoint->send_posted.count);
+        return -1;
+    }
+
+    int unsignaled = endpoint->send_unsignaled;
+    for (int i = 0; i < count; i++) {
+        int slot = slots ? slots[i] : (start + i) % size;
+        struct ibv_send_wr *wr = &send_requests[slot];
+
+        wr->send_flags = endpoint->send_flags & ~IBV_SEND_SIGNALED;
+        if (endpoint->max_inline) {
+            uint32_t length = 0;
+            for (int j = 0; j < wr->num_sge; j++) length += wr->sg_list[j].length;
+            if (length <= endpoint->max_inline) wr->send_flags |= IBV_SEND_INLINE;
+        }
+        if (++unsignaled == endpoint->signal_interval) {
+            wr->send_flags |= IBV_SEND_SIGNALED;
+            endpoint->send_covers[slot] = unsignaled;
+            unsignaled = 0;
+        }
+
+        if (endpoint->options.send_sequence && !endpoint->remote.num_slots) {
+            wr->opcode = IBV_WR_SEND_WITH_IMM;
+            wr->imm_data = htonl(endpoint->send_sequence + i);
+        }
+
+        if (endpoint->remote.num_slots) {
+            struct connection_info *remote = &endpoint->remote;
+            uint32_t remote_slot = (endpoint->remote_next + i) % remote->num_slots;
+            uint64_t offset = remote_slot * remote->stride;
+            uint32_t mr = offset / remote->chunk_size;
+
+            wr->wr.rdma.remote_addr = remote->ring_addr + offset;
+            wr->wr.rdma.rkey = remote->rkeys[mr < remote->num_mrs ? mr : remote->num_mrs - 1];
+            wr->imm_data = htonl(remote_slot);
+        }
+
+        int next = slots ? slots[i + 1 < count ? i + 1 : i] : (start + i + 1) % size;
+        wr->next = i == count - 1 ? NULL : &send_requests[next];
+    }
+
+    int head = slots ? slots[0] : start;
+    int result = ibv_post_send(endpoint->queue_pair, &send_requests[head], &bad_wr);
+    if (result) {
+        fprintf(stderr, "post send failed (%d) with errno: %d\n%s\n%s\n", result, errno, strerror(result), strerror(errno));
+        return -1;
+    }
+
+    endpoint->send_unsignaled = unsignaled;
+    endpoint->send_sequence += count;
+    endpoint->send_stats.messages += count;
+    endpoint->send_stats.chains++;
+    if (endpoint->remote.num_slots) {
+        endpoint->remote_next = (endpoint->remote_next + count) % endpoint->remote.num_slots;
+    }
+    for (int i = 0; i < count; i++) {
+        slot_ring_push(&endpoint->send_posted, slots ? slots[i] : (start + i) % size);
+    }
+
+    return 0;
+}
+
+// Post the Send Requests of 'count' consecutive slots of the circular
+// buffer, starting at slot 'start'. The slots must have been acquired with
+// rdma_send_acquire().
+int post_sends(struct rdma_endpoint *endpoint, int start, int count)
+{
+    return post_send_run(endpoint, NULL, start, count);
+}
+
+int
+rdma_post_send_slots(struct rdma_endpoint *endpoint, const int *slots, int count)
+{
+    return post_send_run(endpoint, slots, 0, count);
+}
+
+// Read the server's credit counter into 'credit', completed by
+// rdma_reap_sends(). Returns -1 on failure.
+static int
+post_credit_read(struct rdma_endpoint *endpoint)
+{
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge = {
+        .addr   = (uintptr_t) endpoint->credit,
+        .length = sizeof *endpoint->credit,
+        .lkey   = endpoint->credit_mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id      = CREDIT_WR_ID,
+        .sg_list    = &sge,
+        .num_sge    = 1,
+        .opcode     = IBV_WR_RDMA_READ,
+        .send_flags = IBV_SEND_SIGNALED,
+        .wr.rdma    = {
+            .remote_addr = endpoint->remote.credit_addr,
+            .rkey        = endpoint->remote.credit_rkey,
+        },
+    };
+
+    int result = ibv_post_send(endpoint->queue_pair, &wr, &bad_wr);
+    if (result) {
+        fprintf(stderr, "Couldn't read credits (%d)\n", result);
+        return -1;
+    }
+
+    endpoint->credit_read_posted = true;
+    return 0;
+}
+
+// Whether an RC client may acquire another slot: 1 if the remote slot it
+// will be written to was reposted by the server, 0 if not yet, and -1 if
+// the credits can't be read. Reads fresh credits once half of the remote
+// ring is in use, so the client rarely has to wait for them.
+static int
+remote_credit(struct rdma_endpoint *endpoint)
+{
+    uint64_t in_use = endpoint->remote_acquired - endpoint->credit_count;
+    uint32_t num_slots = endpoint->remote.num_slots;
+
+    if (endpoint->credit_failed) return -1;
+    if (in_use >= num_slots / 2 && !endpoint->credit_read_posted
+        && post_credit_read(endpoint)) {
+        endpoint->credit_failed = true;
+        return -1;
+    }
+
+    return in_use < num_slots;
+}
+
+// Acquire a free slot of the send buffer to fill and post, -1 if all slots
+// are posted or acquired, or an RC client has no credit for another, and -2
+// if an RC client can't read its credits. Slots are handed out in the order
+// they completed.
+int
+rdma_send_acquire(struct rdma_endpoint *endpoint)
+{
+    if (!endpoint->send_free.count) return -1;
+    if (endpoint->credit_mr) {
+        int credit = remote_credit(endpoint);
+        if (credit <= 0) return credit < 0 ? -2 : -1;
+    }
+    endpoint->remote_acquired++;
+
+    // Undo a shorter or gather send from the slot
+    int slot = slot_ring_pop(&endpoint->send_free);
+    struct ibv_sge *sge = endpoint->send_requests[slot].sg_list;
+    sge->length = endpoint->message_size;
+    if (endpoint->gather_segments) {
+        char *data_buffer = endpoint->send_buffers[slot].data_buffer;
+
+        endpoint->send_requests[slot].num_sge = 1;
+        sge->addr = (uintptr_t) data_buffer;
+        sge->lkey = buf_lkey(&endpoint->buffer, data_buffer);
+    }
+    return slot;
+}
+
+int
+rdma_send_set_length(struct rdma_endpoint *endpoint, int slot, size_t length)
+{
+    if (!length || length > endpoint->message_size) {
+        fprintf(stderr, "Can't send %zu bytes from a %zu byte slot\n", length,
+                endpoint->message_size);
+        return -1;
+    }
+
+    endpoint->send_requests[slot].sg_list[0].length = length;
+    return 0;
+}
+
+bool
+rdma_rate_limited(struct rdma_endpoint *endpoint)
+{
+    return endpoint->rate_limited;
+}
+
+uint32_t
+rdma_max_inline(struct rdma_endpoint *endpoint)
+{
+    return endpoint->max_inline;
+}
+
+int
+rdma_send_credits(struct rdma_endpoint *endpoint)
+{
+    return endpoint->send_free.count;
+}
+
+// Poll the completion queue for Send completions. A queue pair completes its
+// Send Requests in order, so every signaled completion frees the unsignaled
+// slots posted before it as well. Freed slots go back to the free list.
+int
+rdma_reap_sends(struct rdma_endpoint *endpoint)
+{
+    struct ibv_wc wc[16];
+
+    // Without credits the client could never send again
+    if (endpoint->credit_failed) return -1;
+
+    int ne = ibv_poll_cq(endpoint->completion_queue, 16, wc);
+    if (ne < 0) {
+        fprintf(stderr, "poll CQ failed %d\n", ne);
+        return -1;
+    }
+
+    int completed = 0;
+    for (int i = 0; i < ne; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                    ibv_wc_status_str(wc[i].status),
+                    wc[i].status, (int) wc[i].wr_id);
+            return -1;
+        }
+
+        if (wc[i].wr_id == CREDIT_WR_ID) {
+            uint64_t credit = atomic_load_explicit(endpoint->credit, memory_order_relaxed);
+            endpoint->credit_count = be64toh(credit);
+            endpoint->credit_read_posted = false;
+            continue;
+        }
+
+        int covers = endpoint->send_covers[wc[i].wr_id];
+        for (int j = 0; j < covers; j++) {
+            int slot = slot_ring_pop(&endpoint->send_posted);
+            if (endpoint->gather_counts) release_gather_refs(endpoint, slot);
+            if (!endpoint->send_ready) slot_ring_push(&endpoint->send_free, slot);
+        }
+        completed += covers;
+    }
+
+    endpoint->poll_stats.completions += ne;
+
+    return completed;
+}
+
+static bool
+send_ticket_ready(struct rdma_endpoint *endpoint, uint64_t ticket)
+{
+    return atomic_load(&endpoint->send_ready[ticket % endpoint->queue_size]) == ticket + 1;
+}
+
+// Post the longest run of committed tickets following the last posted one as
+// a single chain, and reap completions. Only one thread combines at a time,
+// the others return right away and leave their commits to it. Commits that
+// land after the combiner scanned past them are picked up because it checks
+// for them again after letting go. The ready slots, the flag, and that check
+// are sequentially consistent, so either the committing thread gets the flag,
+// or the combiner sees its commit.
+static int
+combine_sends(struct rdma_endpoint *endpoint)
+{
+    uint64_t published;
+
+    do {
+        if (atomic_flag_test_and_set(&endpoint->send_combining)) return 0;
+
+        uint64_t first = atomic_load_explicit(&endpoint->send_published, memory_order_relaxed);
+        uint64_t next = first;
+        while (next - first < (uint64_t) endpoint->queue_size && send_ticket_ready(endpoint, next)) {
+            next++;
+        }
+
+        int completed = 0;
+        if (next > first) {
+            if (post_sends(endpoint, first % endpoint->queue_size, next - first)) completed = -1;
+            endpoint->send_stats.combines++;
+        }
+        if (!completed) completed = rdma_reap_sends(endpoint);
+
+        if (completed > 0) {
+            atomic_fetch_add_explicit(&endpoint->send_completed, completed, memory_order_release);
+        }
+        if (completed >= 0) {
+            atomic_store_explicit(&endpoint->send_published, next, memory_order_relaxed);
+        }
+        atomic_flag_clear(&endpoint->send_combining);
+
+        if (completed < 0) {
+            atomic_store(&endpoint->send_failed, true);
+            return -1;
+        }
+        published = next;
+    } while (send_ticket_ready(endpoint, published));
+
+    return 0;
+}
+
+int64_t
+rdma_send_reserve(struct rdma_endpoint *endpoint, int count)
+{
+    uint64_t reserved = atomic_load_explicit(&endpoint->send_reserved, memory_order_relaxed);
+
+    // A run longer than the queue would never find its slots free
+    if (count < 1 || count > endpoint->queue_size) {
+        fprintf(stderr, "Can't reserve %d tickets of a %d slot send queue\n",
+                count, endpoint->queue_size);
+        return -2;
+    }
+    if (atomic_load_explicit(&endpoint->send_failed, memory_order_relaxed)) return -2;
+
+    do {
+        // The previous user of every reserved slot has to be completed
+        uint64_t completed = atomic_load_explicit(&endpoint->send_completed, memory_order_acquire);
+        if (reserved + count > completed + endpoint->queue_size) {
+            // Reap completions, unless another thread is already combining
+            return combine_sends(endpoint) ? -2 : -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&endpoint->send_reserved, &reserved,
+                                                    reserved + count,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    return reserved;
+}
+
+char *
+rdma_send_ticket_buffer(struct rdma_endpoint *endpoint, int64_t ticket)
+{
+    return endpoint->send_buffers[ticket % endpoint->queue_size].data_buffer;
+}
+
+int
+rdma_send_commit(struct rdma_endpoint *endpoint, int64_t ticket, int count)
+{
+    for (int64_t i = ticket; i < ticket + count; i++) {
+        atomic_store(&endpoint->send_ready[i % endpoint->queue_size], i + 1);
+    }
+
+    return combine_sends(endpoint);
+}
+
+void
+rdma_get_send_stats(struct rdma_endpoint *endpoint, struct rdma_send_stats *stats)
+{
+    *stats = endpoint->send_stats;
+}
+
+// The header is copied into the data buffer of a send slot, the first SGE,
+// the payload segments are gathered by the following SGEs straight from
+// application memory. A header of 0 bytes is left out, since a 0 byte SGE
+// means 2 GiB to some devices.
+int
+rdma_send_gather
+( struct rdma_endpoint *endpoint
+, const void *header
+, size_t header_length
+, const struct iovec *segments
+, int num_segments
+)
+{
+    size_t length = header_length;
+    for (int i = 0; i < num_segments; i++) length += segments[i].iov_len;
+
+    if (num_segments > endpoint->gather_segments || length > endpoint->message_size) {
+        fprintf(stderr, "Gather send of %zu bytes in %d segments exceeds the %zu bytes in "
+                "%d segments of the endpoint\n", length, num_segments,
+                endpoint->message_size, endpoint->gather_segments);
+        return -1;
+    }
+
+    int slot = rdma_send_acquire(endpoint);
+    if (slot == -2) return -1;
+    if (slot < 0) return 1;
+
+    struct ibv_send_wr *wr = &endpoint->send_requests[slot];
+    struct mr_cache_entry **refs = &endpoint->gather_refs[slot * endpoint->gather_segments];
+    int num_sge = 0;
+
+    if (header_length) {
+        memcpy(endpoint->send_buffers[slot].data_buffer, header, header_length);
+        wr->sg_list[num_sge++].length = header_length;
+    }
+
+    for (int i = 0; i < num_segments; i++) {
+        if (!segments[i].iov_len) continue;
+
+        struct mr_cache_entry *entry =
+            mr_cache_acquire(endpoint->mr_cache, segments[i].iov_base, segments[i].iov_len);
+        if (!entry) goto fail;
+        refs[endpoint->gather_counts[slot]++] = entry;
+
+        struct ibv_sge *sge = &wr->sg_list[num_sge++];
+        sge->addr = (uintptr_t) segments[i].iov_base;
+        sge->length = segments[i].iov_len;
+        sge->lkey = mr_cache_lkey(entry);
+    }
+
+    wr->num_sge = num_sge;
+    if (post_send_run(endpoint, &slot, 0, 1)) goto fail;
+    return 0;
+
+  fail:
+    release_gather_refs(endpoint, slot);
+    slot_ring_push(&endpoint->send_free, slot);
+    endpoint->remote_acquired--;
+    return -1;
+}
+
+int
+rdma_send_register(struct rdma_endpoint *endpoint, const void *addr, size_t length)
+{
+    if (!endpoint->mr_cache) return -1;
+
+    struct mr_cache_entry *entry = mr_cache_acquire(endpoint->mr_cache, addr, length);
+    if (!entry) return -1;
+    mr_cache_release(endpoint->mr_cache, entry);
+    return 0;
+}
+
+void
+rdma_send_forget(struct rdma_endpoint *endpoint, const void *addr, size_t length)
+{
+    if (endpoint->mr_cache) mr_cache_invalidate(endpoint->mr_cache, addr, length);
+}
+
+void
+rdma_get_mr_cache_stats(struct rdma_endpoint *endpoint, struct mr_cache_stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    if (endpoint->mr_cache) mr_cache_get_stats(endpoint->mr_cache, stats);
+}
+
+// Record the poll-to-repost delay of a run of receive slots being reposted
+static void
+record_reposts(struct rdma_endpoint *endpoint, const struct slot_ring *ring, int start, int count)
+{
+    uint64_t *poll_times = receive_ring(endpoint)->poll_times;
+    if (!poll_times) return;
+
+    uint64_t now = timestamp_now(endpoint);
+    int size = receive_ring(endpoint)->queue_size;
+    for (int i = 0; i < count; i++) {
+        int slot = run_slot(ring, start, i, size);
+        if (poll_times[slot]) {
+            latency_histogram_record(&endpoint->poll_to_repost, now - poll_times[slot]);
+            poll_times[slot] = 0;
+        }
+    }
+}
+
+// Link the Receive Requests of a run of 'count' slots (see run_slot()) into
+// one chain and post it to the queue pair, or receive work queue, with a
+// single doorbell.
+static int
+post_recv_run(struct rdma_endpoint *endpoint, const struct slot_ring *ring, int start, int count)
+{
+    struct ibv_recv_wr *recv_requests = endpoint->recv_requests;
+    struct ibv_recv_wr *bad_wr;
+    int size = endpoint->queue_size;
+
+    if (count <= 0) return 0;
+
+    for (int i = 0; i < count; i++) {
+        struct ibv_recv_wr *wr = &recv_requests[run_slot(ring, start, i, size)];
+        wr->next = i == count - 1 ? NULL : &recv_requests[run_slot(ring, start, i + 1, size)];
+    }
+
+    struct ibv_recv_wr *head = &recv_requests[run_slot(ring, start, 0, size)];
+    int result;
+    if (endpoint->work_queue) {
+        result = ibv_post_wq_recv(endpoint->work_queue, head, &bad_wr);
+    } else {
+        result = ibv_post_recv(endpoint->queue_pair, head, &bad_wr);
+    }
+    if (result) {
+        fprintf(stderr, "post receive failed (%d) with errno: %d\n", result, errno);
+        return -1;
+    }
+
+    endpoint->recv_posted += count;
+    return 0;
+}
+
+static int post_placement(struct rdma_endpoint *endpoint);
+
+// Treat the allocated data buffer and Receive Requests as a circular buffer
+// from which we post requests to the the NIC. Starting from request at index
+// 'start' and posting the next 'count' requests. For endpoints of an SRQ
+// group these are slots of the shared pool that were received on this
+// endpoint and are handed back to the shared receive queue.
+int post_recvs(struct rdma_endpoint *endpoint, int start, int count)
+{
+    struct rdma_server_group *group = endpoint->group;
+
+    if (endpoint->placement) return post_placement(endpoint);
 
-    *mr = ibv_reg_mr(protection_domain, *buf, size, IBV_ACCESS_LOCAL_WRITE);
-    if (!*mr) {
-        fprintf(stderr, "Couldn't register memory region.\n");
-        goto clean_buf;
+    record_reposts(endpoint, NULL, start, count);
+
+    if (group && group->srq) {
+        pthread_mutex_lock(&group->srq_lock);
+        int result = srq_post(group, NULL, start, count, count);
+        pthread_mutex_unlock(&group->srq_lock);
+        return result;
     }
 
-    return 0;
+    // Slots beyond the recycling window start out on the free list, the
+    // first of them on top
+    if (endpoint->recycle_lifo) {
+        int posted = endpoint->recv_window - endpoint->recv_posted;
+        if (posted > count) posted = count;
+        if (posted < 0) posted = 0;
+        for (int i = count - 1; i >= posted; i--) {
+            slot_ring_push(&endpoint->recv_free, (start + i) % endpoint->queue_size);
+        }
+        count = posted;
+    }
 
-  clean_buf:
-    free(*buf);
-    *buf= NULL;
-    return 1;
+    return post_recv_run(endpoint, NULL, start, count);
 }
 
-// Common ibverbs initialisation shared by the client and server:
-//
-//   - Check for and open the specified IB device
-//   - Create an ibverbs context for the device
-//   - Find the IB_PORT to use
-//   - Create a protection domain
-//   - Create a completion queue
-//   - Create Unreliable Datagram queue pair for the completion queue
-//   - Configure the queue pair to use the found IB_PORT and transition it to
-//     the RTR (Ready-to-Receive) state
-static void rdma_init(char *dev_name, int completion_queue_size)
+// Count the slots of a run an RC server reposted towards the credits of the
+// client, each once every slot written before it is reposted too, and
+// publish the count
+static void
+publish_credit
+( struct rdma_endpoint *endpoint
+, const struct slot_ring *ring
+, int start
+, int count
+)
 {
-    page_size = sysconf(_SC_PAGESIZE);
-    queue_size = completion_queue_size;
+    int size = endpoint->queue_size;
+    uint64_t credit = endpoint->credit_count;
 
-    int num_devs;
-    struct ibv_device *ib_dev = NULL;
-    struct ibv_device **dev_list = ibv_get_device_list(&num_devs);
-    if (!dev_list) {
-        fprintf(stderr, "No IB devices found.\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < count; i++) {
+        endpoint->slot_reposted[run_slot(ring, start, i, size)] = true;
+    }
+    while (endpoint->slot_reposted[credit % size]) {
+        endpoint->slot_reposted[credit % size] = false;
+        credit++;
     }
 
-    for (int i = 0; dev_list[i]; ++i) {
-        if (!strcmp(ibv_get_device_name(dev_list[i]), dev_name)) {
-            ib_dev = dev_list[i];
-            break;
-        }
+    if (credit != endpoint->credit_count) {
+        endpoint->credit_count = credit;
+        atomic_store_explicit(endpoint->credit, htobe64(credit), memory_order_release);
     }
+}
 
-    if (!ib_dev) {
-        fprintf(stderr, "No device with name: %s\n", dev_name);
-        ibv_free_device_list(dev_list);
-        exit(EXIT_FAILURE);
+// Repost all released slots in one chain. Must be called with the SRQ lock
+// held for endpoints of an SRQ group. With LIFO recycling only the most
+// recently released slots are reposted, up to the recycling window, most
+// recent first, so the NIC writes into the slots most likely to be cached.
+// The others stay at the bottom of the free list.
+static int
+flush_released(struct rdma_endpoint *endpoint, int consumed)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+    struct slot_ring *free_slots = &ring->recv_free;
+    int count = free_slots->count;
+    int start = free_slots->head;
+    int result;
+
+    if (ring->recycle_lifo) {
+        int room = ring->recv_window - ring->recv_posted;
+        if (count > room) count = room > 0 ? room : 0;
+        start = (free_slots->head + free_slots->count - count) % free_slots->size;
+        slot_ring_reverse(free_slots, start, count);
     }
 
-    context = ibv_open_device(ib_dev);
-    ibv_free_device_list(dev_list);
-    if (!context) {
-        fprintf(stderr, "Failed to open device: %s\n", ibv_get_device_name(ib_dev));
-        goto clean_context;
+    record_reposts(endpoint, free_slots, start, count);
+
+    if (endpoint->group && endpoint->group->srq) {
+        result = srq_post(endpoint->group, free_slots, start, count, consumed);
+    } else {
+        result = post_recv_run(ring, free_slots, start, count);
     }
 
-    struct ibv_port_attr port_info;
-    if (ibv_query_port(context, IB_PORT, &port_info)) {
-        fprintf(stderr, "Failed to query port info.\n");
-        goto clean_device;
+    if (!result) {
+        if (ring->slot_reposted) publish_credit(ring, free_slots, start, count);
+        if (!ring->recycle_lifo) free_slots->head = (free_slots->head + count) % free_slots->size;
+        free_slots->count -= count;
     }
+    return result;
+}
 
-    max_mtu = 1 << (port_info.active_mtu + 7);
+// Hand a received slot back to the endpoint. Released slots are collected
+// and reposted in a single chain once the receive queue drains to its low
+// watermark, rather than with a doorbell per datagram. Slots may be
+// released in any order.
+int
+rdma_recv_release(struct rdma_endpoint *endpoint, int slot)
+{
+    struct rdma_server_group *group = endpoint->group;
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+    int result = 0;
 
-    protection_domain = ibv_alloc_pd(context);
-    if (!protection_domain) {
-        fprintf(stderr, "Failed to allocate protection domain.\n");
-        goto clean_context;
+    if (group && group->srq) {
+        pthread_mutex_lock(&group->srq_lock);
+        slot_ring_push(&ring->recv_free, slot);
+        group->srq_released++;
+        if (group->srq_posted - group->srq_released <= ring->recv_low_watermark) {
+            result = flush_released(endpoint, group->srq_released);
+            if (!result) group->srq_released = 0;
+        }
+        pthread_mutex_unlock(&group->srq_lock);
+        return result;
     }
 
-    completion_queue = ibv_create_cq(context, completion_queue_size, NULL, NULL, 0);
-    if (!completion_queue) {
-        fprintf(stderr, "Failed to create completion queue.\n");
-        goto clean_protection_domain;
+    slot_ring_push(&ring->recv_free, slot);
+    if (ring->recv_posted <= ring->recv_low_watermark) {
+        result = flush_released(endpoint, 0);
     }
+    return result;
+}
 
-    struct ibv_qp_init_attr init_attr = {
-        .send_cq = completion_queue,
-        .recv_cq = completion_queue,
-        .cap     = {
-            .max_send_wr  = completion_queue_size,
-            .max_recv_wr  = completion_queue_size,
-            .max_send_sge = 1,
-            .max_recv_sge = 2
-        },
-        .qp_type = IBV_QPT_UD,
-    };
+// Repost all released slots now, regardless of the watermark
+int
+rdma_recv_replenish(struct rdma_endpoint *endpoint)
+{
+    struct rdma_server_group *group = endpoint->group;
 
-    queue_pair = ibv_create_qp(protection_domain, &init_attr);
-    if (!queue_pair)  {
-        fprintf(stderr, "Couldn't create queue pair.\n");
-        goto clean_completion_queue;
+    if (group && group->srq) {
+        pthread_mutex_lock(&group->srq_lock);
+        int result = flush_released(endpoint, group->srq_released);
+        if (!result) group->srq_released = 0;
+        pthread_mutex_unlock(&group->srq_lock);
+        return result;
     }
 
-    struct ibv_qp_attr attr;
-    ibv_query_qp(queue_pair, &attr, IBV_QP_CAP, &init_attr);
-    if (init_attr.cap.max_inline_data >= max_mtu) {
-        send_flags |= IBV_SEND_INLINE;
-    }
+    return flush_released(endpoint, 0);
+}
 
-    attr.qp_state   = IBV_QPS_INIT;
-    attr.pkey_index = 0;
-    attr.port_num   = IB_PORT;
-    attr.qkey       = 0x11111111;
+// Move the slots whose last lease was released back to the free list of the
+// endpoint, reposting them once the receive queue reaches its watermark.
+static int
+reclaim_returned(struct rdma_endpoint *endpoint)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
 
-    if (ibv_modify_qp(queue_pair, &attr, IBV_QP_STATE|IBV_QP_PKEY_INDEX|IBV_QP_PORT|IBV_QP_QKEY)) {
-        fprintf(stderr, "Failed to initialise queue pair.\n");
-        goto clean_queue_pair;
+    int slot = atomic_exchange(&ring->returned_head, -1);
+
+    // The stack holds the latest release first, reverse it so that it ends
+    // up on top of the free list
+    if (ring->recycle_lifo) {
+        int reversed = -1;
+        while (slot >= 0) {
+            int next = ring->returned_next[slot];
+            ring->returned_next[slot] = reversed;
+            reversed = slot;
+            slot = next;
+        }
+        slot = reversed;
     }
 
-    attr.qp_state = IBV_QPS_RTR;
-    if (ibv_modify_qp(queue_pair, &attr, IBV_QP_STATE)) {
-        fprintf(stderr, "Failed to make queue pair ready to receive.\n");
-        goto clean_queue_pair;
+    while (slot >= 0) {
+        int next = ring->returned_next[slot];
+        if (rdma_recv_release(endpoint, slot)) return -1;
+        slot = next;
     }
 
-    return;
+    return 0;
+}
 
-  clean_queue_pair:
-    ibv_destroy_qp(queue_pair);
+// Poll for received datagrams and hand them out as leases on their slots,
+// the payload is used in place and the slot is only reposted once every
+// lease on it is released. Waits up to 'timeout' milliseconds when idle,
+// like rdma_poll(). Returns the number of leases, or -1 on failure.
+int
+rdma_recv_lease
+(struct rdma_endpoint *endpoint, struct rdma_lease *leases, int max, int timeout)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+    struct ibv_wc wc[32];
 
-  clean_completion_queue:
-    ibv_destroy_cq(completion_queue);
+    if (ring->placement) {
+        fprintf(stderr, "Endpoints in block placement mode hand out blocks, not leases.\n");
+        return -1;
+    }
 
-  clean_protection_domain:
-    ibv_dealloc_pd(protection_domain);
+    if (reclaim_returned(endpoint)) return -1;
 
-  clean_device:
-    ibv_close_device(context);
+    int ne = rdma_poll(endpoint, max < 32 ? max : 32, wc, timeout);
+    if (ne < 0) return ne;
 
-  clean_context:
-    fprintf(stderr, "Failed to initialise RDMA context.\n");
-    exit(EXIT_FAILURE);
+    // Raw RoCEv2 frames are followed by the invariant CRC
+    size_t overhead = ring->header_size + (ring->recv_trailer ? ICRC_SIZE : 0);
+
+    for (int i = 0; i < ne; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                    ibv_wc_status_str(wc[i].status), wc[i].status, (int) wc[i].wr_id);
+            return -1;
+        }
+
+        int slot = completion_slot(endpoint, &wc[i]);
+        if (slot < 0) {
+            fprintf(stderr, "Completion for wr_id %d names no receive slot\n",
+                    (int) wc[i].wr_id);
+            return -1;
+        }
+
+        atomic_store_explicit(&ring->lease_refs[slot], 1, memory_order_relaxed);
+
+        leases[i].slot = slot;
+        struct recv_buffer *buffer = &ring->recv_buffers[slot];
+        if (buffer->source) buffer->source->src_qp = wc[i].src_qp;
+
+        leases[i].header_buffer = buffer->header_buffer;
+        leases[i].data_buffer = buffer->data_buffer;
+        leases[i].source = buffer->source;
+        leases[i].byte_len = wc[i].byte_len > overhead ? wc[i].byte_len - overhead : 0;
+    }
+
+    atomic_fetch_add_explicit(&ring->leases, ne, memory_order_relaxed);
+    return ne;
 }
 
-// Server specific ibverbs initialisation. The result value is an array of
-// "struct recv_buffer", we allocate one entry per (potential) completion queue
-// element. These struct hold offsets into the header and data buffers used to
-// receive ibverbs datagrams, splitting these buffers into 1 entry per incoming
-// ibverbs datagram.
-//
-// Initialisation steps:
-//   - Call the shared ibverbs initialisation
-//   - Allocate a data buffer big enough to store the payload for a number of
-//     messages equal to the completion queue size
-//   - Allocate a header buffer big enough to store the header information for
-//     a number of messages equal to the completion queue size
-//   - Allocate a recv_buffer array, contains offsets into data and header
-//     buffers to easily index the data "per datagram"
-//   - Allocate an array for the sge (scatter-gather) configurations for each
-//     of the recv_buffer entries
-//   - Allocate an array of Receive Requests for each of the recv_buffer
-//     entries
-//   - Finally query and report the Local ID, queue pair number, and global ID
-//     on stderr
-struct recv_buffer *
-rdma_init_server(char *dev_name, int completion_queue_size)
+// Take an additional reference on a leased slot, e.g., to hand the payload
+// to a second stage. Every reference needs its own rdma_lease_release().
+void
+rdma_lease_retain(struct rdma_endpoint *endpoint, const struct rdma_lease *lease)
 {
-    struct recv_buffer *result = NULL;
-    union ibv_gid gid;
-    char gid_string[33];
+    atomic_fetch_add_explicit(&receive_ring(endpoint)->lease_refs[lease->slot], 1,
+                              memory_order_relaxed);
+}
 
-    rdma_init(dev_name, completion_queue_size);
+// Drop a reference on a leased slot. Safe to call from any thread, the slot
+// is reposted by the polling thread after the last reference is dropped.
+void
+rdma_lease_release(struct rdma_endpoint *endpoint, const struct rdma_lease *lease)
+{
+    struct rdma_endpoint *ring = receive_ring(endpoint);
+    int slot = lease->slot;
 
-    if (allocate_buf(&buffer, &memory_region, completion_queue_size * MSG_SIZE)) {
-        internal_rdma_cleanup();
-        exit(EXIT_FAILURE);
+    if (atomic_fetch_sub_explicit(&ring->lease_refs[slot], 1, memory_order_acq_rel) != 1) {
+        return;
     }
 
-    if (allocate_buf(&header_buffer, &header_memory_region, completion_queue_size * 40)) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+    int head = atomic_load_explicit(&ring->returned_head, memory_order_relaxed);
+    do {
+        ring->returned_next[slot] = head;
+    } while (!atomic_compare_exchange_weak_explicit(&ring->returned_head, &head, slot,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
 
-    result = malloc(completion_queue_size * (sizeof *result));
-    if (!result) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+    atomic_fetch_sub_explicit(&ring->leases, 1, memory_order_relaxed);
+}
 
-    scatter_gather = malloc(completion_queue_size * 2 * (sizeof *scatter_gather));
-    if (!scatter_gather) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+// Number of slots currently leased out. Once every slot is leased no more
+// receives are posted, so slow consumers apply backpressure on the endpoint.
+int
+rdma_recv_leases(struct rdma_endpoint *endpoint)
+{
+    return atomic_load_explicit(&receive_ring(endpoint)->leases, memory_order_relaxed);
+}
 
-    recv_requests = malloc(completion_queue_size * (sizeof *recv_requests));
-    if (!recv_requests) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+// Data slot of internal sequence number 'sequence' in the block buffers
+static size_t
+placement_slot(const struct block_placement *placement, uint64_t sequence)
+{
+    uint64_t block = sequence / placement->block_packets;
+    return (block % placement->num_blocks) * placement->block_packets
+         + sequence % placement->block_packets;
+}
 
-    struct ib_grh *header_buffers = header_buffer;
-    char *data_buffers = buffer;
-    for (int i = 0; i < completion_queue_size; i++) {
-        result[i].header_buffer = &header_buffers[i];
-        result[i].data_buffer = &data_buffers[i * MSG_SIZE];
+// Mark a packet of a block buffer as placed
+static void
+mark_placed(struct block_placement *placement, size_t slot)
+{
+    int buffer = slot / placement->block_packets;
+    int index = slot % placement->block_packets;
 
-        scatter_gather[2 * i].addr = (uintptr_t) result[i].header_buffer;
-        scatter_gather[2 * i].length = 40;
-        scatter_gather[2 * i].lkey = header_memory_region->lkey;
+    placement->received[buffer * placement->bitmap_words + index / 64] |= 1ULL << (index % 64);
+    placement->block_received[buffer]++;
+}
 
-        scatter_gather[(2 * i) + 1].addr = (uintptr_t) result[i].data_buffer;
-        scatter_gather[(2 * i) + 1].length = MSG_SIZE;
-        scatter_gather[(2 * i) + 1].lkey = memory_region->lkey;
+static bool
+is_placed(const struct block_placement *placement, size_t slot)
+{
+    int buffer = slot / placement->block_packets;
+    int index = slot % placement->block_packets;
 
-        recv_requests[i].wr_id = i;
-        if (i == completion_queue_size - 1) {
-            recv_requests[i].next = &recv_requests[0];
-        } else {
-            recv_requests[i].next = &recv_requests[i+1];
-        }
-        recv_requests[i].sg_list = &scatter_gather[2*i];
-        recv_requests[i].num_sge = 2;
-    }
+    return placement->received[buffer * placement->bitmap_words + index / 64] >> (index % 64) & 1;
+}
 
-    if (ibv_query_gid(context, IB_PORT, 0, &gid)) {
-        fprintf(stderr, "Could not get local gid for gid index 0\n");
-        free(result);
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+// Post Receive Requests for the next expected sequence numbers, in one chain,
+// until the receive queue is full or the sequence numbers run into a block
+// the consumer hasn't released yet. Sequence numbers whose slot already has
+// a Receive Request posted or holds a placed datagram are skipped, the NIC
+// would overwrite the slot otherwise.
+static int
+post_placement(struct rdma_endpoint *endpoint)
+{
+    struct block_placement *placement = endpoint->placement;
+    struct ibv_recv_wr *recv_requests = endpoint->recv_requests;
+    struct ibv_recv_wr *bad_wr;
+    char *data_buffers = endpoint->buffer.addr;
+    int size = endpoint->queue_size;
 
-    struct ibv_port_attr port_attr;
-    if (ibv_query_port(context, IB_PORT, &port_attr)) {
-        fprintf(stderr, "Couldn't get port info\n");
-        free(result);
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+    uint64_t limit = (placement->released + placement->num_blocks) * placement->block_packets;
+    uint64_t sequence = placement->next_post;
+    int count = 0;
+    for (; endpoint->recv_posted + count < size && sequence < limit; sequence++) {
+        size_t slot = placement_slot(placement, sequence);
+        if (placement->slot_pending[slot] || is_placed(placement, slot)) continue;
 
-    if (!inet_ntop(AF_INET6, &gid, gid_string, sizeof gid_string)) {
-        fprintf(stderr, "Couldn't get global id\n");
-        free(result);
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
+        struct ibv_recv_wr *wr = &recv_requests[(placement->wr_head + count) % size];
+
+        wr->wr_id = sequence;
+        wr->sg_list[1].addr = (uintptr_t) &data_buffers[slot * endpoint->stride];
+        wr->sg_list[1].lkey = buf_lkey(&endpoint->buffer, &data_buffers[slot * endpoint->stride]);
+        wr->next = NULL;
+        if (count) recv_requests[(placement->wr_head + count - 1) % size].next = wr;
+
+        placement->slot_pending[slot]++;
+        placement->block_pending[slot / placement->block_packets]++;
+        count++;
     }
 
-    fprintf(stderr, "LID: %d\nQPN: %d\nGID: %s\n", port_attr.lid, queue_pair->qp_num, gid_string);
+    placement->next_post = sequence;
+    if (!count) return 0;
 
-    return result;
+    int result = ibv_post_recv(endpoint->queue_pair, &recv_requests[placement->wr_head], &bad_wr);
+    if (result) {
+        fprintf(stderr, "post receive failed (%d) with errno: %d\n", result, errno);
+        return -1;
+    }
+
+    placement->wr_head = (placement->wr_head + count) % size;
+    endpoint->recv_posted += count;
+    return 0;
 }
 
-// Client specific ibverbs initialisation. The result value is an array of
-// "struct send_buffer", we allocate one entry per (potential) completion queue
-// element. These struct hold offsets into the data buffer used to
-// receive ibverbs datagrams, splitting it into 1 entry per outgoing ibverbs
-// datagram.
-//
-// Initialisation steps:
-//   - Call the shared ibverbs initialisation
-//   - Allocate a data buffer big enough to store the payload for a number of
-//     messages equal to the completion queue size
-//   - Allocate a send_buffer array, contains an offsets into data buffer to
-//     easily index the data "per datagram"
-//   - Allocate an array for the sge (scatter-gather) configurations for each
-//     of the send_buffer entries
-//   - Allocate an array of Send Requests for each of the send_buffer entries
-//   - Transition the queue pair from RTR (Ready-to-Receive) to RTS
-//     (Ready-to-Send)
-//   - Create an Address Handle to address for the server using its local ID,
-//     global ID, and queue pair number
-struct send_buffer*
-rdma_init_client
-( char *dev_name
-, int completion_queue_size
-, int lid
-, union ibv_gid gid
-, uint32_t qpn
+// Internal sequence number of a received datagram, from the immediate data
+// (32 bits, unwrapped around the expected sequence number) or the payload.
+// The first datagram defines the start of the internal numbering. Returns
+// false if the datagram carries no sequence number.
+static bool
+datagram_sequence
+( struct block_placement *placement
+, const struct ibv_wc *wc
+, const char *payload
+, size_t length
+, size_t sequence_offset
+, bool in_payload
+, uint64_t *sequence
 )
 {
-    struct send_buffer *result = NULL;
-    rdma_init(dev_name, completion_queue_size);
-
-    if (allocate_buf(&buffer, &memory_region, completion_queue_size * MSG_SIZE)) {
-        internal_rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+    uint64_t expected = wc->wr_id;
+    uint64_t sender;
 
-    result = malloc(completion_queue_size * (sizeof *result));
-    if (!result) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
+    if (in_payload) {
+        if (length < sequence_offset + sizeof sender) return false;
+        memcpy(&sender, payload + sequence_offset, sizeof sender);
+        sender = le64toh(sender);
+    } else {
+        if (!(wc->wc_flags & IBV_WC_WITH_IMM)) return false;
+        uint32_t expected_sender = expected + placement->sequence_base;
+        sender = expected + placement->sequence_base
+               + (int32_t) (ntohl(wc->imm_data) - expected_sender);
     }
 
-    scatter_gather = malloc(completion_queue_size * (sizeof *scatter_gather));
-    if (!scatter_gather) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
+    if (!placement->synced) {
+        placement->sequence_base = sender - expected;
+        placement->synced = true;
     }
 
-    send_requests = malloc(completion_queue_size * (sizeof *send_requests));
-    if (!send_requests) {
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
-    }
+    *sequence = sender - placement->sequence_base;
+    return true;
+}
 
-    struct ibv_qp_attr attr;
-    attr.qp_state = IBV_QPS_RTS;
-    attr.sq_psn   = 0;
+// Move a datagram received in the slot of sequence number 'expected' to the
+// slot of its own sequence number 'sequence'. If that slot still has a
+// Receive Request posted the datagram waits in a spill slot, the NIC would
+// overwrite it otherwise. Datagrams outside the blocks being received, and
+// duplicates, are dropped.
+static void
+place_datagram
+(struct rdma_endpoint *endpoint, uint64_t expected, uint64_t sequence, size_t length)
+{
+    struct block_placement *placement = endpoint->placement;
+    struct rdma_placement_stats *stats = &placement->stats;
+    char *data_buffers = endpoint->buffer.addr;
+    uint64_t first = placement->next_block * placement->block_packets;
+    uint64_t limit = (placement->released + placement->num_blocks) * placement->block_packets;
 
-    if (ibv_modify_qp(queue_pair, &attr, IBV_QP_STATE|IBV_QP_SQ_PSN)) {
-        fprintf(stderr, "Failed to make queue pair ready to send.\n");
-        free(result);
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
+    if (sequence < first || sequence >= limit) {
+        stats->dropped++;
+        return;
     }
 
-    struct ibv_ah_attr ah_attr;
-    memset(&ah_attr, 0, sizeof(ah_attr));
-    ah_attr.dlid          = lid;
-    ah_attr.sl            = 0; // ??
-    ah_attr.src_path_bits = 0;
-    ah_attr.port_num      = IB_PORT;
-    ah_attr.is_global = 1;
-    ah_attr.grh.hop_limit = 1;
-    ah_attr.grh.dgid = gid;
-    ah_attr.grh.sgid_index = 0; // ??
-
-    errno = 0;
-    ah = ibv_create_ah(protection_domain, &ah_attr);
-    if (!ah) {
-        char *msg = errno != 0 ? strerror(errno) : "";
-        fprintf(stderr, "Failed to create AH: %s\n", msg);
-        free(result);
-        rdma_cleanup();
-        exit(EXIT_FAILURE);
+    size_t source = placement_slot(placement, expected);
+    size_t slot = placement_slot(placement, sequence);
+    if (is_placed(placement, slot) || placement->spill_of[slot] >= 0) {
+        stats->dropped++;
+        return;
     }
 
-    char *data_buffers = buffer;
-    for (int i = 0; i < completion_queue_size; i++) {
-        result[i].data_buffer = &data_buffers[i * MSG_SIZE];
-
-        scatter_gather[i].addr = (uintptr_t) result[i].data_buffer;
-        scatter_gather[i].length = MSG_SIZE;
-        scatter_gather[i].lkey = memory_region->lkey;
+    if (length > endpoint->message_size) length = endpoint->message_size;
 
-        send_requests[i].wr_id = i;
-        if (i == completion_queue_size - 1) {
-            send_requests[i].next = &send_requests[0];
-        } else {
-            send_requests[i].next = &send_requests[i+1];
+    if (placement->slot_pending[slot]) {
+        if (!placement->spill_free.count) {
+            stats->dropped++;
+            return;
         }
-        send_requests[i].sg_list = &scatter_gather[i];
-        send_requests[i].num_sge = 1;
-        send_requests[i].opcode = IBV_WR_SEND;
-        send_requests[i].send_flags = send_flags;
-        send_requests[i].wr.ud.ah = ah;
-        send_requests[i].wr.ud.remote_qpn = qpn;
-        send_requests[i].wr.ud.remote_qkey = 0x11111111;
+        int spill = slot_ring_pop(&placement->spill_free);
+        memcpy(&placement->spill[spill * endpoint->stride],
+               &data_buffers[source * endpoint->stride], length);
+        placement->spill_of[slot] = spill;
+        stats->spilled++;
+        return;
     }
 
-    return result;
+    if (slot == source) {
+        stats->in_place++;
+    } else {
+        memcpy(&data_buffers[slot * endpoint->stride],
+               &data_buffers[source * endpoint->stride], length);
+        stats->copied++;
+    }
+    mark_placed(placement, slot);
 }
 
-// Cleanup all the global allocations done during the initialisation
-void rdma_cleanup()
+// Handle a receive completion in block placement mode: place the datagram,
+// and move a datagram waiting for this slot out of its spill slot. Returns
+// false if the datagram had no sequence number, which is stored in
+// 'sequence' otherwise.
+static bool
+complete_placement(struct rdma_endpoint *endpoint, const struct ibv_wc *wc, uint64_t *sequence)
 {
-    if (ibv_dereg_mr(memory_region)) {
-        fprintf(stderr, "Couldn't destroy memory region.\n");
-        exit(EXIT_FAILURE);
-    }
+    struct block_placement *placement = endpoint->placement;
+    char *data_buffers = endpoint->buffer.addr;
+    uint64_t expected = wc->wr_id;
+    size_t source = placement_slot(placement, expected);
+    size_t length = wc->byte_len > endpoint->header_size ? wc->byte_len - endpoint->header_size : 0;
 
-    free(buffer);
+    placement->slot_pending[source]--;
+    placement->block_pending[source / placement->block_packets]--;
 
-    if (header_memory_region) {
-        if (ibv_dereg_mr(header_memory_region)) {
-            fprintf(stderr, "Couldn't destroy memory region.\n");
-            exit(EXIT_FAILURE);
-        }
+    bool numbered = datagram_sequence(placement, wc, &data_buffers[source * endpoint->stride],
+                                      length, endpoint->options.sequence_offset,
+                                      endpoint->options.sequence_in_payload, sequence);
+    if (numbered) {
+        place_datagram(endpoint, expected, *sequence, length);
+    } else {
+        placement->stats.dropped++;
+    }
+
+    int spill = placement->spill_of[source];
+    if (spill >= 0 && !placement->slot_pending[source]) {
+        memcpy(&data_buffers[source * endpoint->stride],
+               &placement->spill[spill * endpoint->stride], endpoint->message_size);
+        placement->spill_of[source] = -1;
+        slot_ring_push(&placement->spill_free, spill);
+        mark_placed(placement, source);
     }
 
-    if (header_buffer) free(header_buffer);
+    return numbered;
+}
+
+// Realign the Receive Requests still to be posted with the sequence numbers
+// arriving, given the highest sequence number received and the number of
+// Receive Requests posted after its datagram. Datagrams fill Receive Requests
+// in order, so after a loss every datagram in the posted requests lands a
+// slot early and needs a copy. Realigning the requests posted next limits
+// that to at most a receive queue's worth of datagrams. Realigning only moves
+// forward, a late datagram must not make sequence numbers be posted twice.
+static void
+realign_placement(struct rdma_endpoint *endpoint, uint64_t sequence, int posted_after)
+{
+    struct block_placement *placement = endpoint->placement;
+    uint64_t first = placement->next_block * placement->block_packets;
+    uint64_t next = sequence + posted_after + 1;
 
-    if (scatter_gather) free(scatter_gather);
-    if (recv_requests) free(recv_requests);
-    if (send_requests) free(send_requests);
+    // Only follow plausible sequence numbers
+    int64_t shift = next - placement->next_post;
+    if (shift <= 0 || shift >= endpoint->queue_size) return;
 
-    internal_rdma_cleanup();
+    placement->next_post = next < first ? first : next;
 }
 
-// Cleanup that's shared between rdma_cleanup() and the error handling in this
-// file.
-static void internal_rdma_cleanup()
+// Hand out the oldest block if all of its packets arrived, or if no Receive
+// Request for it remains posted and none will be. Missing packets are
+// reported in the 'missing' bitmap of the block.
+static bool
+block_ready(struct rdma_endpoint *endpoint, struct rdma_block *block)
 {
-    if (ah) {
-        if (ibv_destroy_ah(ah)) {
-            fprintf(stderr, "Couldn't destroy AH.\n");
-            exit(EXIT_FAILURE);
-        }
-    }
+    struct block_placement *placement = endpoint->placement;
+    uint64_t number = placement->next_block;
+    uint64_t end = (number + 1) * placement->block_packets;
+    int buffer = number % placement->num_blocks;
+    int words = placement->bitmap_words;
 
-    if (ibv_destroy_qp(queue_pair)) {
-        fprintf(stderr, "Couldn't destroy queue pair.\n");
-        exit(EXIT_FAILURE);
+    if (number >= placement->released + placement->num_blocks) return false;
+    if (placement->block_pending[buffer]) return false;
+    if (placement->block_received[buffer] < placement->block_packets
+        && placement->next_post < end) {
+        return false;
     }
 
-    if (ibv_destroy_cq(completion_queue)) {
-        fprintf(stderr, "Couldn't destroy completion queue.\n");
-        exit(EXIT_FAILURE);
+    uint64_t *missing = &placement->missing[buffer * words];
+    for (int i = 0; i < words; i++) {
+        missing[i] = ~placement->received[buffer * words + i];
     }
-
-    if (ibv_dealloc_pd(protection_domain)) {
-        fprintf(stderr, "Couldn't deallocate protection domain.\n");
-        exit(EXIT_FAILURE);
+    if (placement->block_packets % 64) {
+        missing[words - 1] &= (1ULL << (placement->block_packets % 64)) - 1;
     }
 
-    if (ibv_close_device(context)) {
-        fprintf(stderr, "Couldn't release context\n");
-        exit(EXIT_FAILURE);
-    }
+    block->sequence = number * placement->block_packets + placement->sequence_base;
+    block->data = (char *) endpoint->buffer.addr + buffer * placement->block_bytes;
+    block->packets = placement->block_packets;
+    block->received = placement->block_received[buffer];
+    block->missing = missing;
+
+    placement->next_block++;
+    if (placement->next_post < end) placement->next_post = end;
+    placement->stats.blocks++;
+    return true;
 }
 
-// Treat the allocated data buffer and Send Requests as a circular buffer from
-// which we post requests to the the NIC. Starting from request at index
-// 'start' and posting the next 'count' requests.
-int post_sends(int start, int count)
+// Poll for datagrams and place them in the block buffers, reposting Receive
+// Requests for the sequence numbers expected next. Returns 1 with the oldest
+// block once it is ready, see block_ready().
+int
+rdma_recv_block(struct rdma_endpoint *endpoint, struct rdma_block *block, int timeout)
 {
-    int return_value = 0;
-    struct ibv_send_wr *bad_wr;
+    struct ibv_wc wc[32];
 
-    size_t last_idx = (start + count - 1) % queue_size;
-    void *old = send_requests[last_idx].next;
+    if (!endpoint->placement) {
+        fprintf(stderr, "Endpoint is not in block placement mode.\n");
+        return -1;
+    }
 
-    send_requests[last_idx].next = NULL;
+    if (block_ready(endpoint, block)) return 1;
 
-    int result = ibv_post_send(queue_pair, &send_requests[start], &bad_wr);
-    if (result) {
-        fprintf(stderr, "post send failed (%d) with errno: %d\n%s\n%s\n", result, errno, strerror(result), strerror(errno));
-        return_value = -1;
+    int ne = rdma_poll(endpoint, 32, wc, timeout);
+    if (ne < 0) return ne;
+
+    uint64_t sequence, highest = 0;
+    int highest_index = -1;
+    for (int i = 0; i < ne; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Failed status %s (%d) for wr_id %lu\n",
+                    ibv_wc_status_str(wc[i].status), wc[i].status, (unsigned long) wc[i].wr_id);
+            return -1;
+        }
+        if (complete_placement(endpoint, &wc[i], &sequence)
+            && (highest_index < 0 || sequence > highest)) {
+            highest = sequence;
+            highest_index = i;
+        }
+    }
+
+    // rdma_poll() already counted all 'ne' Receive Requests as completed
+    if (highest_index >= 0) {
+        realign_placement(endpoint, highest, endpoint->recv_posted + ne - 1 - highest_index);
     }
 
-    send_requests[last_idx].next = old;
+    if (post_placement(endpoint)) return -1;
 
-    return return_value;
+    return block_ready(endpoint, block) ? 1 : 0;
 }
 
-// Treat the allocated data buffer and Receive Requests as a circular buffer
-// from which we post requests to the the NIC. Starting from request at index
-// 'start' and posting the next 'count' requests.
-int post_recvs(int start, int count)
+// Release the oldest block handed out, its buffer takes the block after the
+// last one being received and Receive Requests are posted for it.
+int
+rdma_block_release(struct rdma_endpoint *endpoint, const struct rdma_block *block)
 {
-    int return_value = 0;
-    struct ibv_recv_wr *bad_wr;
+    struct block_placement *placement = endpoint->placement;
+    int buffer = (block->data - (char *) endpoint->buffer.addr) / placement->block_bytes;
+    int words = placement->bitmap_words;
 
-    size_t last_idx = (start + count - 1) % queue_size;
-    void *old = recv_requests[last_idx].next;
-
-    recv_requests[last_idx].next = NULL;
-
-    int result = ibv_post_recv(queue_pair, &recv_requests[start], &bad_wr);
-    if (result) {
-        fprintf(stderr, "post receive failed (%d) with errno: %d\n", result, errno);
-        return_value = -1;
+    if (buffer != (int) (placement->released % placement->num_blocks)) {
+        fprintf(stderr, "Blocks must be released in the order they were received.\n");
+        return -1;
     }
 
-    recv_requests[last_idx].next = old;
+    memset(&placement->received[buffer * words], 0, words * sizeof *placement->received);
+    placement->block_received[buffer] = 0;
+    placement->released++;
 
-    return return_value;
+    return post_placement(endpoint);
+}
+
+void
+rdma_get_placement_stats(struct rdma_endpoint *endpoint, struct rdma_placement_stats *stats)
+{
+    if (endpoint->placement) {
+        *stats = endpoint->placement->stats;
+    } else {
+        memset(stats, 0, sizeof *stats);
+    }
 }
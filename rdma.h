@@ -7,6 +7,7 @@
 #define RDMA_H
 
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #if defined(__has_include)
 #if __has_include(<infiniband/verbs.h>)
@@ -17,12 +18,49 @@
 #endif
 
 #include "constants.h"
+#include "latency_histogram.h"
+#include "mr_cache.h"
+
+// Header fields of a datagram kept by the RDMA_HEADERS_COMPACT policy: the
+// source GID, scattered from the GRH by the NIC, and the source queue pair
+// number from the completion.
+struct rdma_compact_header {
+    union ibv_gid sgid;
+    uint32_t src_qp;
+};
 
 // Struct for the allocated receive buffers, separate pointers for the header
-// and payload parts, since we use separate buffers for these.
+// and payload parts, since we use separate buffers for these. For endpoints
+// of a server group in RSS mode the header slot holds the raw
+// Ethernet/IPv4/UDP/BTH/DETH headers of the frame instead of a GRH. Without
+// the RDMA_HEADERS_KEEP policy 'header_buffer' is NULL, and 'source' points
+// at the compact header fields of RDMA_HEADERS_COMPACT.
 struct recv_buffer {
     struct ib_grh *header_buffer;
     char *data_buffer;
+    struct rdma_compact_header *source;
+};
+
+// Lease on a received datagram, see rdma_recv_lease(). The header and payload
+// stay valid, in place in the circular buffer, until the lease is released.
+// 'byte_len' is the payload size, excluding the header slot.
+struct rdma_lease {
+    int slot;
+    struct ib_grh *header_buffer;
+    char *data_buffer;
+    uint32_t byte_len;
+    const struct rdma_compact_header *source;
+};
+
+// Block of consecutive packets handed out by rdma_recv_block(). Packet i of
+// the block, sequence number 'sequence + i', is at 'data + i * stride' (see
+// rdma_buffer_stride()), bit i of 'missing' is set if it never arrived.
+struct rdma_block {
+    uint64_t sequence;
+    char *data;
+    int packets;
+    int received;
+    const uint64_t *missing;
 };
 
 // Struct for the allocated send buffers
@@ -30,28 +68,496 @@ struct send_buffer {
     char *data_buffer;
 };
 
-// Pointer to the allocated completion queue
-extern struct ibv_cq *completion_queue;
+// Transport of the queue pairs of an endpoint. Unreliable Datagram endpoints
+// send to a receiver they address per datagram. Reliable and Unreliable
+// Connected endpoints are connected to a single peer (see rdma_accept() and
+// rdma_connect()) and the client writes every message straight into a slot
+// of the receive ring of the server with RDMA WRITE with immediate, the
+// immediate data carrying the slot index.
+enum rdma_transport {
+    RDMA_TRANSPORT_UD,
+    RDMA_TRANSPORT_RC,
+    RDMA_TRANSPORT_UC
+};
 
-struct recv_buffer *
+// What a receive endpoint keeps of the GRH of every datagram: all of it, in a
+// header slot per receive entry, nothing, scattering every GRH into one
+// shared sink slot, or only the source GID and queue pair number, in a
+// compact side array.
+enum rdma_header_policy {
+    RDMA_HEADERS_KEEP,
+    RDMA_HEADERS_DISCARD,
+    RDMA_HEADERS_COMPACT
+};
+
+// Optional features of an endpoint. Passing NULL, or a zero-initialised
+// struct, to the initialisation functions gives the defaults.
+struct rdma_options {
+    // Create the completion queue with a completion channel, letting
+    // rdma_poll() block on completion events when the endpoint is idle.
+    bool completion_channel;
+    // Microseconds without completions after which rdma_poll() stops busy
+    // polling and waits for a completion event instead.
+    long idle_usec;
+    // Timestamp completions, with the device clock of an extended completion
+    // queue where supported and TSC timestamps otherwise, and record latency
+    // histograms in rdma_poll()/post_recvs().
+    bool timestamps;
+    // Back the data and header buffers with hugepages of this size (2 MiB or
+    // 1 GiB), falling back to smaller pages if none are available. 0 for base
+    // pages, sizes that aren't a power of two fail.
+    size_t hugepage_size;
+    // Only signal every Nth Send Request, the completion of a signaled
+    // request also frees the unsignaled slots before it. 0 or 1 signals
+    // every request, larger values are capped at the queue size.
+    int signal_interval;
+    // Largest datagram payload in bytes, at most the port MTU. 0 for the
+    // port MTU, capped at MSG_SIZE. Connected transports default to MSG_SIZE.
+    size_t message_size;
+    // Pad every buffer slot to a multiple of this power of two, e.g., the
+    // page size for O_DIRECT writes of the payload. 0 for a cache line.
+    size_t stride_alignment;
+    // Repost released receive slots once no more than this many Receive
+    // Requests remain posted. 0 for half the receive queue.
+    int recv_low_watermark;
+    // Register buffers with On-Demand Paging where the device supports it,
+    // instead of touching and pinning all of their memory at startup, and
+    // prefetch the first 'odp_prefetch' bytes of every buffer.
+    bool on_demand_paging;
+    size_t odp_prefetch;
+    // Fault in and register the buffers with this many threads in parallel,
+    // registering every buffer as 'registration_chunks' memory regions. 0 or
+    // 1 for a single thread and memory region per buffer.
+    int init_threads;
+    int registration_chunks;
+    // Fault in the buffers by touching a byte per page instead of zeroing
+    // them, anonymous memory is zero-filled by the kernel already.
+    bool skip_zeroing;
+    // Transport of the queue pair, Unreliable Datagram by default. Messages
+    // of a connected transport are not limited by the port MTU.
+    enum rdma_transport transport;
+    // Place received datagrams by sequence number into 'placement_blocks'
+    // (0 for 4) blocks of 'block_packets' consecutive packets, instead of
+    // the circular buffer, see rdma_recv_block(). The sequence number is the
+    // immediate data of a datagram, or with 'sequence_in_payload' the 64-bit
+    // little-endian number at byte 'sequence_offset' of its payload. UD only.
+    int block_packets;
+    int placement_blocks;
+    bool sequence_in_payload;
+    size_t sequence_offset;
+    // Send every datagram with its sequence number as immediate data
+    bool send_sequence;
+    // Scatter the payload of every datagram over 'scatter_segments' separate
+    // arrays, the next 'scatter_layout[k]' bytes into array k, e.g., an array
+    // per polarisation. The NIC does the de-interleaving, the message size is
+    // the sum of the segments. The layout is copied at initialisation. UD
+    // endpoints with a circular buffer only, 0 for a single payload array.
+    const size_t *scatter_layout;
+    int scatter_segments;
+    // GRHs kept by receive endpoints, all of them by default. Doesn't apply to
+    // the raw headers of RSS groups.
+    enum rdma_header_policy header_policy;
+    // Repost released receive slots most recently released first, keeping at
+    // most 'recycle_budget' bytes of slots posted, e.g., the ways of the
+    // last-level cache DDIO writes into, so the NIC keeps writing into lines
+    // that are still cached. UD endpoints outside SRQ groups only, 0 to cycle
+    // through the whole circular buffer.
+    size_t recycle_budget;
+    // Let any number of threads send on the endpoint concurrently through
+    // rdma_send_reserve()/rdma_send_commit() instead of acquiring slots with
+    // rdma_send_acquire().
+    bool concurrent_send;
+    // Send up to this many payload segments from application memory per
+    // message with rdma_send_gather(), registering that memory through a
+    // cache of at most 'mr_cache_entries' memory regions (0 for 64). 0
+    // disables gather sends. Endpoints with both this and concurrent_send fail
+    // to initialise.
+    int gather_segments;
+    int mr_cache_entries;
+    // Never send inline. By default Send Requests that fit in the inline
+    // data of the queue pair are sent inline, see rdma_max_inline().
+    bool disable_inline;
+    // Have the NIC pace the sends of a client to this many kbit/s, if it
+    // supports packet pacing for the transport at that rate, see
+    // rdma_rate_limited(). 0 for no limit.
+    uint32_t rate_limit_kbps;
+};
+
+// Time spent in the phases of allocating the buffers of an endpoint, the
+// total size of the buffers, the smallest page size backing them, and the
+// NUMA node the data buffer ended up on (-1 if unknown). With On-Demand
+// Paging 'touch_ns' is the time spent prefetching.
+struct rdma_alloc_stats {
+    uint64_t alloc_ns;
+    uint64_t touch_ns;
+    uint64_t register_ns;
+    size_t bytes;
+    size_t page_size;
+    int numa_node;
+    bool on_demand;
+    // Threads used to touch and register, and memory regions registered
+    int threads;
+    int num_mrs;
+};
+
+// Packets placed by an endpoint in block placement mode: straight into their
+// slot, moved there with a copy, moved through a spill slot (two copies)
+// because their slot still had a Receive Request posted, and dropped as
+// duplicate, out of the window, or without a sequence number.
+struct rdma_placement_stats {
+    uint64_t in_place;
+    uint64_t copied;
+    uint64_t spilled;
+    uint64_t dropped;
+    uint64_t blocks;
+};
+
+// Time spent and events counted by rdma_poll() for an endpoint
+struct rdma_poll_stats {
+    // Nanoseconds in busy polling mode and blocked waiting for an event
+    uint64_t busy_poll_ns;
+    uint64_t interrupt_ns;
+    uint64_t completions;
+    uint64_t empty_polls;
+    // Completion events received and switches from busy polling to waiting
+    uint64_t interrupts;
+    uint64_t mode_switches;
+};
+
+struct rdma_send_stats {
+    // Send Requests posted and the chains, one doorbell each, they were
+    // posted in
+    uint64_t messages;
+    uint64_t chains;
+    // Concurrent send path: passes in which a thread posted the commits of
+    // every thread in one chain
+    uint64_t combines;
+};
+
+// Parse a size with an optional K, M, or G suffix (e.g., "2M"), 0 if the
+// string isn't a valid size.
+size_t
+rdma_parse_size(const char *str);
+
+// Parse a transport name ("ud", "rc", or "uc"), -1 if it isn't one.
+int
+rdma_parse_transport(const char *str);
+
+// Parse a header policy name ("keep", "discard", or "compact"), -1 if it
+// isn't one.
+int
+rdma_parse_header_policy(const char *str);
+
+// Opaque handle for a single ibverbs endpoint. An endpoint owns its own
+// device context, protection domain, completion queue, queue pair, and
+// circular buffer. Endpoints share no state, so a process can create several
+// of them and drive each one from its own thread.
+struct rdma_endpoint;
+
+// Opaque handle for a group of receive endpoints sharing a single device.
+struct rdma_server_group;
+
+// How the endpoints of a server group receive: spread over receive work
+// queues by RSS (falling back to one queue pair per endpoint), or with one
+// queue pair per endpoint drawing from a shared receive queue.
+enum rdma_group_mode {
+    RDMA_GROUP_RSS,
+    RDMA_GROUP_SRQ
+};
+
+struct rdma_endpoint *
 rdma_init_server
-(char *dev_name, int completion_queue_size);
+(char *dev_name, int completion_queue_size, const struct rdma_options *options);
 
-struct send_buffer *
+struct rdma_endpoint *
 rdma_init_client
 ( char *dev_name
 , int completion_queue_size
 , int lid
 , union ibv_gid gid
 , uint32_t qpn
+, const struct rdma_options *options
+);
+
+// Connect a server endpoint of a connected transport to the next client
+// connecting on TCP port 'port', exchanging queue pair numbers, addresses,
+// and the location and keys of the receive ring. All receive slots are
+// posted before the client gets to write. Blocks until a client connects.
+// An RC client only writes slots the server released, see rdma_connect(); a
+// UC client can overwrite slots the server still holds.
+int
+rdma_accept(struct rdma_endpoint *endpoint, const char *port);
+
+// Create a client endpoint of the connected transport of 'options' (RC if
+// it is UD) and connect it to the server accepting on 'host' and 'port'.
+// Posted send slots are written to the slots of the server's receive ring in
+// ring order. An RC client reads the number of slots the server reposted in
+// ring order with RDMA READ and rdma_send_acquire() fails while the next
+// slot isn't reposted yet, so every write finds a Receive Request. UC has no RDMA READ, so a UC client writes
+// regardless and overruns a server that falls behind. Not with
+// concurrent_send.
+struct rdma_endpoint *
+rdma_connect
+( char *dev_name
+, int completion_queue_size
+, const char *host
+, const char *port
+, const struct rdma_options *options
+);
+
+void
+rdma_cleanup(struct rdma_endpoint *endpoint);
+
+// Create 'num_queues' receive endpoints on one device. In RDMA_GROUP_RSS mode
+// RSS spreads incoming RoCEv2 traffic over the endpoints when the device
+// supports it, with a fallback to one UD queue pair per endpoint. In
+// RDMA_GROUP_SRQ mode the endpoints share a pool of 'completion_queue_size'
+// receive buffers, which the group posts itself.
+struct rdma_server_group *
+rdma_init_server_group
+( char *dev_name
+, int completion_queue_size
+, int num_queues
+, enum rdma_group_mode mode
+, const struct rdma_options *options
+);
+
+// Release a server group, including all of its endpoints. Endpoints of a
+// group must not be passed to rdma_cleanup.
+void
+rdma_server_group_cleanup(struct rdma_server_group *group);
+
+int
+rdma_server_group_size(struct rdma_server_group *group);
+
+struct rdma_endpoint *
+rdma_server_group_endpoint(struct rdma_server_group *group, int index);
+
+bool
+rdma_server_group_uses_rss(struct rdma_server_group *group);
+
+// Handle pending asynchronous device events, waiting up to 'timeout'
+// milliseconds for one. Refills the SRQ when it reaches its low watermark.
+int
+rdma_server_group_handle_events(struct rdma_server_group *group, int timeout);
+
+long
+rdma_server_group_emergency_refills(struct rdma_server_group *group);
+
+// Array of per-datagram receive buffers, one per completion queue entry. The
+// array is owned by the endpoint and freed by rdma_cleanup.
+struct recv_buffer *
+rdma_recv_buffers(struct rdma_endpoint *endpoint);
+
+// Array of per-datagram send buffers, one per completion queue entry. The
+// array is owned by the endpoint and freed by rdma_cleanup.
+struct send_buffer *
+rdma_send_buffers(struct rdma_endpoint *endpoint);
+
+struct ibv_cq *
+rdma_completion_queue(struct rdma_endpoint *endpoint);
+
+uint32_t
+rdma_queue_pair_number(struct rdma_endpoint *endpoint);
+
+// Local ID and GID (index 0) of the port of the endpoint, -1 on failure
+int
+rdma_local_address(struct rdma_endpoint *endpoint, int *lid, union ibv_gid *gid);
+
+// Completion channel file descriptor for epoll, -1 without a channel
+int
+rdma_completion_fd(struct rdma_endpoint *endpoint);
+
+// Poll for completions, busy polling while traffic flows and blocking for up
+// to 'timeout' milliseconds on the completion channel once idle.
+int
+rdma_poll
+(struct rdma_endpoint *endpoint, int num_entries, struct ibv_wc *wc, int timeout);
+
+void
+rdma_get_poll_stats(struct rdma_endpoint *endpoint, struct rdma_poll_stats *stats);
+
+// Message size of the endpoint and the distance in bytes between consecutive
+// data buffers of its circular buffer.
+size_t
+rdma_message_size(struct rdma_endpoint *endpoint);
+
+size_t
+rdma_buffer_stride(struct rdma_endpoint *endpoint);
+
+// Array 'segment' of the scatter layout of an endpoint, one slot per receive
+// entry, the slot of a lease at 'slot * stride'. Segment 0 is the data buffer
+// of the lease. NULL if the endpoint has no such segment.
+char *
+rdma_segment_buffer(struct rdma_endpoint *endpoint, int segment, size_t *stride);
+
+// NUMA node the device of the endpoint is attached to, -1 if unknown. The
+// buffers of the endpoint are allocated on this node.
+int
+rdma_numa_node(struct rdma_endpoint *endpoint);
+
+void
+rdma_get_alloc_stats(struct rdma_endpoint *endpoint, struct rdma_alloc_stats *stats);
+
+// Histograms, in nanoseconds, of the delay from NIC arrival to poll and from
+// poll to repost of received datagrams. NULL without the timestamps option.
+// Without hardware timestamps the arrival time is bounded by the previous
+// poll of the completion queue, so the NIC-to-poll delay is an upper bound.
+const struct latency_histogram *
+rdma_nic_to_poll_histogram(struct rdma_endpoint *endpoint);
+
+const struct latency_histogram *
+rdma_poll_to_repost_histogram(struct rdma_endpoint *endpoint);
+
+bool
+rdma_hardware_timestamps(struct rdma_endpoint *endpoint);
+
+// Acquire a free slot of the send buffer to fill, -1 if none is free, or an
+// RC client has no credit for another, and -2 if an RC client can't read its
+// credits. Slots return to the free list once their Send completes (see
+// rdma_reap_sends).
+int
+rdma_send_acquire(struct rdma_endpoint *endpoint);
+
+// Number of send slots that can currently be acquired
+int
+rdma_send_credits(struct rdma_endpoint *endpoint);
+
+// Send only the first 'length' bytes of an acquired slot, rather than the
+// full message size. Returns -1 if the slot is smaller.
+int
+rdma_send_set_length(struct rdma_endpoint *endpoint, int slot, size_t length);
+
+// Whether the NIC paces the sends of the endpoint at the rate_limit_kbps
+// option. Without device support the limit is ignored, so the sender has to
+// pace itself.
+bool
+rdma_rate_limited(struct rdma_endpoint *endpoint);
+
+// Largest Send Request in bytes the endpoint sends inline, with
+// IBV_SEND_INLINE, which saves the NIC a DMA read of the send slot. 0 if
+// the device or the disable_inline option rules out inline sends.
+uint32_t
+rdma_max_inline(struct rdma_endpoint *endpoint);
+
+// Post the acquired send slots 'start' up to 'start + count' of the circular
+// buffer (post_sends), or an arbitrary list of acquired slots, as a single
+// chain. Returns -1 on failure.
+int
+post_sends(struct rdma_endpoint *endpoint, int start, int count);
+
+int
+rdma_post_send_slots(struct rdma_endpoint *endpoint, const int *slots, int count);
+
+// Reap Send completions and return the slots they free to the free list.
+// Returns the number of slots freed, or -1 on a failed completion or once an
+// RC client failed to read its credits.
+int
+rdma_reap_sends(struct rdma_endpoint *endpoint);
+
+// Concurrent send path of endpoints with the concurrent_send option. Send
+// slots are numbered by tickets in posting order, ticket t using slot
+// t % queue size. Any thread reserves a run of 'count' consecutive tickets,
+// fills their buffers, and commits them. Whichever thread commits while no
+// other thread is combining posts the longest run of committed tickets as one
+// chain and reaps completions, so threads never wait on a lock.
+//
+// Returns the first ticket of the run, -1 if fewer than 'count' slots are
+// free, or -2 if posting failed or 'count' isn't between 1 and the queue
+// size.
+int64_t
+rdma_send_reserve(struct rdma_endpoint *endpoint, int count);
+
+// Data buffer of a reserved ticket
+char *
+rdma_send_ticket_buffer(struct rdma_endpoint *endpoint, int64_t ticket);
+
+// Commit the run of 'count' tickets starting at 'ticket'. Returns -1 if
+// posting failed.
+int
+rdma_send_commit(struct rdma_endpoint *endpoint, int64_t ticket, int count);
+
+void
+rdma_get_send_stats(struct rdma_endpoint *endpoint, struct rdma_send_stats *stats);
+
+// Send a message gathered from application memory, for endpoints with the
+// gather_segments option: 'header_length' bytes at 'header', copied into a
+// send slot, followed by 'num_segments' payload segments the NIC reads in
+// place. The payload memory is registered through the endpoint's
+// registration cache, and must stay untouched until the Send completes
+// (see rdma_reap_sends()). Returns 1 if no send slot is free, -1 on failure.
+int
+rdma_send_gather
+( struct rdma_endpoint *endpoint
+, const void *header
+, size_t header_length
+, const struct iovec *segments
+, int num_segments
 );
 
+// Register application memory in the registration cache up front, e.g., a
+// whole array, rather than in steps as gather sends reach further into it,
+// each step registering the union with what came before. Returns -1 on
+// failure.
+int
+rdma_send_register(struct rdma_endpoint *endpoint, const void *addr, size_t length);
+
+// Drop cached registrations of application memory before unmapping it
+void
+rdma_send_forget(struct rdma_endpoint *endpoint, const void *addr, size_t length);
+
+void
+rdma_get_mr_cache_stats(struct rdma_endpoint *endpoint, struct mr_cache_stats *stats);
+
+// Hand the receive slot of a completion (its wr_id, or the immediate data for
+// a connected transport) back to the endpoint, in any order. Released slots
+// are reposted in one chain once the receive queue drains to the low
+// watermark.
+int
+rdma_recv_release(struct rdma_endpoint *endpoint, int slot);
+
+// Repost all released receive slots immediately
+int
+rdma_recv_replenish(struct rdma_endpoint *endpoint);
+
+// Post Receive Requests for the slots 'start' up to 'start + count' of the
+// circular buffer at once, e.g., to fill the receive queue initially. In block
+// placement mode this fills the receive queue with the next expected
+// sequence numbers instead.
+int
+post_recvs(struct rdma_endpoint *endpoint, int start, int count);
+
+// Poll for received datagrams and return up to 'max' leases on their slots,
+// waiting up to 'timeout' milliseconds when idle. A slot is reposted only
+// after every reference on its lease is released, the payload can be
+// processed in place without copying. Returns -1 on failure.
+int
+rdma_recv_lease
+(struct rdma_endpoint *endpoint, struct rdma_lease *leases, int max, int timeout);
+
+// Take an extra reference on a lease, released separately
+void
+rdma_lease_retain(struct rdma_endpoint *endpoint, const struct rdma_lease *lease);
+
+// Release a reference on a lease, may be called from any thread
 void
-rdma_cleanup();
+rdma_lease_release(struct rdma_endpoint *endpoint, const struct rdma_lease *lease);
 
+// Number of receive slots currently leased out
 int
-post_sends(int start, int count);
+rdma_recv_leases(struct rdma_endpoint *endpoint);
 
+// Block placement mode: poll for datagrams and place them by sequence number,
+// waiting up to 'timeout' milliseconds when idle. Returns 1 and fills in
+// 'block' once the oldest block is complete, or can't be completed any more,
+// 0 if there is none yet, or -1 on failure.
 int
-post_recvs(int start, int count);
+rdma_recv_block(struct rdma_endpoint *endpoint, struct rdma_block *block, int timeout);
+
+// Hand a block back to be reused, in the order blocks were received
+int
+rdma_block_release(struct rdma_endpoint *endpoint, const struct rdma_block *block);
+
+void
+rdma_get_placement_stats(struct rdma_endpoint *endpoint, struct rdma_placement_stats *stats);
 #endif
@@ -0,0 +1,793 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rdma.h"
+#include "send_pipeline.h"
+
+static uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Allocate the circular buffers of a receive endpoint with base pages, 2 MiB,
+// and 1 GiB hugepages and compare the time spent allocating, touching, and
+// registering them.
+static int
+bench_pages(int argc, char *argv[])
+{
+    static const size_t page_sizes[] = { 0, 2UL << 20, 1UL << 30 };
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: rdma_bench pages <IB driver> <ring entries>\n");
+        return EXIT_FAILURE;
+    }
+
+    char *dev_name = argv[0];
+    int entries = atoi(argv[1]);
+
+    printf("%10s %10s %12s %12s %12s %12s\n", "requested", "backing",
+           "MiB", "alloc ms", "touch ms", "register ms");
+
+    for (size_t i = 0; i < sizeof page_sizes / sizeof *page_sizes; i++) {
+        struct rdma_options options = { .hugepage_size = page_sizes[i] };
+        struct rdma_endpoint *endpoint = rdma_init_server(dev_name, entries, &options);
+        if (!endpoint) return EXIT_FAILURE;
+
+        struct rdma_alloc_stats stats;
+        rdma_get_alloc_stats(endpoint, &stats);
+        rdma_cleanup(endpoint);
+
+        printf("%9zuK %9zuK %12.1f %12.3f %12.3f %12.3f\n",
+               (page_sizes[i] ? page_sizes[i] : stats.page_size) >> 10,
+               stats.page_size >> 10, stats.bytes / (double) (1 << 20),
+               stats.alloc_ns / 1e6, stats.touch_ns / 1e6,
+               stats.register_ns / 1e6);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Create a receive endpoint with pinned buffers and with On-Demand Paging
+// buffers, and compare how long startup takes.
+static int
+bench_odp(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: rdma_bench odp <IB driver> <ring entries> [prefetch bytes]\n");
+        return EXIT_FAILURE;
+    }
+
+    char *dev_name = argv[0];
+    int entries = atoi(argv[1]);
+    size_t prefetch = argc == 3 ? rdma_parse_size(argv[2]) : 0;
+
+    printf("%10s %12s %12s %12s %12s %12s\n", "mode", "MiB", "startup ms",
+           "alloc ms", "touch ms", "register ms");
+
+    for (int on_demand = 0; on_demand < 2; on_demand++) {
+        struct rdma_options options = {
+            .on_demand_paging = on_demand,
+            .odp_prefetch = prefetch,
+        };
+
+        uint64_t start = bench_now_ns();
+        struct rdma_endpoint *endpoint = rdma_init_server(dev_name, entries, &options);
+        uint64_t startup = bench_now_ns() - start;
+        if (!endpoint) return EXIT_FAILURE;
+
+        struct rdma_alloc_stats stats;
+        rdma_get_alloc_stats(endpoint, &stats);
+        rdma_cleanup(endpoint);
+
+        printf("%10s %12.1f %12.3f %12.3f %12.3f %12.3f\n",
+               stats.on_demand ? "on-demand" : "pinned",
+               stats.bytes / (double) (1 << 20), startup / 1e6,
+               stats.alloc_ns / 1e6, stats.touch_ns / 1e6,
+               stats.register_ns / 1e6);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Fault in and register the buffers of a receive endpoint with 1 up to
+// 'max threads' threads, registering as many memory regions as threads, with
+// and without zeroing the buffers.
+static int
+bench_init(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: rdma_bench init <IB driver> <ring entries> [max threads]\n");
+        return EXIT_FAILURE;
+    }
+
+    char *dev_name = argv[0];
+    int entries = atoi(argv[1]);
+    int max_threads = argc == 3 ? atoi(argv[2]) : 8;
+
+    printf("%8s %8s %6s %12s %12s %12s %12s\n", "threads", "MRs", "zero",
+           "MiB", "alloc ms", "touch ms", "register ms");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        for (int skip_zeroing = 0; skip_zeroing < 2; skip_zeroing++) {
+            struct rdma_options options = {
+                .init_threads = threads,
+                .registration_chunks = threads,
+                .skip_zeroing = skip_zeroing,
+            };
+
+            struct rdma_endpoint *endpoint = rdma_init_server(dev_name, entries, &options);
+            if (!endpoint) return EXIT_FAILURE;
+
+            struct rdma_alloc_stats stats;
+            rdma_get_alloc_stats(endpoint, &stats);
+            rdma_cleanup(endpoint);
+
+            printf("%8d %8d %6s %12.1f %12.3f %12.3f %12.3f\n", stats.threads,
+                   stats.num_mrs, skip_zeroing ? "no" : "yes",
+                   stats.bytes / (double) (1 << 20), stats.alloc_ns / 1e6,
+                   stats.touch_ns / 1e6, stats.register_ns / 1e6);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Keep the send queue of a client endpoint full for 'seconds' seconds and
+// return the number of messages sent, -1 on failure.
+static int64_t
+send_flood(struct rdma_endpoint *endpoint, int queue_size, double seconds)
+{
+    uint64_t packets = 0;
+    uint64_t end = bench_now_ns() + seconds * 1e9;
+    int slots[queue_size];
+
+    while (bench_now_ns() < end) {
+        int num_slots = 0;
+        while (num_slots < queue_size
+               && (slots[num_slots] = rdma_send_acquire(endpoint)) >= 0) {
+            num_slots++;
+        }
+        if (rdma_post_send_slots(endpoint, slots, num_slots)) return -1;
+
+        int completed = rdma_reap_sends(endpoint);
+        if (completed < 0) return -1;
+        packets += completed;
+    }
+
+    return packets;
+}
+
+// Send datagrams as fast as the send queue allows for every signal interval
+// and report the packet rate and the number of completions it took.
+static int
+bench_pps(int argc, char *argv[])
+{
+    static const int intervals[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const int queue_size = 256;
+
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: rdma_bench pps <IB driver> <IB GID> <IB LID> <IB QP> [seconds]\n");
+        return EXIT_FAILURE;
+    }
+
+    union ibv_gid gid;
+    inet_pton(AF_INET6, argv[1], &gid);
+    int lid = atoi(argv[2]);
+    int qpn = atoi(argv[3]);
+    double seconds = argc == 5 ? atof(argv[4]) : 2.0;
+
+    printf("%10s %14s %14s %12s\n", "interval", "packets/s", "CQEs/s", "CQEs/packet");
+
+    for (size_t i = 0; i < sizeof intervals / sizeof *intervals; i++) {
+        struct rdma_options options = { .signal_interval = intervals[i] };
+        struct rdma_endpoint *endpoint =
+            rdma_init_client(argv[0], queue_size, lid, gid, qpn, &options);
+        if (!endpoint) return EXIT_FAILURE;
+
+        uint64_t start = bench_now_ns();
+        int64_t packets = send_flood(endpoint, queue_size, seconds);
+        double elapsed = (bench_now_ns() - start) / 1e9;
+
+        struct rdma_poll_stats stats;
+        rdma_get_poll_stats(endpoint, &stats);
+        rdma_cleanup(endpoint);
+        if (packets < 0) return EXIT_FAILURE;
+
+        printf("%10d %14.0f %14.0f %12.3f\n", intervals[i], packets / elapsed,
+               stats.completions / elapsed,
+               packets ? stats.completions / (double) packets : 0.0);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Stream messages to an rdma_server of the same transport as fast as the send
+// queue allows and report the message rate and throughput. UD sends
+// datagrams to the queue pair at <IB GID> <IB LID> <IB QP>, RC and UC write
+// into the receive ring of the server accepting on <host> <port>, so the
+// transports can be compared at the same message size.
+static int
+bench_stream(int argc, char *argv[])
+{
+    const int queue_size = 256;
+    int transport = argc >= 2 ? rdma_parse_transport(argv[1]) : -1;
+    int targets = transport == RDMA_TRANSPORT_UD ? 3 : 2;
+
+    if (transport < 0 || argc < 2 + targets || argc > 4 + targets) {
+        fprintf(stderr, "Usage: rdma_bench stream <IB driver> ud <IB GID> <IB LID> <IB QP> "
+                "[seconds] [message size]\n"
+                "       rdma_bench stream <IB driver> <rc|uc> <server host> <port> "
+                "[seconds] [message size]\n");
+        return EXIT_FAILURE;
+    }
+
+    double seconds = argc > 2 + targets ? atof(argv[2 + targets]) : 2.0;
+    struct rdma_options options = {
+        .transport = transport,
+        .signal_interval = 16,
+        .message_size = argc > 3 + targets ? rdma_parse_size(argv[3 + targets]) : 0,
+    };
+
+    struct rdma_endpoint *endpoint;
+    if (transport == RDMA_TRANSPORT_UD) {
+        union ibv_gid gid;
+        inet_pton(AF_INET6, argv[2], &gid);
+        endpoint = rdma_init_client(argv[0], queue_size, atoi(argv[3]), gid, atoi(argv[4]),
+                                    &options);
+    } else {
+        endpoint = rdma_connect(argv[0], queue_size, argv[2], argv[3], &options);
+    }
+    if (!endpoint) return EXIT_FAILURE;
+
+    size_t message_size = rdma_message_size(endpoint);
+    uint64_t start = bench_now_ns();
+    int64_t messages = send_flood(endpoint, queue_size, seconds);
+    double elapsed = (bench_now_ns() - start) / 1e9;
+    rdma_cleanup(endpoint);
+    if (messages < 0) return EXIT_FAILURE;
+
+    printf("%10s %12s %14s %12s\n", "transport", "message", "messages/s", "Gbit/s");
+    printf("%10s %12zu %14.0f %12.3f\n", argv[1], message_size, messages / elapsed,
+           messages * message_size * 8 / elapsed / 1e9);
+
+    return EXIT_SUCCESS;
+}
+
+// Producer of the pipeline benchmark, fills every slot it acquires
+struct bench_producer {
+    pthread_t thread;
+    struct send_pipeline *pipeline;
+    size_t message_size;
+    atomic_bool *running;
+};
+
+static void *
+bench_produce(void *arg)
+{
+    struct bench_producer *producer = arg;
+    int index = 0;
+
+    while (atomic_load_explicit(producer->running, memory_order_relaxed)) {
+        int slot = send_pipeline_acquire(producer->pipeline);
+        if (slot < 0) continue;
+
+        memset(send_pipeline_buffer(producer->pipeline, slot), index++, producer->message_size);
+        send_pipeline_commit(producer->pipeline, slot);
+    }
+
+    return NULL;
+}
+
+// Send datagrams through a send pipeline with 1 up to 'max producers'
+// producer threads filling every message, and report the message rate,
+// throughput, and how many messages the transport thread posted per chain.
+static int
+bench_pipeline(int argc, char *argv[])
+{
+    const int queue_size = 256;
+
+    if (argc < 4 || argc > 6) {
+        fprintf(stderr, "Usage: rdma_bench pipeline <IB driver> <IB GID> <IB LID> <IB QP> "
+                "[max producers] [seconds]\n");
+        return EXIT_FAILURE;
+    }
+
+    union ibv_gid gid;
+    inet_pton(AF_INET6, argv[1], &gid);
+    int lid = atoi(argv[2]);
+    int qpn = atoi(argv[3]);
+    int max_producers = argc > 4 ? atoi(argv[4]) : 4;
+    double seconds = argc > 5 ? atof(argv[5]) : 2.0;
+
+    printf("%10s %14s %12s %16s\n", "producers", "messages/s", "Gbit/s", "messages/chain");
+
+    for (int producers = 1; producers <= max_producers; producers *= 2) {
+        struct rdma_options options = { .signal_interval = 16 };
+        struct rdma_endpoint *endpoint =
+            rdma_init_client(argv[0], queue_size, lid, gid, qpn, &options);
+        if (!endpoint) return EXIT_FAILURE;
+
+        struct send_pipeline *pipeline = send_pipeline_start(endpoint, -1, NULL);
+        if (!pipeline) {
+            rdma_cleanup(endpoint);
+            return EXIT_FAILURE;
+        }
+
+        struct bench_producer threads[producers];
+        atomic_bool running = true;
+        int started = 0;
+        uint64_t start = bench_now_ns();
+        for (; started < producers; started++) {
+            threads[started] = (struct bench_producer) {
+                .pipeline = pipeline,
+                .message_size = rdma_message_size(endpoint),
+                .running = &running,
+            };
+            if (pthread_create(&threads[started].thread, NULL, bench_produce, &threads[started])) {
+                break;
+            }
+        }
+
+        struct timespec duration = { seconds, (seconds - (long) seconds) * 1e9 };
+        if (started == producers) nanosleep(&duration, NULL);
+        atomic_store(&running, false);
+        for (int i = 0; i < started; i++) pthread_join(threads[i].thread, NULL);
+        double elapsed = (bench_now_ns() - start) / 1e9;
+
+        struct send_pipeline_stats stats;
+        send_pipeline_get_stats(pipeline, &stats);
+        int failed = send_pipeline_stop(pipeline) || started < producers;
+        size_t message_size = rdma_message_size(endpoint);
+        rdma_cleanup(endpoint);
+        if (failed) return EXIT_FAILURE;
+
+        printf("%10d %14.0f %12.3f %16.1f\n", producers, stats.messages / elapsed,
+               stats.messages * message_size * 8 / elapsed / 1e9,
+               stats.chains ? stats.messages / (double) stats.chains : 0.0);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Sender of the contention benchmark, one of many sharing an endpoint
+struct bench_sender {
+    pthread_t thread;
+    struct rdma_endpoint *endpoint;
+    pthread_mutex_t *lock;
+    atomic_bool *running;
+    int batch;
+    int failed;
+};
+
+// Send through the concurrent send path, reserving 'batch' tickets at a time
+static void *
+bench_send_combining(void *arg)
+{
+    struct bench_sender *sender = arg;
+    struct rdma_endpoint *endpoint = sender->endpoint;
+
+    while (atomic_load_explicit(sender->running, memory_order_relaxed)) {
+        int64_t ticket = rdma_send_reserve(endpoint, sender->batch);
+        if (ticket == -1) continue;
+        if (ticket < 0) goto fail;
+
+        for (int i = 0; i < sender->batch; i++) {
+            rdma_send_ticket_buffer(endpoint, ticket + i)[0] = (char) (ticket + i);
+        }
+        if (rdma_send_commit(endpoint, ticket, sender->batch)) goto fail;
+    }
+
+    return NULL;
+
+  fail:
+    sender->failed = 1;
+    return NULL;
+}
+
+// Send through the single-threaded send path, serialised by a mutex
+static void *
+bench_send_locked(void *arg)
+{
+    struct bench_sender *sender = arg;
+    struct rdma_endpoint *endpoint = sender->endpoint;
+    struct send_buffer *buffers = rdma_send_buffers(endpoint);
+    int slots[sender->batch];
+
+    while (atomic_load_explicit(sender->running, memory_order_relaxed)) {
+        int num_slots = 0;
+        pthread_mutex_lock(sender->lock);
+        while (num_slots < sender->batch && (slots[num_slots] = rdma_send_acquire(endpoint)) >= 0) {
+            num_slots++;
+        }
+        int completed = num_slots ? 0 : rdma_reap_sends(endpoint);
+        pthread_mutex_unlock(sender->lock);
+        if (completed < 0) goto fail;
+
+        for (int i = 0; i < num_slots; i++) buffers[slots[i]].data_buffer[0] = (char) slots[i];
+
+        pthread_mutex_lock(sender->lock);
+        int result = rdma_post_send_slots(endpoint, slots, num_slots);
+        if (!result) result = rdma_reap_sends(endpoint) < 0;
+        pthread_mutex_unlock(sender->lock);
+        if (result) goto fail;
+    }
+
+    return NULL;
+
+  fail:
+    sender->failed = 1;
+    return NULL;
+}
+
+// Share one endpoint between 1 up to 32 sending threads, serialised by a
+// mutex, and through the concurrent send path where threads reserve tickets
+// with atomics and one of them combines the commits of all into a chain.
+// Reports the message rate and the messages posted per chain of each.
+static int
+bench_contention(int argc, char *argv[])
+{
+    const int queue_size = 256;
+    const int max_threads = 32;
+
+    if (argc < 4 || argc > 6) {
+        fprintf(stderr, "Usage: rdma_bench contention <IB driver> <IB GID> <IB LID> <IB QP> "
+                "[seconds] [batch]\n");
+        return EXIT_FAILURE;
+    }
+
+    union ibv_gid gid;
+    inet_pton(AF_INET6, argv[1], &gid);
+    int lid = atoi(argv[2]);
+    int qpn = atoi(argv[3]);
+    double seconds = argc > 4 ? atof(argv[4]) : 1.0;
+    int batch = argc > 5 ? atoi(argv[5]) : 1;
+
+    if (batch < 1 || batch > queue_size) {
+        fprintf(stderr, "Batch has to be between 1 and %d\n", queue_size);
+        return EXIT_FAILURE;
+    }
+
+    printf("%10s %10s %14s %16s\n", "threads", "mode", "messages/s", "messages/chain");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        for (int combining = 0; combining < 2; combining++) {
+            struct rdma_options options = {
+                .signal_interval = 16,
+                .concurrent_send = combining,
+            };
+            struct rdma_endpoint *endpoint =
+                rdma_init_client(argv[0], queue_size, lid, gid, qpn, &options);
+            if (!endpoint) return EXIT_FAILURE;
+
+            pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+            atomic_bool running = true;
+            struct bench_sender senders[threads];
+            int started = 0;
+            int failed = 0;
+
+            uint64_t start = bench_now_ns();
+            for (; started < threads; started++) {
+                senders[started] = (struct bench_sender) {
+                    .endpoint = endpoint,
+                    .lock = &lock,
+                    .running = &running,
+                    .batch = batch,
+                };
+                if (pthread_create(&senders[started].thread, NULL,
+                                   combining ? bench_send_combining : bench_send_locked,
+                                   &senders[started])) {
+                    failed = 1;
+                    break;
+                }
+            }
+
+            struct timespec duration = { seconds, (seconds - (long) seconds) * 1e9 };
+            if (!failed) nanosleep(&duration, NULL);
+            atomic_store(&running, false);
+            for (int i = 0; i < started; i++) {
+                pthread_join(senders[i].thread, NULL);
+                failed |= senders[i].failed;
+            }
+            double elapsed = (bench_now_ns() - start) / 1e9;
+
+            struct rdma_send_stats stats;
+            rdma_get_send_stats(endpoint, &stats);
+            rdma_cleanup(endpoint);
+            if (failed) return EXIT_FAILURE;
+
+            printf("%10d %10s %14.0f %16.1f\n", threads, combining ? "combining" : "mutex",
+                   stats.messages / elapsed,
+                   stats.chains ? stats.messages / (double) stats.chains : 0.0);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Send messages of a 16 byte header and a payload from an application array,
+// once copying both into the send slots and once gathering the payload in
+// place, split over 'segments' SGEs, through the registration cache. Reports
+// the message rate and the cache hits and misses of the gather sends.
+static int
+bench_gather(int argc, char *argv[])
+{
+    const int queue_size = 256;
+    const size_t header_length = 16;
+    const size_t array_size = 64UL << 20;
+
+    if (argc < 4 || argc > 6) {
+        fprintf(stderr, "Usage: rdma_bench gather <IB driver> <IB GID> <IB LID> <IB QP> "
+                "[seconds] [segments]\n");
+        return EXIT_FAILURE;
+    }
+
+    union ibv_gid gid;
+    inet_pton(AF_INET6, argv[1], &gid);
+    int lid = atoi(argv[2]);
+    int qpn = atoi(argv[3]);
+    double seconds = argc > 4 ? atof(argv[4]) : 2.0;
+    int segments = argc > 5 ? atoi(argv[5]) : 1;
+
+    if (segments < 1) {
+        fprintf(stderr, "Need at least one segment\n");
+        return EXIT_FAILURE;
+    }
+
+    char *array = malloc(array_size);
+    if (!array) {
+        fprintf(stderr, "Couldn't allocate application array\n");
+        return EXIT_FAILURE;
+    }
+    memset(array, 1, array_size);
+
+    printf("%10s %14s %12s %10s %10s\n", "mode", "messages/s", "Gbit/s", "hits", "misses");
+
+    int result = EXIT_SUCCESS;
+    for (int gather = 0; gather < 2 && result == EXIT_SUCCESS; gather++) {
+        struct rdma_options options = {
+            .signal_interval = 16,
+            .gather_segments = gather ? segments : 0,
+        };
+        struct rdma_endpoint *endpoint =
+            rdma_init_client(argv[0], queue_size, lid, gid, qpn, &options);
+        if (!endpoint) {
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        // Registering the whole array costs the one miss
+        if (gather && rdma_send_register(endpoint, array, array_size)) {
+            rdma_cleanup(endpoint);
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        struct send_buffer *buffers = rdma_send_buffers(endpoint);
+        size_t payload = rdma_message_size(endpoint) - header_length;
+        size_t segment = (payload + segments - 1) / segments;
+        size_t messages_per_array = array_size / payload;
+        char header[16] = { 0 };
+        uint64_t messages = 0;
+        uint64_t start = bench_now_ns();
+        uint64_t end = start + seconds * 1e9;
+
+        while (result == EXIT_SUCCESS && bench_now_ns() < end) {
+            const char *data = &array[(messages % messages_per_array) * payload];
+            memcpy(header, &messages, sizeof messages);
+
+            int sent;
+            if (gather) {
+                struct iovec iov[segments];
+                int num_segments = 0;
+                for (size_t offset = 0; offset < payload; offset += segment) {
+                    iov[num_segments].iov_base = (void *) &data[offset];
+                    iov[num_segments++].iov_len = offset + segment < payload ? segment : payload - offset;
+                }
+                sent = rdma_send_gather(endpoint, header, header_length, iov, num_segments);
+            } else {
+                int slot = rdma_send_acquire(endpoint);
+                sent = slot < 0;
+                if (!sent) {
+                    memcpy(buffers[slot].data_buffer, header, header_length);
+                    memcpy(buffers[slot].data_buffer + header_length, data, payload);
+                    sent = rdma_post_send_slots(endpoint, &slot, 1);
+                }
+            }
+
+            if (sent < 0 || rdma_reap_sends(endpoint) < 0) result = EXIT_FAILURE;
+            if (!sent) messages++;
+        }
+        double elapsed = (bench_now_ns() - start) / 1e9;
+
+        struct mr_cache_stats stats;
+        rdma_get_mr_cache_stats(endpoint, &stats);
+        size_t message_size = rdma_message_size(endpoint);
+        rdma_cleanup(endpoint);
+
+        printf("%10s %14.0f %12.3f %10lu %10lu\n", gather ? "gather" : "copy",
+               messages / elapsed, messages * message_size * 8 / elapsed / 1e9,
+               stats.hits, stats.misses);
+    }
+
+    free(array);
+    return result;
+}
+
+// Accepting side of the latency benchmark over a connected transport
+struct bench_acceptor {
+    pthread_t thread;
+    struct rdma_endpoint *endpoint;
+    const char *port;
+    int result;
+};
+
+static void *
+bench_accept(void *arg)
+{
+    struct bench_acceptor *acceptor = arg;
+    acceptor->result = rdma_accept(acceptor->endpoint, acceptor->port);
+    return NULL;
+}
+
+// Send one message of 'length' bytes and wait until the server receives it.
+// Returns the nanoseconds from posting to the receive completion, or 0 on
+// failure.
+static uint64_t
+send_one(struct rdma_endpoint *client, struct rdma_endpoint *server, size_t length)
+{
+    int slot;
+    while ((slot = rdma_send_acquire(client)) < 0) {
+        if (rdma_reap_sends(client) < 0) return 0;
+    }
+    if (rdma_send_set_length(client, slot, length)) return 0;
+
+    struct rdma_lease lease;
+    uint64_t start = bench_now_ns();
+    if (rdma_post_send_slots(client, &slot, 1)) return 0;
+
+    int received;
+    while (!(received = rdma_recv_lease(server, &lease, 1, 0)));
+    uint64_t latency = bench_now_ns() - start;
+    if (received < 0) return 0;
+
+    rdma_lease_release(server, &lease);
+    return rdma_reap_sends(client) < 0 ? 0 : latency;
+}
+
+// Measure the one-way latency of 64 byte up to 8 KiB messages from a client
+// to a server endpoint on the same device, once sent inline below the inline
+// limit of the device and once always read by the NIC from the send slot.
+// UD loops datagrams, up to the MTU, back to the server's queue pair, RC
+// connects over TCP port 'port' on localhost. Reports the median and 99th
+// percentile latency per message size.
+static int
+bench_latency(int argc, char *argv[])
+{
+    const int queue_size = 64;
+    const size_t max_length = 8192;
+    const int warmup = 100;
+
+    int transport = argc > 1 ? rdma_parse_transport(argv[1]) : RDMA_TRANSPORT_UD;
+    if (argc < 1 || argc > 4 || transport < 0 || transport == RDMA_TRANSPORT_UC) {
+        fprintf(stderr, "Usage: rdma_bench latency <IB driver> [ud|rc] [iterations] [port]\n");
+        return EXIT_FAILURE;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+    const char *port = argc > 3 ? argv[3] : "18515";
+
+    printf("%10s %10s %12s %10s %10s\n", "bytes", "inline", "max inline", "p50 ns", "p99 ns");
+
+    for (int inlined = 1; inlined >= 0; inlined--) {
+        struct rdma_options options = {
+            .transport = transport,
+            .signal_interval = 1,
+            .message_size = transport == RDMA_TRANSPORT_UD ? 0 : max_length,
+            .disable_inline = !inlined,
+        };
+        struct rdma_endpoint *server = rdma_init_server(argv[0], queue_size, &options);
+        if (!server) return EXIT_FAILURE;
+
+        struct rdma_endpoint *client = NULL;
+        if (transport == RDMA_TRANSPORT_UD) {
+            int lid;
+            union ibv_gid gid;
+            if (!rdma_local_address(server, &lid, &gid) && !post_recvs(server, 0, queue_size)) {
+                client = rdma_init_client(argv[0], queue_size, lid, gid,
+                                          rdma_queue_pair_number(server), &options);
+            }
+        } else {
+            struct bench_acceptor acceptor = { .endpoint = server, .port = port };
+            if (!pthread_create(&acceptor.thread, NULL, bench_accept, &acceptor)) {
+                // The acceptor may not be listening yet
+                for (int attempt = 0; !client && attempt < 50; attempt++) {
+                    client = rdma_connect(argv[0], queue_size, "localhost", port, &options);
+                    if (!client) nanosleep(&(struct timespec) { 0, 100000000 }, NULL);
+                }
+                pthread_join(acceptor.thread, NULL);
+                if (acceptor.result && client) {
+                    rdma_cleanup(client);
+                    client = NULL;
+                }
+            }
+        }
+        if (!client) {
+            rdma_cleanup(server);
+            return EXIT_FAILURE;
+        }
+
+        int result = EXIT_SUCCESS;
+        size_t message_size = rdma_message_size(client);
+        for (size_t length = 64; length <= max_length && length <= message_size; length *= 2) {
+            struct latency_histogram histogram;
+            latency_histogram_reset(&histogram);
+
+            for (int i = -warmup; i < iterations; i++) {
+                uint64_t latency = send_one(client, server, length);
+                if (!latency) {
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                if (i >= 0) latency_histogram_record(&histogram, latency);
+            }
+            if (result != EXIT_SUCCESS) break;
+
+            printf("%10zu %10s %12u %10lu %10lu\n", length,
+                   length <= rdma_max_inline(client) ? "yes" : "no",
+                   rdma_max_inline(client),
+                   latency_histogram_percentile(&histogram, 50),
+                   latency_histogram_percentile(&histogram, 99));
+        }
+
+        rdma_cleanup(client);
+        rdma_cleanup(server);
+        if (result != EXIT_SUCCESS) return result;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+} benchmarks[] = {
+    { "pages", bench_pages },
+    { "pps", bench_pps },
+    { "odp", bench_odp },
+    { "init", bench_init },
+    { "stream", bench_stream },
+    { "pipeline", bench_pipeline },
+    { "contention", bench_contention },
+    { "gather", bench_gather },
+    { "latency", bench_latency },
+};
+
+int main(int argc, char *argv[])
+{
+    const size_t num_benchmarks = sizeof benchmarks / sizeof *benchmarks;
+
+    for (size_t i = 0; argc > 1 && i < num_benchmarks; i++) {
+        if (!strcmp(argv[1], benchmarks[i].name)) {
+            return benchmarks[i].run(argc - 2, argv + 2);
+        }
+    }
+
+    fprintf(stderr, "Usage: rdma_bench <benchmark> [arguments]\nBenchmarks:\n");
+    for (size_t i = 0; i < num_benchmarks; i++) {
+        fprintf(stderr, "  %s\n", benchmarks[i].name);
+    }
+    return EXIT_FAILURE;
+}
@@ -30,16 +30,26 @@
  *
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "pacer.h"
 #include "rdma.h"
+#include "record.h"
+#include "sar.h"
+#include "send_pipeline.h"
 
-static int client_loop = 1;
+#define MAX_PRODUCERS 64
+
+static volatile sig_atomic_t client_loop = 1;
 
 void stop_loop(int sig)
 {
@@ -47,24 +57,179 @@ void stop_loop(int sig)
     client_loop = 0;
 }
 
+// Producer thread, fills every slot it acquires with its message index and
+// commits it, the transport thread of the pipeline does the posting. With a
+// coalescer it emits records of 'record_size' bytes instead, packed into
+// datagrams. With a frame size it sends frames of that size, segmented over
+// as many datagrams as they need.
+struct producer {
+    pthread_t thread;
+    struct send_pipeline *pipeline;
+    size_t message_size;
+    struct record_coalescer *coalescer;
+    size_t record_size;
+    char *frame;
+    size_t frame_size;
+    atomic_uint_fast64_t *frames;
+    // Producer k of n fills messages k, k + n, k + 2n, ...
+    int first;
+    int step;
+};
+
+static void *
+produce(void *arg)
+{
+    struct producer *producer = arg;
+    int index = producer->first;
+
+    while (client_loop && producer->frame) {
+        memset(producer->frame, index, producer->frame_size);
+        size_t offset = 0;
+        int sent = 0;
+        while (client_loop && !sent) {
+            sent = sar_send(producer->pipeline, producer->message_size, index,
+                            producer->frame, producer->frame_size, &offset);
+            if (sent < 0) {
+                client_loop = 0;
+                return NULL;
+            }
+        }
+        if (sent) atomic_fetch_add_explicit(producer->frames, 1, memory_order_relaxed);
+        index += producer->step;
+    }
+
+    while (client_loop && producer->coalescer) {
+        char *record = record_reserve(producer->coalescer, producer->record_size);
+        if (record) {
+            memset(record, index, producer->record_size);
+            index += producer->step;
+        }
+        record_coalescer_poll(producer->coalescer);
+    }
+
+    while (client_loop) {
+        int slot = send_pipeline_acquire(producer->pipeline);
+        if (slot < 0) continue;
+
+        memset(send_pipeline_buffer(producer->pipeline, slot), index, producer->message_size);
+        send_pipeline_commit(producer->pipeline, slot);
+        index += producer->step;
+    }
+
+    return NULL;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int main(int argc, char *argv[])
 {
-    const int completion_queue_size = 20;
-    struct send_buffer *buffers = NULL;
+    const int completion_queue_size = 256;
+    struct rdma_endpoint *endpoint = NULL;
+    struct send_pipeline *pipeline = NULL;
+    struct producer producers[MAX_PRODUCERS];
+    struct rdma_options options = { 0 };
+    int num_producers = 1;
+    int started = 0;
+    int transport_cpu = -1;
+    size_t record_size = 0;
+    uint64_t deadline_usec = 100;
+    size_t frame_size = 0;
+    atomic_uint_fast64_t frames = 0;
+    double gbps = 0;
+    int pattern = PACER_CONSTANT;
+    int burst = 16;
+    struct pacer pacer;
 
     int qpn;
     int lid;
     union ibv_gid gid;
     int result = EXIT_SUCCESS;
+    int transport, opt;
 
-    if (argc != 5) {
-        fprintf(stderr, "Usage: rdma_client <IB driver> <IB GID> <IB LID> <IB QP>\n");
-        return EXIT_FAILURE;
+    while ((opt = getopt(argc, argv, "S:m:A:C:It:c:r:d:F:R:P:B:")) != -1) {
+        switch (opt) {
+          case 'S':
+            options.signal_interval = atoi(optarg);
+            break;
+          case 'm':
+            options.message_size = rdma_parse_size(optarg);
+            break;
+          case 'A':
+            options.stride_alignment = rdma_parse_size(optarg);
+            break;
+          case 'I':
+            options.send_sequence = true;
+            break;
+          case 'C':
+            transport = rdma_parse_transport(optarg);
+            if (transport < 0) argc = 0;
+            else options.transport = transport;
+            break;
+          case 't':
+            num_producers = atoi(optarg);
+            if (num_producers < 1 || num_producers > MAX_PRODUCERS) argc = 0;
+            break;
+          case 'c':
+            transport_cpu = atoi(optarg);
+            break;
+          case 'r':
+            record_size = rdma_parse_size(optarg);
+            if (!record_size) argc = 0;
+            break;
+          case 'd':
+            deadline_usec = atol(optarg);
+            break;
+          case 'F':
+            frame_size = rdma_parse_size(optarg);
+            if (!frame_size || frame_size > UINT32_MAX) argc = 0;
+            break;
+          case 'R':
+            gbps = atof(optarg);
+            if (gbps <= 0) argc = 0;
+            break;
+          case 'P':
+            pattern = pacer_parse_pattern(optarg);
+            if (pattern < 0) argc = 0;
+            break;
+          case 'B':
+            burst = atoi(optarg);
+            if (burst < 1) argc = 0;
+            break;
+          default:
+            argc = 0;
+            break;
+        }
     }
 
-    lid = atoi(argv[3]);
-    qpn = atoi(argv[4]);
-    inet_pton(AF_INET6, argv[2], &gid);
+    // Connected transports find the server through a TCP connection
+    bool connected = options.transport != RDMA_TRANSPORT_UD;
+    if (argc - optind != (connected ? 3 : 4) || (record_size && frame_size)) {
+        fprintf(stderr, "Usage: rdma_client [options] <IB driver> <IB GID> <IB LID> <IB QP>\n"
+                "       rdma_client -C <rc|uc> [options] <IB driver> <server host> <port>\n"
+                "  -S <N>        only signal every Nth Send Request\n"
+                "  -m <bytes>    message size, at most the port MTU for UD (default: MTU)\n"
+                "  -A <bytes>    pad buffer slots to a multiple of this (default: 64)\n"
+                "  -C <ud|rc|uc> transport, RC/UC write into the server's buffers\n"
+                "  -I            send sequence numbers as immediate data (UD)\n"
+                "  -t <threads>  producer threads filling messages (default: 1)\n"
+                "  -c <CPU>      CPU to pin the transport thread to\n"
+                "  -r <bytes>    send records this long, packed into datagrams\n"
+                "  -d <usec>     send a partly filled datagram of records after this\n"
+                "                long (default: 100)\n"
+                "  -F <bytes>    send frames this long, segmented over datagrams\n"
+                "  -R <Gbit/s>   pace the messages to this rate, counting full messages\n"
+                "  -P <constant|bursty|poisson>\n"
+                "                arrival pattern of the paced messages (default: constant)\n"
+                "  -B <messages> burst size of the pacer (default: 16)\n");
+        return EXIT_FAILURE;
+    }
+    argv += optind - 1;
 
     struct sigaction handler;
     memset(&handler, 0, sizeof handler);
@@ -75,62 +240,137 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // The NIC can only pace at a constant rate
+    if (gbps && pattern == PACER_CONSTANT) options.rate_limit_kbps = gbps * 1e6;
+
     // ibverbs initialisation and allocate a circular buffer to write from
-    buffers = rdma_init_client(argv[1], completion_queue_size, lid, gid, qpn);
+    if (connected) {
+        endpoint = rdma_connect(argv[1], completion_queue_size, argv[2], argv[3], &options);
+    } else {
+        lid = atoi(argv[3]);
+        qpn = atoi(argv[4]);
+        inet_pton(AF_INET6, argv[2], &gid);
+        endpoint = rdma_init_client(argv[1], completion_queue_size, lid, gid, qpn, &options);
+    }
+    if (!endpoint) return EXIT_FAILURE;
+
+    size_t message_size = rdma_message_size(endpoint);
 
-    // initialise the memory in each send buffer
-    int count = 0;
-    for (int i = 0; i < completion_queue_size; i++) {
-        memset(buffers[i].data_buffer, count++, MSG_SIZE);
+    // Records have to fit a datagram, behind their header
+    if (record_size && record_size + sizeof (struct record_header) > message_size) {
+        fprintf(stderr, "Records of %zu bytes and their %zu byte header don't fit "
+                "messages of %zu bytes, use a smaller -r or a larger -m\n",
+                record_size, sizeof (struct record_header), message_size);
+        result = EXIT_FAILURE;
+        goto cleanup;
     }
 
-    // Fill completion queue with Send Requests for each buffer
-    if (post_sends(0, completion_queue_size)) {
-        fprintf(stderr, "Couldn't post sends\n");
+    // Every segment of a frame carries a header
+    if (frame_size && message_size <= sizeof (struct sar_header)) {
+        fprintf(stderr, "Messages of %zu bytes can't hold a frame segment, use a larger -m\n",
+                message_size);
         result = EXIT_FAILURE;
         goto cleanup;
     }
 
-    struct ibv_wc wc[10];
-    while (client_loop) {
-        // Poll for completed Send Requests
-        int ne = ibv_poll_cq(completion_queue, 10, wc);
-        if (ne < 0) {
-            fprintf(stderr, "poll CQ failed %d\n", ne);
+    // Without the NIC pacing, the transport thread posts as the pacer allows
+    bool paced = gbps && !rdma_rate_limited(endpoint);
+    if (paced) pacer_init(&pacer, gbps * 1e9 / 8 / message_size, pattern, burst);
+    fprintf(stderr, "Pacing: %s\n", !gbps ? "none" : paced ? "software" : "NIC");
+
+    // The transport thread posts and reaps, the producers only fill slots
+    pipeline = send_pipeline_start(endpoint, transport_cpu, paced ? &pacer : NULL);
+    if (!pipeline) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    for (; started < num_producers; started++) {
+        producers[started] = (struct producer) {
+            .pipeline = pipeline,
+            .message_size = message_size,
+            .record_size = record_size,
+            .frame_size = frame_size,
+            .frames = &frames,
+            .first = started,
+            .step = num_producers,
+        };
+        if (frame_size && !(producers[started].frame = malloc(frame_size))) {
+            fprintf(stderr, "Couldn't allocate frame buffer\n");
+            client_loop = 0;
             result = EXIT_FAILURE;
-            goto cleanup;
-        } else {
-            fprintf(stderr, "sent %d messages\n", ne);
+            break;
         }
-
-        // Check the result status for each completed Send Request
-        for (int i = 0; i < ne; ++i) {
-            if (wc[i].status != IBV_WC_SUCCESS) {
-                fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                        ibv_wc_status_str(wc[i].status),
-                        wc[i].status, (int) wc[i].wr_id);
+        if (record_size) {
+            producers[started].coalescer =
+                record_coalescer_create(pipeline, message_size, deadline_usec * 1000);
+            if (!producers[started].coalescer) {
+                free(producers[started].frame);
+                client_loop = 0;
                 result = EXIT_FAILURE;
-                goto cleanup;
+                break;
             }
-
-            // Change buffer contents
-            memset(buffers[wc[i].wr_id].data_buffer, count++, MSG_SIZE);
         }
+        if (pthread_create(&producers[started].thread, NULL, produce, &producers[started])) {
+            fprintf(stderr, "Couldn't start producer thread %d\n", started);
+            record_coalescer_destroy(producers[started].coalescer);
+            free(producers[started].frame);
+            client_loop = 0;
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
 
-        // If there were completed requests, requeue the Send Requests.
-        if (ne > 0) {
-            if (post_sends(wc[0].wr_id, ne)) {
-                fprintf(stderr, "Couldn't post sends\n");
-                result = EXIT_FAILURE;
-                goto cleanup;
+    struct send_pipeline_stats last = { 0 };
+    uint64_t last_records = 0;
+    uint64_t last_frames = 0;
+    uint64_t last_ns = monotonic_ns();
+    while (client_loop) {
+        sleep(1);
+
+        struct send_pipeline_stats stats;
+        send_pipeline_get_stats(pipeline, &stats);
+        uint64_t now = monotonic_ns();
+        double seconds = (now - last_ns) / 1e9;
+        uint64_t messages = stats.messages - last.messages;
+        uint64_t chains = stats.chains - last.chains;
+
+        if (frame_size) {
+            uint64_t sent = atomic_load_explicit(&frames, memory_order_relaxed);
+            fprintf(stderr, "sent %.0f frames/s in %.0f packets/s, %.3f Gbit/s\n",
+                    (sent - last_frames) / seconds, messages / seconds,
+                    (sent - last_frames) * frame_size * 8 / seconds / 1e9);
+            last_frames = sent;
+        } else if (record_size) {
+            uint64_t records = 0;
+            for (int i = 0; i < started; i++) {
+                struct record_stats record_stats;
+                record_coalescer_get_stats(producers[i].coalescer, &record_stats);
+                records += record_stats.records;
             }
+            fprintf(stderr, "sent %.0f records/s in %.0f packets/s, %.1f records per packet\n",
+                    (records - last_records) / seconds, messages / seconds,
+                    messages ? (records - last_records) / (double) messages : 0.0);
+            last_records = records;
+        } else {
+            fprintf(stderr, "sent %lu messages, %.3f Gbit/s, %.1f messages per chain\n",
+                    messages, messages * message_size * 8 / seconds / 1e9,
+                    chains ? messages / (double) chains : 0.0);
         }
-        sleep(1);
+        last = stats;
+        last_ns = now;
+    }
+
+    // Send the records still waiting in partly filled datagrams
+    for (int i = 0; i < started; i++) {
+        pthread_join(producers[i].thread, NULL);
+        record_coalescer_destroy(producers[i].coalescer);
+        free(producers[i].frame);
     }
+    if (send_pipeline_stop(pipeline)) result = EXIT_FAILURE;
 
   cleanup:
-    free(buffers);
-    rdma_cleanup();
+    rdma_cleanup(endpoint);
 
     return result;
 }
@@ -29,16 +29,30 @@
  * SOFTWARE.
  *
  */
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "perf_counter.h"
 #include "rdma.h"
+#include "record.h"
+#include "sar.h"
 
-static int server_loop = 1;
+#define MAX_CPUS 1024
+#define MAX_SEGMENTS 32
+// Leases ahead of the one being processed whose payload is prefetched
+#define PREFETCH_DISTANCE 2
+// Frames reassembled at once, and how long an incomplete one is kept
+#define FRAME_CONTEXTS 8
+#define FRAME_TIMEOUT_NS 10000000
+
+static volatile sig_atomic_t server_loop = 1;
 
 void stop_loop(int sig)
 {
@@ -46,20 +60,460 @@ void stop_loop(int sig)
     server_loop = 0;
 }
 
+// Per-thread state, each receive thread drains its own endpoint.
+struct receive_thread {
+    pthread_t thread;
+    int cpu;
+    int completion_queue_size;
+    struct rdma_endpoint *endpoint;
+    // Set when the receive buffers were already posted by a server group
+    bool prefilled;
+    // Set when the endpoint places datagrams in blocks by sequence number
+    bool blocks;
+    // Set when datagrams carry records coalesced by the client
+    bool records;
+    // Largest frame segmented by the client, 0 if frames aren't segmented
+    size_t frame_size;
+    uint64_t frames;
+    int result;
+    // Successfully received datagrams and payload bytes, and the time of the
+    // first and last completion in nanoseconds
+    uint64_t datagrams;
+    uint64_t bytes;
+    uint64_t num_records;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    // Last-level cache misses of the receive loop, -1 without a counter
+    int llc_misses;
+};
+
+// Parse a Linux CPU list (e.g., "0-3,8,10-11") into at most 'max' CPU
+// numbers. Returns the number of CPUs, or -1 if the list is malformed.
+static int
+parse_cpu_list(const char *list, int *cpus, int max)
+{
+    int count = 0;
+
+    while (*list && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) return -1;
+
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) return -1;
+        }
+
+        for (long cpu = first; cpu <= last && count < max; cpu++) {
+            cpus[count++] = cpu;
+        }
+
+        list = end;
+        if (*list == ',') list++;
+    }
+
+    return count;
+}
+
+// Parse a comma separated list of at most 'max' segment sizes (e.g.,
+// "4K,4K"). Returns the number of segments, or -1 if the list is malformed.
+static int
+parse_layout(char *list, size_t *layout, int max)
+{
+    int count = 0;
+
+    for (char *size = strtok(list, ","); size; size = strtok(NULL, ",")) {
+        if (count == max || !(layout[count] = rdma_parse_size(size))) return -1;
+        count++;
+    }
+
+    return count;
+}
+
+// Read the CPUs of a NUMA node from sysfs, returns 0 if unknown.
+static int
+numa_node_cpus(int node, int *cpus, int max)
+{
+    char path[64], list[4096];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+
+    int count = fgets(list, sizeof list, file) ? parse_cpu_list(list, cpus, max) : 0;
+    fclose(file);
+
+    return count < 0 ? 0 : count;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Wait for the next block of a block placement endpoint, report how complete
+// it is, and hand it back. Returns -1 on failure.
+static int
+receive_block(struct receive_thread *state, uint32_t qpn)
+{
+    struct rdma_endpoint *endpoint = state->endpoint;
+    struct rdma_block block;
+
+    int ready = rdma_recv_block(endpoint, &block, 100);
+    if (ready <= 0) return ready;
+
+    // Not while cache misses are counted, see receive_loop()
+    if (state->llc_misses < 0) {
+        printf("QPN %u block at sequence %lu: %d of %d packets\n", qpn,
+               (unsigned long) block.sequence, block.received, block.packets);
+    }
+
+    state->last_ns = monotonic_ns();
+    if (!state->first_ns) state->first_ns = state->last_ns;
+    state->datagrams += block.received;
+    state->bytes += block.received * rdma_message_size(endpoint);
+
+    return rdma_block_release(endpoint, &block);
+}
+
+// Receive loop for a single endpoint. Runs on its own thread, pinned to the
+// CPU in the receive_thread struct.
+static void *
+receive_loop(void *arg)
+{
+    struct receive_thread *state = arg;
+    struct rdma_endpoint *endpoint = state->endpoint;
+    uint32_t qpn = rdma_queue_pair_number(endpoint);
+
+    state->result = EXIT_SUCCESS;
+    state->llc_misses = -1;
+    struct sar_reassembler *reassembler = NULL;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(state->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus)) {
+        fprintf(stderr, "Couldn't pin receive thread for QPN %u to CPU %d\n", qpn, state->cpu);
+    }
+
+    // Fill completion queue with Receive Requests for each buffer
+    if (!state->prefilled && post_recvs(endpoint, 0, state->completion_queue_size)) {
+        fprintf(stderr, "Couldn't post receives\n");
+        goto fail;
+    }
+
+    if (state->frame_size) {
+        reassembler = sar_reassembler_create(state->frame_size, FRAME_CONTEXTS, FRAME_TIMEOUT_NS);
+        if (!reassembler) goto fail;
+    }
+
+    // The prints per datagram and per batch would dominate the cache misses
+    // of the loop, so they are left out while the misses are counted
+    state->llc_misses = perf_counter_open_llc_misses();
+    bool verbose = state->llc_misses < 0;
+    uint64_t misses_start = perf_counter_read(state->llc_misses);
+
+    struct rdma_lease leases[32];
+    while (server_loop) {
+        if (state->blocks) {
+            if (receive_block(state, qpn) < 0) {
+                fprintf(stderr, "Receiving blocks failed\n");
+                goto fail;
+            }
+            continue;
+        }
+
+        // Poll for received datagrams. This busy polls while traffic flows
+        // and, once idle, waits for a completion event to avoid pinning the
+        // CPU at 100% utilisation. The timeout makes sure we notice the end
+        // of the server loop.
+        int ne = rdma_recv_lease(endpoint, leases, 32, 100);
+        if (ne < 0) {
+            fprintf(stderr, "Receiving datagrams failed\n");
+            goto fail;
+        } else if (reassembler) {
+            sar_expire(reassembler);
+        }
+        if (ne > 0) {
+            if (verbose) fprintf(stderr, "QPN %u received %d messages\n", qpn, ne);
+            state->last_ns = monotonic_ns();
+            if (!state->first_ns) state->first_ns = state->last_ns;
+        }
+
+        // Process the payloads in place and release the leases, the
+        // endpoint reposts the buffers in one batch once the receive queue
+        // drains to its low watermark. The payloads of the next leases are
+        // prefetched while the current one is processed.
+        for (int i = 0; i < PREFETCH_DISTANCE && i < ne; ++i) {
+            __builtin_prefetch(leases[i].data_buffer);
+        }
+        for (int i = 0; i < ne; ++i) {
+            if (i + PREFETCH_DISTANCE < ne) {
+                __builtin_prefetch(leases[i + PREFETCH_DISTANCE].data_buffer);
+            }
+            state->datagrams++;
+            state->bytes += leases[i].byte_len;
+
+            // The reassembler takes over the lease
+            if (reassembler) {
+                struct sar_message frame;
+                if (sar_receive(reassembler, endpoint, &leases[i], &frame)) {
+                    if (verbose) printf("Frame #%u: %zu bytes\n", frame.id, frame.length);
+                    state->frames++;
+                    sar_message_release(reassembler, endpoint, &frame);
+                }
+                continue;
+            }
+
+            if (state->records) {
+                // Walk the records in place
+                struct record_iterator records;
+                int count = 0;
+                uint32_t length;
+                record_iterator_init(&records, leases[i].data_buffer, leases[i].byte_len);
+                while (record_next(&records, &length)) count++;
+                state->num_records += count;
+                if (verbose) {
+                    printf("Message for slot #%d: %d records in %u bytes\n", leases[i].slot,
+                           count, leases[i].byte_len);
+                }
+            } else if (verbose) {
+                printf("Message for slot #%d: index #%d size: %u bytes\n", leases[i].slot,
+                       leases[i].data_buffer[0], leases[i].byte_len);
+            }
+
+            rdma_lease_release(endpoint, &leases[i]);
+        }
+    }
+
+    struct rdma_poll_stats stats;
+    rdma_get_poll_stats(endpoint, &stats);
+    fprintf(stderr, "QPN %u: %.3f s busy polling, %.3f s waiting for "
+            "events, %lu completions, %lu events, %lu switches to events\n",
+            qpn, stats.busy_poll_ns / 1e9, stats.interrupt_ns / 1e9,
+            stats.completions, stats.interrupts, stats.mode_switches);
+
+    // Throughput between the first and last completion, so the time spent
+    // waiting for the sender to start doesn't count.
+    struct rdma_alloc_stats alloc;
+    rdma_get_alloc_stats(endpoint, &alloc);
+    double seconds = (state->last_ns - state->first_ns) / 1e9;
+    fprintf(stderr, "QPN %u: %lu datagrams, %lu bytes, %.3f Gbit/s on %zu KiB %s pages\n",
+            qpn, state->datagrams, state->bytes,
+            seconds > 0 ? state->bytes * 8 / seconds / 1e9 : 0.0,
+            alloc.page_size >> 10, alloc.on_demand ? "on-demand" : "pinned");
+    if (state->records) {
+        fprintf(stderr, "QPN %u: %lu records, %.0f records/s, %.0f packets/s\n",
+                qpn, state->num_records,
+                seconds > 0 ? state->num_records / seconds : 0.0,
+                seconds > 0 ? state->datagrams / seconds : 0.0);
+    }
+    if (reassembler) {
+        struct sar_stats frames;
+        sar_get_stats(reassembler, &frames);
+        fprintf(stderr, "QPN %u: %lu frames, %.0f frames/s, %lu in place, %lu bytes copied, "
+                "%lu timed out, %lu evicted, %lu segments of partial frames, "
+                "%lu segments dropped\n", qpn, frames.messages,
+                seconds > 0 ? frames.messages / seconds : 0.0, frames.in_place,
+                frames.copied_bytes, frames.timeouts, frames.evictions,
+                frames.partial_segments, frames.dropped_segments);
+        sar_reassembler_destroy(reassembler);
+    }
+
+    // Includes the misses of idle polling, so compare runs at full rate
+    if (state->llc_misses >= 0) {
+        uint64_t misses = perf_counter_read(state->llc_misses) - misses_start;
+        fprintf(stderr, "QPN %u: %lu LLC misses, %.2f per datagram\n", qpn, misses,
+                state->datagrams ? misses / (double) state->datagrams : 0.0);
+    }
+    perf_counter_close(state->llc_misses);
+
+    if (state->blocks) {
+        struct rdma_placement_stats placement;
+        rdma_get_placement_stats(endpoint, &placement);
+        fprintf(stderr, "QPN %u: %lu blocks, %lu datagrams in place, %lu copied, "
+                "%lu spilled, %lu dropped\n", qpn, placement.blocks, placement.in_place,
+                placement.copied, placement.spilled, placement.dropped);
+    }
+
+    if (rdma_nic_to_poll_histogram(endpoint)) {
+        char name[64];
+        snprintf(name, sizeof name, "QPN %u NIC-to-poll (%s)", qpn,
+                 rdma_hardware_timestamps(endpoint) ? "hardware" : "TSC bound");
+        latency_histogram_print(rdma_nic_to_poll_histogram(endpoint), stderr, name);
+
+        snprintf(name, sizeof name, "QPN %u poll-to-repost", qpn);
+        latency_histogram_print(rdma_poll_to_repost_histogram(endpoint), stderr, name);
+    }
+
+    return NULL;
+
+  fail:
+    perf_counter_close(state->llc_misses);
+    sar_reassembler_destroy(reassembler);
+    // Take the other receive threads down with us
+    state->result = EXIT_FAILURE;
+    server_loop = 0;
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
-    (void) argc;
-    (void) argv;
     const int completion_queue_size = 100;
-    struct recv_buffer *buffers;
+    int num_threads = 1;
+    int num_queues = 0;
+    enum rdma_group_mode mode = RDMA_GROUP_RSS;
+    int cpus[MAX_CPUS];
+    int num_cpus = 0;
+    size_t layout[MAX_SEGMENTS];
+    struct rdma_server_group *group = NULL;
+    const char *port = "18515";
+    // Wait for completion events after 1 ms without traffic by default
+    struct rdma_options options = {
+        .completion_channel = true,
+        .idle_usec = 1000,
+    };
+    bool records = false;
+    size_t frame_size = 0;
+    int transport, policy, opt;
 
     int result = EXIT_SUCCESS;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: rdma_server <IB driver>\n");
+    while ((opt = getopt(argc, argv, "t:q:s:i:TH:O:P:R:Zc:m:A:w:C:p:b:k:E:L:G:D:rF:")) != -1) {
+        switch (opt) {
+          case 't':
+            num_threads = atoi(optarg);
+            break;
+          case 'q':
+          case 's':
+            mode = opt == 's' ? RDMA_GROUP_SRQ : RDMA_GROUP_RSS;
+            num_queues = atoi(optarg);
+            if (num_queues < 1) num_threads = 0;
+            break;
+          case 'i':
+            options.idle_usec = atol(optarg);
+            break;
+          case 'T':
+            options.timestamps = true;
+            break;
+          case 'H':
+            options.hugepage_size = rdma_parse_size(optarg);
+            if (options.hugepage_size != (size_t) 2 << 20
+                && options.hugepage_size != (size_t) 1 << 30) {
+                num_threads = 0;
+            }
+            break;
+          case 'O':
+            options.on_demand_paging = true;
+            options.odp_prefetch = rdma_parse_size(optarg);
+            break;
+          case 'P':
+            options.init_threads = atoi(optarg);
+            break;
+          case 'R':
+            options.registration_chunks = atoi(optarg);
+            break;
+          case 'Z':
+            options.skip_zeroing = true;
+            break;
+          case 'm':
+            options.message_size = rdma_parse_size(optarg);
+            break;
+          case 'A':
+            options.stride_alignment = rdma_parse_size(optarg);
+            break;
+          case 'w':
+            options.recv_low_watermark = atoi(optarg);
+            break;
+          case 'C':
+            transport = rdma_parse_transport(optarg);
+            if (transport < 0) num_threads = 0;
+            else options.transport = transport;
+            break;
+          case 'p':
+            port = optarg;
+            break;
+          case 'b':
+            options.block_packets = atoi(optarg);
+            break;
+          case 'k':
+            options.placement_blocks = atoi(optarg);
+            break;
+          case 'L':
+            options.scatter_layout = layout;
+            options.scatter_segments = parse_layout(optarg, layout, MAX_SEGMENTS);
+            if (options.scatter_segments < 1) num_threads = 0;
+            break;
+          case 'G':
+            policy = rdma_parse_header_policy(optarg);
+            if (policy < 0) num_threads = 0;
+            else options.header_policy = policy;
+            break;
+          case 'D':
+            options.recycle_budget = rdma_parse_size(optarg);
+            break;
+          case 'r':
+            records = true;
+            break;
+          case 'F':
+            frame_size = rdma_parse_size(optarg);
+            if (!frame_size || frame_size > UINT32_MAX) num_threads = 0;
+            break;
+          case 'E':
+            options.sequence_in_payload = true;
+            options.sequence_offset = rdma_parse_size(optarg);
+            break;
+          case 'c':
+            num_cpus = parse_cpu_list(optarg, cpus, MAX_CPUS);
+            if (num_cpus < 1) num_threads = 0;
+            break;
+          default:
+            num_threads = 0;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || num_threads < 1) {
+        fprintf(stderr, "Usage: rdma_server [options] <IB driver>\n"
+                "  -t <threads>  independent endpoints, one receive thread each\n"
+                "  -q <queues>   receive queues spread by RSS, or one QP each\n"
+                "  -s <QPs>      queue pairs sharing a single SRQ buffer pool\n"
+                "  -i <usec>     idle time before waiting for completion events\n"
+                "  -T            timestamp completions and report latencies\n"
+                "  -H <2M|1G>    back the circular buffers with hugepages\n"
+                "  -O <bytes>    On-Demand Paging, prefetching this much per buffer\n"
+                "  -P <threads>  fault in and register buffers with this many threads\n"
+                "  -R <MRs>      register every buffer as this many memory regions\n"
+                "  -Z            fault in buffers without zeroing them\n"
+                "  -m <bytes>    message size, at most the port MTU for UD (default: MTU)\n"
+                "  -A <bytes>    pad buffer slots to a multiple of this (default: 64)\n"
+                "  -w <WRs>      repost buffers once this few receives remain posted\n"
+                "                (default: half the receive queue)\n"
+                "  -c <CPUs>     CPU list to pin the receive threads to, e.g., 0-3,8\n"
+                "                (default: the CPUs of the device's NUMA node)\n"
+                "  -C <ud|rc|uc> transport, clients of RC/UC write into the buffers\n"
+                "  -p <port>     TCP port RC/UC clients connect to (default: 18515)\n"
+                "  -b <packets>  place datagrams by sequence number in blocks this long\n"
+                "  -k <blocks>   block buffers to place into (default: 4)\n"
+                "  -E <offset>   64-bit sequence number at this payload offset\n"
+                "                (default: the immediate data)\n"
+                "  -L <bytes,..> scatter every payload over arrays of these sizes\n"
+                "  -G <keep|discard|compact>\n"
+                "                GRHs to keep: all, none, or the source GID and QPN\n"
+                "  -D <bytes>    repost the latest released buffers first, keeping at\n"
+                "                most this much posted, e.g., the DDIO share of the LLC\n"
+                "  -r            count the records of datagrams from rdma_client -r\n"
+                "  -F <bytes>    reassemble frames of up to this size from rdma_client -F\n");
         return EXIT_FAILURE;
     }
 
+    char *dev_name = argv[optind];
+
     struct sigaction handler;
     memset(&handler, 0, sizeof handler);
     handler.sa_handler = &stop_loop;
@@ -69,61 +523,118 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // ibverbs initialisation and allocate circular buffer to read from
-    buffers = rdma_init_server(argv[1], completion_queue_size);
+    if (num_queues) num_threads = num_queues;
 
-    // Fill completion queue with Receive Requests for each buffer
-    if (post_recvs(0, completion_queue_size)) {
-        fprintf(stderr, "Couldn't post receives\n");
-        result = EXIT_FAILURE;
-        goto cleanup;
+    struct receive_thread *threads = calloc(num_threads, sizeof *threads);
+    if (!threads) {
+        fprintf(stderr, "Couldn't allocate receive threads.\n");
+        return EXIT_FAILURE;
     }
 
-    struct ibv_wc wc[10];
-    while (server_loop) {
-        // Poll for completed Receive Requests
-        int ne = ibv_poll_cq(completion_queue, 10, wc);
-        if (ne < 0) {
-            fprintf(stderr, "poll CQ failed %d\n", ne);
+    // In multi-queue mode all receive queues are created on one device as a
+    // server group, the NIC spreads incoming traffic over them if it
+    // supports RSS. In SRQ mode the queue pairs share a single buffer pool
+    // of completion_queue_size entries, which the group posts itself.
+    if (num_queues) {
+        group = rdma_init_server_group(dev_name, completion_queue_size, num_queues, mode, &options);
+        if (!group) {
             result = EXIT_FAILURE;
             goto cleanup;
-        } else if (ne == 0) {
-            // If no requests are completed, sleep for 1 second to avoid
-            // pinning the CPU at 100% utilisation
-            struct timespec sleep_time;
-            sleep_time.tv_sec = 1;
-            sleep_time.tv_nsec = 0;
-            nanosleep(&sleep_time, NULL);
-        } else {
-            fprintf(stderr, "received %d messages\n", ne);
-        }
-
-        // Check the result status for each completed Receive Request
-        for (int i = 0; i < ne; ++i) {
-            printf("Message for WR #%ld: index #%d size: %d bytes\n", wc[i].wr_id, buffers[wc[i].wr_id].data_buffer[0], wc[i].byte_len);
-
-            if (wc[i].status != IBV_WC_SUCCESS) {
-                fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                        ibv_wc_status_str(wc[i].status),
-                        wc[i].status, (int) wc[i].wr_id);
-                result = EXIT_FAILURE;
-                goto cleanup;
-            }
         }
+    }
 
-        // If there were completed requests, requeue the Receive Requests.
-        if (ne > 0) {
-            if (post_recvs(wc[0].wr_id, ne)) {
-                fprintf(stderr, "Couldn't post receives\n");
-                result = EXIT_FAILURE;
-                goto cleanup;
-            }
+    // ibverbs initialisation and allocate a circular buffer to read from for
+    // every receive thread, each thread gets its own endpoint.
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].completion_queue_size = completion_queue_size;
+        threads[i].records = records;
+        threads[i].frame_size = frame_size;
+        if (group) {
+            threads[i].endpoint = rdma_server_group_endpoint(group, i);
+            threads[i].prefilled = mode == RDMA_GROUP_SRQ;
+            continue;
+        }
+
+        threads[i].endpoint = rdma_init_server(dev_name, completion_queue_size, &options);
+        if (!threads[i].endpoint) {
+            result = EXIT_FAILURE;
+            goto cleanup;
+        }
+        threads[i].blocks = options.block_packets > 0;
+    }
+
+    // Without an explicit CPU list, poll from the CPUs on the NUMA node of
+    // the device, where the circular buffers were allocated too. Fall back
+    // to all CPUs if the node is unknown.
+    int device_node = rdma_numa_node(threads[0].endpoint);
+    if (!num_cpus && device_node >= 0) {
+        num_cpus = numa_node_cpus(device_node, cpus, MAX_CPUS);
+    }
+    if (!num_cpus) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (; num_cpus < online && num_cpus < MAX_CPUS; num_cpus++) {
+            cpus[num_cpus] = num_cpus;
         }
     }
 
+    for (int i = 0; i < num_threads; i++) {
+        struct rdma_alloc_stats alloc;
+        rdma_get_alloc_stats(threads[i].endpoint, &alloc);
+
+        threads[i].cpu = cpus[i % num_cpus];
+        fprintf(stderr, "QPN %u: device on NUMA node %d, buffers on node %d, "
+                "polling on CPU %d\n", rdma_queue_pair_number(threads[i].endpoint),
+                device_node, alloc.numa_node, threads[i].cpu);
+        fprintf(stderr, "QPN %u: %.1f MiB in %d memory regions by %d threads, "
+                "%.3f ms allocating, %.3f ms touching, %.3f ms registering\n",
+                rdma_queue_pair_number(threads[i].endpoint),
+                alloc.bytes / (double) (1 << 20), alloc.num_mrs, alloc.threads,
+                alloc.alloc_ns / 1e6, alloc.touch_ns / 1e6, alloc.register_ns / 1e6);
+    }
+
+    // Connected endpoints accept one client each, in turn, and post their
+    // receives before the client starts writing.
+    for (int i = 0; options.transport != RDMA_TRANSPORT_UD && i < num_threads; i++) {
+        if (rdma_accept(threads[i].endpoint, port)) {
+            result = EXIT_FAILURE;
+            goto cleanup;
+        }
+        threads[i].prefilled = true;
+    }
+
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started].thread, NULL, receive_loop, &threads[started])) {
+            fprintf(stderr, "Couldn't start receive thread.\n");
+            server_loop = 0;
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    // Handle asynchronous device events, such as the SRQ reaching its low
+    // watermark, while the receive threads run.
+    while (group && server_loop) {
+        if (rdma_server_group_handle_events(group, 100)) {
+            server_loop = 0;
+            result = EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].result != EXIT_SUCCESS) result = threads[i].result;
+    }
+
   cleanup:
-    free(buffers);
-    rdma_cleanup();
+    if (group) {
+        rdma_server_group_cleanup(group);
+    } else {
+        for (int i = 0; i < num_threads; i++) {
+            if (threads[i].endpoint) rdma_cleanup(threads[i].endpoint);
+        }
+    }
+    free(threads);
 
     return result;
 }
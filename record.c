@@ -0,0 +1,138 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "record.h"
+#include "tsc.h"
+
+struct record_coalescer {
+    struct send_pipeline *pipeline;
+    size_t datagram_size;
+    uint64_t deadline_cycles;
+
+    // Open slot, -1 if none, the bytes filled, and the TSC time at which
+    // it has to be committed
+    int slot;
+    char *buffer;
+    size_t filled;
+    uint64_t deadline;
+
+    atomic_uint_fast64_t records;
+    atomic_uint_fast64_t packets;
+    atomic_uint_fast64_t deadline_flushes;
+};
+
+struct record_coalescer *
+record_coalescer_create
+(struct send_pipeline *pipeline, size_t datagram_size, uint64_t deadline_ns)
+{
+    if (datagram_size <= sizeof (struct record_header)) {
+        fprintf(stderr, "Datagrams of %zu bytes can't hold a record\n", datagram_size);
+        return NULL;
+    }
+
+    struct record_coalescer *coalescer = calloc(1, sizeof *coalescer);
+    if (!coalescer) {
+        fprintf(stderr, "Couldn't allocate record coalescer.\n");
+        return NULL;
+    }
+
+    tsc_calibrate();
+    coalescer->pipeline = pipeline;
+    coalescer->datagram_size = datagram_size;
+    coalescer->deadline_cycles = ns_to_tsc(deadline_ns);
+    coalescer->slot = -1;
+    atomic_init(&coalescer->records, 0);
+    atomic_init(&coalescer->packets, 0);
+    atomic_init(&coalescer->deadline_flushes, 0);
+
+    return coalescer;
+}
+
+void
+record_coalescer_flush(struct record_coalescer *coalescer)
+{
+    if (coalescer->slot < 0) return;
+
+    send_pipeline_commit_length(coalescer->pipeline, coalescer->slot, coalescer->filled);
+    coalescer->slot = -1;
+    atomic_fetch_add_explicit(&coalescer->packets, 1, memory_order_relaxed);
+}
+
+void *
+record_reserve(struct record_coalescer *coalescer, size_t length)
+{
+    // The last record of a datagram goes without padding
+    size_t size = sizeof (struct record_header) + length;
+    if (!length || size > coalescer->datagram_size) return NULL;
+
+    if (coalescer->slot >= 0 && coalescer->filled + size > coalescer->datagram_size) {
+        record_coalescer_flush(coalescer);
+    }
+
+    if (coalescer->slot < 0) {
+        coalescer->slot = send_pipeline_acquire(coalescer->pipeline);
+        if (coalescer->slot < 0) return NULL;
+
+        coalescer->buffer = send_pipeline_buffer(coalescer->pipeline, coalescer->slot);
+        coalescer->filled = 0;
+        coalescer->deadline = tsc_read() + coalescer->deadline_cycles;
+    }
+
+    struct record_header header = { .length = length };
+    char *record = coalescer->buffer + coalescer->filled;
+    memcpy(record, &header, sizeof header);
+    coalescer->filled += record_footprint(length);
+    if (coalescer->filled > coalescer->datagram_size) {
+        coalescer->filled = coalescer->datagram_size;
+    }
+    atomic_fetch_add_explicit(&coalescer->records, 1, memory_order_relaxed);
+
+    return record + sizeof header;
+}
+
+int
+record_append(struct record_coalescer *coalescer, const void *record, size_t length)
+{
+    if (!length || sizeof (struct record_header) + length > coalescer->datagram_size) {
+        return -1;
+    }
+
+    void *data = record_reserve(coalescer, length);
+    if (!data) return 1;
+
+    memcpy(data, record, length);
+    return 0;
+}
+
+int
+record_coalescer_poll(struct record_coalescer *coalescer)
+{
+    if (coalescer->slot < 0 || tsc_read() < coalescer->deadline) return 0;
+
+    record_coalescer_flush(coalescer);
+    atomic_fetch_add_explicit(&coalescer->deadline_flushes, 1, memory_order_relaxed);
+    return 1;
+}
+
+void
+record_coalescer_get_stats(struct record_coalescer *coalescer, struct record_stats *stats)
+{
+    stats->records = atomic_load_explicit(&coalescer->records, memory_order_relaxed);
+    stats->packets = atomic_load_explicit(&coalescer->packets, memory_order_relaxed);
+    stats->deadline_flushes =
+        atomic_load_explicit(&coalescer->deadline_flushes, memory_order_relaxed);
+}
+
+void
+record_coalescer_destroy(struct record_coalescer *coalescer)
+{
+    if (!coalescer) return;
+
+    record_coalescer_flush(coalescer);
+    free(coalescer);
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "send_pipeline.h"
+
+// Coalescing of small records into datagrams. A producer appends records to
+// an open send slot of a send pipeline, each behind a record_header and
+// padded to RECORD_ALIGNMENT, and the slot is committed, with just the bytes
+// filled, once the next record doesn't fit or the oldest record in it waited
+// for the deadline. The receiver walks the records of a datagram in place
+// with a record_iterator.
+#define RECORD_ALIGNMENT 4
+
+struct record_header {
+    // Bytes of record data following the header, excluding padding
+    uint32_t length;
+};
+
+struct record_coalescer;
+
+struct record_stats {
+    uint64_t records;
+    // Datagrams committed, and how many of them were flushed by the deadline
+    uint64_t packets;
+    uint64_t deadline_flushes;
+};
+
+// Space a record of 'length' bytes takes in a datagram, unless it's the last
+static inline size_t
+record_footprint(size_t length)
+{
+    size_t size = sizeof (struct record_header) + length;
+    return (size + RECORD_ALIGNMENT - 1) & ~(size_t) (RECORD_ALIGNMENT - 1);
+}
+
+// Coalescer for a single producer thread, with its own open slot of
+// 'pipeline', filling datagrams of up to 'datagram_size' bytes, at most the
+// message size of the endpoint. A partly filled datagram is committed
+// 'deadline_ns' nanoseconds after its first record, as checked by
+// record_coalescer_poll(). Returns NULL on failure.
+struct record_coalescer *
+record_coalescer_create
+(struct send_pipeline *pipeline, size_t datagram_size, uint64_t deadline_ns);
+
+// Reserve room for a record of 'length' bytes, to be written in place,
+// committing the open datagram first if the record doesn't fit in it.
+// Returns NULL if no send slot is free, or if the record is larger than a
+// datagram can hold.
+void *
+record_reserve(struct record_coalescer *coalescer, size_t length);
+
+// Copy a record into the open datagram. Returns 0 on success, 1 if no send
+// slot is free, and -1 if the record can never fit in a datagram.
+int
+record_append(struct record_coalescer *coalescer, const void *record, size_t length);
+
+// Commit the open datagram if its deadline passed. Returns 1 if it did.
+int
+record_coalescer_poll(struct record_coalescer *coalescer);
+
+// Commit the open datagram, if it holds any records
+void
+record_coalescer_flush(struct record_coalescer *coalescer);
+
+// Safe to call from any thread
+void
+record_coalescer_get_stats(struct record_coalescer *coalescer, struct record_stats *stats);
+
+// Commits the open datagram before releasing the coalescer, so it has to be
+// destroyed before the pipeline is stopped
+void
+record_coalescer_destroy(struct record_coalescer *coalescer);
+
+// Iterator over the records of a received datagram, the records are handed
+// out in place, without copying.
+struct record_iterator {
+    const char *next;
+    const char *end;
+};
+
+static inline void
+record_iterator_init(struct record_iterator *iterator, const char *data, size_t length)
+{
+    iterator->next = data;
+    iterator->end = data + length;
+}
+
+// Next record and its length, NULL after the last one or if the rest of the
+// datagram is malformed.
+static inline const char *
+record_next(struct record_iterator *iterator, uint32_t *length)
+{
+    const char *next = iterator->next;
+    if ((size_t) (iterator->end - next) < sizeof (struct record_header)) return NULL;
+
+    struct record_header header;
+    memcpy(&header, next, sizeof header);
+    size_t remaining = iterator->end - next - sizeof header;
+    if (!header.length || header.length > remaining) return NULL;
+
+    size_t footprint = record_footprint(header.length);
+    iterator->next = footprint - sizeof header < remaining ? next + footprint : iterator->end;
+    *length = header.length;
+    return next + sizeof header;
+}
+#endif
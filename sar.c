@@ -0,0 +1,258 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sar.h"
+#include "tsc.h"
+
+enum context_state {
+    CONTEXT_FREE,
+    CONTEXT_ASSEMBLING,
+    CONTEXT_DELIVERED
+};
+
+struct sar_context {
+    enum context_state state;
+    uint32_t message;
+    uint32_t length;
+    // Bytes and segments received so far, UD doesn't duplicate datagrams so
+    // the message is complete once every byte arrived
+    uint32_t received;
+    uint32_t segments;
+    // TSC time at which the message is dropped, the oldest message has the
+    // earliest deadline
+    uint64_t deadline;
+    char *buffer;
+};
+
+struct sar_reassembler {
+    size_t max_length;
+    int num_contexts;
+    uint64_t timeout_cycles;
+    struct sar_context *contexts;
+    struct sar_stats stats;
+};
+
+int
+sar_send
+( struct send_pipeline *pipeline
+, size_t datagram_size
+, uint32_t id
+, const void *data
+, size_t length
+, size_t *offset
+)
+{
+    if (datagram_size <= sizeof (struct sar_header)) {
+        fprintf(stderr, "Datagrams of %zu bytes can't hold a segment\n", datagram_size);
+        return -1;
+    }
+    if (length > UINT32_MAX) {
+        fprintf(stderr, "Messages of %zu bytes are too long to segment\n", length);
+        return -1;
+    }
+
+    size_t segment_size = datagram_size - sizeof (struct sar_header);
+
+    while (*offset < length) {
+        int slot = send_pipeline_acquire(pipeline);
+        if (slot < 0) return 0;
+
+        size_t segment = length - *offset < segment_size ? length - *offset : segment_size;
+        struct sar_header header = { .message = id, .offset = *offset, .length = length };
+        char *buffer = send_pipeline_buffer(pipeline, slot);
+
+        memcpy(buffer, &header, sizeof header);
+        memcpy(buffer + sizeof header, (const char *) data + *offset, segment);
+        send_pipeline_commit_length(pipeline, slot, sizeof header + segment);
+        *offset += segment;
+    }
+
+    return 1;
+}
+
+struct sar_reassembler *
+sar_reassembler_create(size_t max_length, int contexts, uint64_t timeout_ns)
+{
+    struct sar_reassembler *reassembler = calloc(1, sizeof *reassembler);
+    if (!reassembler) goto fail;
+
+    tsc_calibrate();
+    reassembler->max_length = max_length;
+    reassembler->num_contexts = contexts;
+    reassembler->timeout_cycles = ns_to_tsc(timeout_ns);
+    reassembler->contexts = calloc(contexts, sizeof *reassembler->contexts);
+    if (!reassembler->contexts) goto clean_reassembler;
+
+    for (int i = 0; i < contexts; i++) {
+        reassembler->contexts[i].buffer = malloc(max_length);
+        if (!reassembler->contexts[i].buffer) goto clean_contexts;
+    }
+
+    return reassembler;
+
+  clean_contexts:
+    for (int i = 0; i < contexts; i++) free(reassembler->contexts[i].buffer);
+    free(reassembler->contexts);
+  clean_reassembler:
+    free(reassembler);
+  fail:
+    fprintf(stderr, "Couldn't allocate reassembler.\n");
+    return NULL;
+}
+
+static void
+drop_partial(struct sar_reassembler *reassembler, struct sar_context *context)
+{
+    reassembler->stats.partial_segments += context->segments;
+    context->state = CONTEXT_FREE;
+}
+
+int
+sar_expire(struct sar_reassembler *reassembler)
+{
+    uint64_t now = tsc_read();
+    int expired = 0;
+
+    for (int i = 0; i < reassembler->num_contexts; i++) {
+        struct sar_context *context = &reassembler->contexts[i];
+        if (context->state == CONTEXT_ASSEMBLING && now >= context->deadline) {
+            drop_partial(reassembler, context);
+            expired++;
+        }
+    }
+
+    reassembler->stats.timeouts += expired;
+    return expired;
+}
+
+// Context assembling message 'id', or a context to start it in: a free one,
+// or else the one of the oldest incomplete message. NULL if every context
+// holds a delivered message.
+static struct sar_context *
+find_context(struct sar_reassembler *reassembler, uint32_t id)
+{
+    struct sar_context *free_context = NULL, *oldest = NULL;
+
+    for (int i = 0; i < reassembler->num_contexts; i++) {
+        struct sar_context *context = &reassembler->contexts[i];
+        switch (context->state) {
+          case CONTEXT_ASSEMBLING:
+            if (context->message == id) return context;
+            if (!oldest || context->deadline < oldest->deadline) oldest = context;
+            break;
+          case CONTEXT_FREE:
+            if (!free_context) free_context = context;
+            break;
+          case CONTEXT_DELIVERED:
+            break;
+        }
+    }
+
+    if (free_context || !oldest) return free_context;
+
+    reassembler->stats.evictions++;
+    drop_partial(reassembler, oldest);
+    return oldest;
+}
+
+int
+sar_receive
+( struct sar_reassembler *reassembler
+, struct rdma_endpoint *endpoint
+, const struct rdma_lease *lease
+, struct sar_message *message
+)
+{
+    struct sar_header header;
+    if (lease->byte_len < sizeof header) goto drop;
+    memcpy(&header, lease->data_buffer, sizeof header);
+
+    uint32_t segment = lease->byte_len - sizeof header;
+    if (header.length > reassembler->max_length || header.offset > header.length
+        || segment > header.length - header.offset) {
+        goto drop;
+    }
+
+    reassembler->stats.segments++;
+
+    // The whole message in one segment, hand out the lease
+    if (segment == header.length) {
+        *message = (struct sar_message) {
+            .id = header.message,
+            .data = lease->data_buffer + sizeof header,
+            .length = header.length,
+            .context = -1,
+            .lease = *lease,
+        };
+        reassembler->stats.messages++;
+        reassembler->stats.in_place++;
+        return 1;
+    }
+
+    struct sar_context *context = find_context(reassembler, header.message);
+    if (!context) goto drop;
+
+    if (context->state == CONTEXT_FREE) {
+        context->state = CONTEXT_ASSEMBLING;
+        context->message = header.message;
+        context->length = header.length;
+        context->received = 0;
+        context->segments = 0;
+        context->deadline = tsc_read() + reassembler->timeout_cycles;
+    }
+
+    memcpy(context->buffer + header.offset, lease->data_buffer + sizeof header, segment);
+    rdma_lease_release(endpoint, lease);
+    context->received += segment;
+    context->segments++;
+    reassembler->stats.copied_bytes += segment;
+
+    if (context->received < context->length) return 0;
+
+    context->state = CONTEXT_DELIVERED;
+    *message = (struct sar_message) {
+        .id = context->message,
+        .data = context->buffer,
+        .length = context->length,
+        .context = context - reassembler->contexts,
+    };
+    reassembler->stats.messages++;
+    return 1;
+
+  drop:
+    reassembler->stats.dropped_segments++;
+    rdma_lease_release(endpoint, lease);
+    return 0;
+}
+
+void
+sar_message_release
+( struct sar_reassembler *reassembler
+, struct rdma_endpoint *endpoint
+, const struct sar_message *message
+)
+{
+    if (message->context < 0) rdma_lease_release(endpoint, &message->lease);
+    else reassembler->contexts[message->context].state = CONTEXT_FREE;
+}
+
+void
+sar_get_stats(const struct sar_reassembler *reassembler, struct sar_stats *stats)
+{
+    *stats = reassembler->stats;
+}
+
+void
+sar_reassembler_destroy(struct sar_reassembler *reassembler)
+{
+    if (!reassembler) return;
+
+    for (int i = 0; i < reassembler->num_contexts; i++) free(reassembler->contexts[i].buffer);
+    free(reassembler->contexts);
+    free(reassembler);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef SAR_H
+#define SAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rdma.h"
+#include "send_pipeline.h"
+
+// Segmentation and reassembly of messages larger than a datagram. The
+// sender splits a message over consecutive send slots, each segment behind a
+// sar_header saying where it goes, and the receiver copies the segments of a
+// message into a contiguous destination buffer. Messages that fit in a
+// single segment are handed out in place, without copying.
+struct sar_header {
+    // Chosen by the sender, unique among the messages in flight
+    uint32_t message;
+    // Byte offset of the segment in the message, and the message length
+    uint32_t offset;
+    uint32_t length;
+};
+
+// Send the segments of message 'id' of 'length' bytes at 'data', starting at
+// byte '*offset', as long as 'pipeline' has free send slots, advancing
+// '*offset' past them. Segments carry up to 'datagram_size' bytes, header
+// included. Returns 1 once the message is sent, 0 if it needs more send
+// slots, and -1 if datagrams can't hold a segment or the message is longer
+// than a sar_header can describe.
+int
+sar_send
+( struct send_pipeline *pipeline
+, size_t datagram_size
+, uint32_t id
+, const void *data
+, size_t length
+, size_t *offset
+);
+
+struct sar_reassembler;
+
+// Reassembled message, valid until it is handed back with
+// sar_message_release()
+struct sar_message {
+    uint32_t id;
+    const char *data;
+    size_t length;
+    // Context, or -1 for a message handed out in place in its lease
+    int context;
+    struct rdma_lease lease;
+};
+
+struct sar_stats {
+    uint64_t messages;
+    uint64_t segments;
+    // Single segment messages handed out in place, and bytes copied to
+    // reassemble the others
+    uint64_t in_place;
+    uint64_t copied_bytes;
+    // Incomplete messages dropped when they timed out, or when their
+    // context was needed for a newer message, and the segments lost with
+    // them
+    uint64_t timeouts;
+    uint64_t evictions;
+    uint64_t partial_segments;
+    // Malformed segments, too large messages, and segments arriving while
+    // every context holds a message not yet released
+    uint64_t dropped_segments;
+};
+
+// Reassembler with 'contexts' messages of up to 'max_length' bytes in
+// flight. Messages still incomplete 'timeout_ns' nanoseconds after their
+// first segment are dropped. Returns NULL on failure.
+struct sar_reassembler *
+sar_reassembler_create(size_t max_length, int contexts, uint64_t timeout_ns);
+
+// Take over a received lease. Returns 1 and fills in 'message' if this
+// completed a message, 0 if the message needs more segments or the segment
+// was dropped.
+int
+sar_receive
+( struct sar_reassembler *reassembler
+, struct rdma_endpoint *endpoint
+, const struct rdma_lease *lease
+, struct sar_message *message
+);
+
+// Hand a message back, freeing its context or lease
+void
+sar_message_release
+( struct sar_reassembler *reassembler
+, struct rdma_endpoint *endpoint
+, const struct sar_message *message
+);
+
+// Drop the incomplete messages that timed out, call this while idle too.
+// Returns the number dropped.
+int
+sar_expire(struct sar_reassembler *reassembler);
+
+void
+sar_get_stats(const struct sar_reassembler *reassembler, struct sar_stats *stats);
+
+void
+sar_reassembler_destroy(struct sar_reassembler *reassembler);
+#endif
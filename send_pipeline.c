@@ -0,0 +1,275 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send_pipeline.h"
+
+struct send_pipeline {
+    struct rdma_endpoint *endpoint;
+    struct pacer *pacer;
+    struct send_buffer *buffers;
+    int queue_size;
+    int cpu;
+    pthread_t thread;
+    atomic_bool running;
+    int result;
+
+    // Free slots, a stack only the transport thread pushes onto. Any number
+    // of producers pop from it, so the head packs a generation count above
+    // the slot index, a producer that read the head before another producer
+    // popped and the transport pushed back the same slot (ABA) fails its
+    // compare-and-swap. Slots are linked through 'free_next', -1 terminated.
+    _Atomic uint64_t free_head;
+    atomic_int *free_next;
+
+    // Committed slots, a stack producers push onto and the transport thread
+    // takes as a whole, linked through 'committed_next', -1 terminated.
+    atomic_int committed_head;
+    int *committed_next;
+    // Bytes to send of every committed slot, 0 for the whole message
+    size_t *committed_length;
+
+    // Slots taken off the committed stack, in commit order, the first
+    // 'pending' of which the pacer held back so far
+    int *batch;
+    int pending;
+
+    atomic_uint_fast64_t messages;
+    atomic_uint_fast64_t chains;
+    atomic_uint_fast64_t idle_polls;
+};
+
+static inline int
+stack_slot(uint64_t head)
+{
+    return (int32_t) (uint32_t) head;
+}
+
+static inline uint64_t
+stack_head(uint64_t generation, int slot)
+{
+    return generation << 32 | (uint32_t) slot;
+}
+
+static void
+free_push(struct send_pipeline *pipeline, int slot)
+{
+    uint64_t head = atomic_load_explicit(&pipeline->free_head, memory_order_relaxed);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&pipeline->free_next[slot], stack_slot(head), memory_order_relaxed);
+        next = stack_head((head >> 32) + 1, slot);
+    } while (!atomic_compare_exchange_weak_explicit(&pipeline->free_head, &head, next,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+int
+send_pipeline_acquire(struct send_pipeline *pipeline)
+{
+    uint64_t head = atomic_load_explicit(&pipeline->free_head, memory_order_acquire);
+    uint64_t next;
+    do {
+        int slot = stack_slot(head);
+        if (slot < 0) return -1;
+
+        int following = atomic_load_explicit(&pipeline->free_next[slot], memory_order_relaxed);
+        next = stack_head((head >> 32) + 1, following);
+    } while (!atomic_compare_exchange_weak_explicit(&pipeline->free_head, &head, next,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+
+    return stack_slot(head);
+}
+
+char *
+send_pipeline_buffer(struct send_pipeline *pipeline, int slot)
+{
+    return pipeline->buffers[slot].data_buffer;
+}
+
+void
+send_pipeline_commit(struct send_pipeline *pipeline, int slot)
+{
+    send_pipeline_commit_length(pipeline, slot, 0);
+}
+
+void
+send_pipeline_commit_length(struct send_pipeline *pipeline, int slot, size_t length)
+{
+    pipeline->committed_length[slot] = length;
+
+    int head = atomic_load_explicit(&pipeline->committed_head, memory_order_relaxed);
+    do {
+        pipeline->committed_next[slot] = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pipeline->committed_head, &head, slot,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Take all committed slots into 'batch', after the pending ones. The stack
+// holds the latest commit first, so the batch is filled back to front.
+// Returns the number of slots taken.
+static int
+take_committed(struct send_pipeline *pipeline)
+{
+    int slot = atomic_exchange_explicit(&pipeline->committed_head, -1, memory_order_acquire);
+    int *batch = &pipeline->batch[pipeline->pending];
+    int count = 0;
+
+    for (int i = slot; i >= 0; i = pipeline->committed_next[i]) count++;
+    for (int i = count - 1; i >= 0; i--) {
+        batch[i] = slot;
+        slot = pipeline->committed_next[slot];
+    }
+
+    return count;
+}
+
+// Transport thread: hand freed slots to the producers, post whatever was
+// committed, or as much as the pacer allows, in one chain, and reap
+// completions, until the pipeline is stopped. The iterations after the stop
+// post the final commits.
+static void *
+transport_loop(void *arg)
+{
+    struct send_pipeline *pipeline = arg;
+    struct rdma_endpoint *endpoint = pipeline->endpoint;
+
+    if (pipeline->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(pipeline->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus)) {
+            fprintf(stderr, "Couldn't pin transport thread to CPU %d\n", pipeline->cpu);
+        }
+    }
+
+    bool running;
+    do {
+        running = atomic_load_explicit(&pipeline->running, memory_order_acquire);
+
+        for (int slot; (slot = rdma_send_acquire(endpoint)) >= 0; ) {
+            free_push(pipeline, slot);
+        }
+
+        int taken = take_committed(pipeline);
+        for (int i = pipeline->pending; i < pipeline->pending + taken; i++) {
+            size_t length = pipeline->committed_length[pipeline->batch[i]];
+            if (length && rdma_send_set_length(endpoint, pipeline->batch[i], length)) goto fail;
+        }
+
+        int available = pipeline->pending + taken;
+        int count = pipeline->pacer ? pacer_take(pipeline->pacer, available) : available;
+        if (count) {
+            if (rdma_post_send_slots(endpoint, pipeline->batch, count)) goto fail;
+            atomic_fetch_add_explicit(&pipeline->messages, count, memory_order_relaxed);
+            atomic_fetch_add_explicit(&pipeline->chains, 1, memory_order_relaxed);
+        } else if (!available) {
+            atomic_fetch_add_explicit(&pipeline->idle_polls, 1, memory_order_relaxed);
+        }
+        pipeline->pending = available - count;
+        memmove(pipeline->batch, &pipeline->batch[count],
+                pipeline->pending * (sizeof *pipeline->batch));
+
+        int completed = rdma_reap_sends(endpoint);
+        if (completed < 0) goto fail;
+
+        // Give the producers the CPU when there's nothing to do, but spin
+        // while waiting for the pacer
+        if (!available && !completed) sched_yield();
+    } while (running || pipeline->pending);
+
+    return NULL;
+
+  fail:
+    fprintf(stderr, "Send pipeline transport failed\n");
+    pipeline->result = -1;
+    return NULL;
+}
+
+struct send_pipeline *
+send_pipeline_start(struct rdma_endpoint *endpoint, int cpu, struct pacer *pacer)
+{
+    struct send_pipeline *pipeline = calloc(1, sizeof *pipeline);
+    if (!pipeline) {
+        fprintf(stderr, "Couldn't allocate send pipeline.\n");
+        return NULL;
+    }
+
+    // Nothing is acquired or posted yet, so every slot is a credit
+    int queue_size = rdma_send_credits(endpoint);
+    pipeline->endpoint = endpoint;
+    pipeline->pacer = pacer;
+    pipeline->buffers = rdma_send_buffers(endpoint);
+    pipeline->queue_size = queue_size;
+    pipeline->cpu = cpu;
+    pipeline->free_next = calloc(queue_size, sizeof *pipeline->free_next);
+    pipeline->committed_next = malloc(queue_size * (sizeof *pipeline->committed_next));
+    pipeline->committed_length = malloc(queue_size * (sizeof *pipeline->committed_length));
+    pipeline->batch = malloc(queue_size * (sizeof *pipeline->batch));
+    if (!pipeline->free_next || !pipeline->committed_next || !pipeline->committed_length
+        || !pipeline->batch) {
+        fprintf(stderr, "Couldn't allocate send pipeline.\n");
+        goto clean_pipeline;
+    }
+
+    atomic_init(&pipeline->running, true);
+    atomic_init(&pipeline->free_head, stack_head(0, -1));
+    atomic_init(&pipeline->committed_head, -1);
+    atomic_init(&pipeline->messages, 0);
+    atomic_init(&pipeline->chains, 0);
+    atomic_init(&pipeline->idle_polls, 0);
+
+    // Fill the free stack before any producer shows up
+    for (int slot; (slot = rdma_send_acquire(endpoint)) >= 0; ) {
+        free_push(pipeline, slot);
+    }
+
+    if (pthread_create(&pipeline->thread, NULL, transport_loop, pipeline)) {
+        fprintf(stderr, "Couldn't start transport thread.\n");
+        goto clean_pipeline;
+    }
+
+    return pipeline;
+
+  clean_pipeline:
+    free(pipeline->free_next);
+    free(pipeline->committed_next);
+    free(pipeline->committed_length);
+    free(pipeline->batch);
+    free(pipeline);
+    return NULL;
+}
+
+void
+send_pipeline_get_stats(struct send_pipeline *pipeline, struct send_pipeline_stats *stats)
+{
+    stats->messages = atomic_load_explicit(&pipeline->messages, memory_order_relaxed);
+    stats->chains = atomic_load_explicit(&pipeline->chains, memory_order_relaxed);
+    stats->idle_polls = atomic_load_explicit(&pipeline->idle_polls, memory_order_relaxed);
+}
+
+int
+send_pipeline_stop(struct send_pipeline *pipeline)
+{
+    atomic_store_explicit(&pipeline->running, false, memory_order_release);
+    pthread_join(pipeline->thread, NULL);
+
+    int result = pipeline->result;
+    free(pipeline->free_next);
+    free(pipeline->committed_next);
+    free(pipeline->committed_length);
+    free(pipeline->batch);
+    free(pipeline);
+    return result;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef SEND_PIPELINE_H
+#define SEND_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pacer.h"
+#include "rdma.h"
+
+// Producer/transport split of the send path of an endpoint. Producer threads
+// acquire a free send slot, fill its data buffer, and commit it, while a
+// transport thread owns the endpoint: it posts the committed slots as chains
+// of Send Requests, one doorbell per chain, reaps the completions, and hands
+// the freed slots back to the producers. Slots are handed off through
+// lock-free stacks, so producers never wait on the NIC or on each other.
+struct send_pipeline;
+
+struct send_pipeline_stats {
+    // Messages posted, and the number of chains they were posted in
+    uint64_t messages;
+    uint64_t chains;
+    // Transport iterations that found no committed slot to post
+    uint64_t idle_polls;
+};
+
+// Start the transport thread of 'endpoint', pinned to 'cpu' unless it's
+// negative. From then on the endpoint belongs to the pipeline, it can only
+// be cleaned up after the pipeline is stopped. With a 'pacer' committed
+// slots are only posted as its tokens allow, the pacer belongs to the
+// transport thread until the pipeline is stopped. Returns NULL on failure.
+struct send_pipeline *
+send_pipeline_start(struct rdma_endpoint *endpoint, int cpu, struct pacer *pacer);
+
+// Acquire a free send slot to fill, -1 if none is free. Safe to call from any
+// thread.
+int
+send_pipeline_acquire(struct send_pipeline *pipeline);
+
+// Data buffer of an acquired slot, rdma_message_size() bytes long
+char *
+send_pipeline_buffer(struct send_pipeline *pipeline, int slot);
+
+// Commit a filled slot for posting. Safe to call from any thread, the slots
+// committed by one thread are posted in the order they were committed.
+void
+send_pipeline_commit(struct send_pipeline *pipeline, int slot);
+
+// Commit a slot filled with only 'length' bytes, which is all that is sent
+void
+send_pipeline_commit_length(struct send_pipeline *pipeline, int slot, size_t length);
+
+void
+send_pipeline_get_stats(struct send_pipeline *pipeline, struct send_pipeline_stats *stats);
+
+// Stop the transport thread once it posted every committed slot, and
+// release the pipeline. Producers have to stop committing first. Returns -1
+// if the transport thread failed.
+int
+send_pipeline_stop(struct send_pipeline *pipeline);
+#endif
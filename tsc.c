@@ -0,0 +1,56 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+
+#include "tsc.h"
+
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+static uint64_t base_cycles = 0;
+static double ns_per_cycle = 1.0;
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Count TSC cycles over a 20 ms sleep to find the TSC frequency
+static void
+calibrate(void)
+{
+    struct timespec sleep_time = { .tv_sec = 0, .tv_nsec = 20000000 };
+
+    uint64_t start_ns = monotonic_ns();
+    uint64_t start_cycles = tsc_read();
+    nanosleep(&sleep_time, NULL);
+    uint64_t end_ns = monotonic_ns();
+    uint64_t end_cycles = tsc_read();
+
+    if (end_cycles > start_cycles) {
+        ns_per_cycle = (double) (end_ns - start_ns) / (end_cycles - start_cycles);
+    }
+    base_cycles = start_cycles;
+}
+
+void
+tsc_calibrate(void)
+{
+    pthread_once(&calibrated, calibrate);
+}
+
+uint64_t
+tsc_to_ns(uint64_t cycles)
+{
+    return (uint64_t) ((cycles - base_cycles) * ns_per_cycle);
+}
+
+uint64_t
+ns_to_tsc(uint64_t ns)
+{
+    return (uint64_t) (ns / ns_per_cycle);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2021 Netherlands eScience Center and ASTRON.
+ * Licensed under the Apache License, version 2.0. See LICENSE for details.
+ */
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Cheap timestamps from the CPU's time stamp counter, calibrated against
+// CLOCK_MONOTONIC. On architectures without a TSC the "cycles" are
+// nanoseconds of CLOCK_MONOTONIC.
+
+// Calibrate the TSC frequency. Safe to call from multiple threads, only the
+// first call does the (~20 ms) calibration.
+void tsc_calibrate(void);
+
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t ns_to_tsc(uint64_t ns);
+
+static inline uint64_t
+tsc_read(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+// Nanoseconds since calibration
+static inline uint64_t
+tsc_ns(void)
+{
+    return tsc_to_ns(tsc_read());
+}
+#endif